@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "crossplatform/stdnoreturn.h"
+#include "arena.h"
+
+#define ARENA_BLOCK (64 * 1024)
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t size;
+    max_align_t data[];
+};
+
+static _Noreturn void arena_oom(void)
+{
+    puts("Out of memory in arena");
+    abort();
+}
+
+static ArenaBlock* create_block(size_t size)
+{
+    ArenaBlock* ret = malloc(sizeof(ArenaBlock) + size);
+    if (!ret) arena_oom();
+    ret->next = NULL;
+    ret->size = size;
+
+    return ret;
+}
+
+void init_arena(Arena* A)
+{
+    A->blocks = NULL;
+    A->ptr = NULL;
+    A->end = NULL;
+}
+
+// size is already aligned
+void* arena_alloc_slow(Arena* A, size_t size)
+{
+    if (size > ARENA_BLOCK / 4) { // Gets a block of its own behind the current one
+        ArenaBlock* block = create_block(size);
+        if (A->blocks) {
+            block->next = A->blocks->next;
+            A->blocks->next = block;
+        } else {
+            block->next = NULL;
+            A->blocks = block;
+        }
+        return block->data;
+    }
+
+    ArenaBlock* block = create_block(ARENA_BLOCK);
+    block->next = A->blocks;
+    A->blocks = block;
+    A->ptr = (char*) block->data + size;
+    A->end = (char*) block->data + ARENA_BLOCK;
+
+    return block->data;
+}
+
+char* arena_strndup(Arena* A, const char* str, size_t length)
+{
+    char* ret = arena_alloc(A, length + 1);
+    memcpy(ret, str, length);
+    ret[length] = '\0';
+
+    return ret;
+}
+
+// Frees everything but the current block, which is reused
+void reset_arena(Arena* A)
+{
+    if (!A->blocks) {
+        return;
+    }
+
+    ArenaBlock* keep = A->blocks;
+    A->blocks = keep->next;
+    free_arena(A);
+    keep->next = NULL;
+    A->blocks = keep;
+    A->ptr = (char*) keep->data;
+    A->end = (char*) keep->data + keep->size;
+}
+
+void free_arena(Arena* A)
+{
+    ArenaBlock* block = A->blocks;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    init_arena(A);
+}
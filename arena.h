@@ -0,0 +1,36 @@
+#ifndef PHPINTERP_ARENA_H
+#define PHPINTERP_ARENA_H
+
+#include <stddef.h>
+
+// Bump-pointer allocator. Allocations are never freed one by one, the whole
+// arena is released at once.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock* blocks; // Most recent first, bump allocations use the first
+    char* ptr;
+    char* end;
+} Arena;
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+void init_arena(Arena*);
+void* arena_alloc_slow(Arena*, size_t size);
+char* arena_strndup(Arena*, const char* str, size_t length);
+void reset_arena(Arena*);
+void free_arena(Arena*);
+
+static inline void* arena_alloc(Arena* A, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if ((size_t) (A->end - A->ptr) < size) {
+        return arena_alloc_slow(A, size);
+    }
+
+    void* ret = A->ptr;
+    A->ptr += size;
+    return ret;
+}
+
+#endif //PHPINTERP_ARENA_H
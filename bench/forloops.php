@@ -0,0 +1,24 @@
+<?php
+// Tight for-loops over the increment and accumulate idioms.
+// Usage: time ./PHPInterp bench/forloops.php
+
+$sum = 0;
+for ($i = 0; $i < 2000000; ++$i) {
+    $sum = $sum + 3;
+}
+echo $sum . "\n";
+
+$count = 0;
+for ($i = 2000000; $i > 0; $i--) {
+    $count++;
+}
+echo $count . "\n";
+
+$str = "";
+for ($i = 0; $i < 200000; $i++) {
+    $str = $str . "x";
+}
+if ($str == "") {
+    echo "empty\n";
+}
+echo "appended\n";
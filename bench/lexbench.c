@@ -0,0 +1,101 @@
+// Lexer microbenchmark: lexes a script repeatedly and reports tokens/sec.
+// Usage: lexbench [file]
+// Without a file two generated workloads are measured: a keyword and
+// identifier heavy script and an html template with small php islands.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../lex.h"
+#include "../source.h"
+
+static const char snippet[] =
+    "function idxToDay($num) {\n"
+    "    if ($num == 0) {\n"
+    "        return \"Monday\";\n"
+    "    } else {\n"
+    "        return null;\n"
+    "    }\n"
+    "}\n"
+    "const LIMIT = 42;\n"
+    "for ($i = 0; $i < LIMIT; ++$i) {\n"
+    "    echo idxToDay($i) . \"\\n\";\n"
+    "    while (false) { echo true; }\n"
+    "}\n";
+
+static const char template_snippet[] =
+    "<tr>\n"
+    "  <td class=\"day\">A day of the week, rendered as plain html</td>\n"
+    "  <td class=\"count\">Some more passthrough text for the template</td>\n"
+    "</tr>\n"
+    "<?php echo \"<td>\" . $i . \"</td>\\n\"; ?>\n";
+
+static char* generate_script(const char* snippet, size_t repeat, size_t* len)
+{
+    const size_t snippetlen = strlen(snippet);
+    *len = strlen("<?php\n") + snippetlen * repeat;
+    char* ret = malloc(*len);
+    memcpy(ret, "<?php\n", strlen("<?php\n"));
+    char* pos = ret + strlen("<?php\n");
+    for (size_t i = 0; i < repeat; ++i, pos += snippetlen) {
+        memcpy(pos, snippet, snippetlen);
+    }
+
+    return ret;
+}
+
+static size_t lex_all(const char* buf, size_t len)
+{
+    size_t count = 0;
+    Lexer* S = create_lexer_from_buffer(buf, len);
+    while (get_token(S).type != TK_END) {
+        count++;
+    }
+    destroy_lexer(S);
+
+    return count;
+}
+
+static void bench(const char* name, const char* buf, size_t len)
+{
+    size_t tokens = 0;
+    int runs = 0;
+    const clock_t start = clock();
+    clock_t elapsed;
+    do {
+        tokens += lex_all(buf, len);
+        runs++;
+        elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC);
+
+    const double seconds = (double) elapsed / CLOCKS_PER_SEC;
+    printf("%s: %zu bytes, %d runs: %.0f tokens/sec, %.1f MB/sec\n", name, len,
+           runs, tokens / seconds, len * (double) runs / seconds / (1 << 20));
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) {
+        Source* source = open_source(argv[1]);
+        if (!source) {
+            printf("Could not open input file: %s\n", argv[1]);
+            return 1;
+        }
+        bench(argv[1], source->data, source->length);
+        close_source(source);
+        free_symbols();
+        return 0;
+    }
+
+    size_t len;
+    char* script = generate_script(snippet, 20000, &len);
+    bench("script", script, len);
+    free(script);
+
+    script = generate_script(template_snippet, 20000, &len);
+    bench("template", script, len);
+    free(script);
+
+    free_symbols();
+    return 0;
+}
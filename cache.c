@@ -0,0 +1,529 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "crossplatform/endian.h"
+#include "crossplatform/stdnoreturn.h"
+#include "cache.h"
+#include "op_util.h"
+#include "symbol.h"
+
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+// Bump whenever the meaning of the bytecode changes. Adding opcodes is
+// caught by the opcode count in the header as well.
+#define CACHE_VERSION 3
+
+static const char CACHE_MAGIC[4] = {'P', 'H', 'P', 'B'};
+
+// Layout, all numbers little endian:
+//   magic, version, opcode count, whether -O was on, script mtime, size
+//   and content hash, script path, body length and checksum, body
+// The body holds the symbol table, so symbols can be interned again in
+// this process, then every function of the State in order. Builtins are
+// only recorded by name to check they are still at the same index.
+
+static _Noreturn void cache_oom(void)
+{
+    puts("Out of memory in bytecode cache");
+    abort();
+}
+
+static uint64_t hash_bytes(const void* data, size_t length)
+{
+    const unsigned char* bytes = data;
+    uint64_t hash = 14695981039346656037u; // FNV-1a
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+typedef struct Writer {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} Writer;
+
+static void put_bytes(Writer* out, const void* bytes, size_t length)
+{
+    if (out->size + length > out->capacity) {
+        size_t capacity = out->capacity ? out->capacity * 2 : 4096;
+        while (capacity < out->size + length) {
+            capacity *= 2;
+        }
+        uint8_t* tmp = realloc(out->data, capacity);
+        if (!tmp) cache_oom();
+        out->data = tmp;
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->size, bytes, length);
+    out->size += length;
+}
+
+static void put8(Writer* out, uint8_t value)
+{
+    put_bytes(out, &value, 1);
+}
+
+static void put32(Writer* out, uint32_t value)
+{
+    value = htole32(value);
+    put_bytes(out, &value, 4);
+}
+
+static void put64(Writer* out, uint64_t value)
+{
+    value = htole64(value);
+    put_bytes(out, &value, 8);
+}
+
+static void put_str(Writer* out, const char* str)
+{
+    const size_t length = strlen(str);
+    put32(out, (uint32_t) length);
+    put_bytes(out, str, length);
+}
+
+// Reading stops at the first value past the end, ok tells if one was hit
+typedef struct Reader {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    bool ok;
+} Reader;
+
+static const void* get_bytes(Reader* in, size_t length)
+{
+    if (!in->ok || length > in->size - in->pos) {
+        in->ok = false;
+        return NULL;
+    }
+    const void* ret = in->data + in->pos;
+    in->pos += length;
+    return ret;
+}
+
+static uint8_t get8(Reader* in)
+{
+    const uint8_t* bytes = get_bytes(in, 1);
+    return bytes ? *bytes : 0;
+}
+
+static uint32_t get32(Reader* in)
+{
+    uint32_t value = 0;
+    const void* bytes = get_bytes(in, 4);
+    if (bytes) {
+        memcpy(&value, bytes, 4);
+    }
+    return le32toh(value);
+}
+
+static uint64_t get64(Reader* in)
+{
+    uint64_t value = 0;
+    const void* bytes = get_bytes(in, 8);
+    if (bytes) {
+        memcpy(&value, bytes, 8);
+    }
+    return le64toh(value);
+}
+
+static void write_function(Writer* out, const Function* fn)
+{
+    put32(out, fn->lineno_defined);
+    put8(out, fn->paramlen);
+    put32(out, fn->lastline);
+
+    put32(out, fn->locals.size);
+    for (uint32_t i = 0; i < fn->locals.size; ++i) {
+        put32(out, fn->locals.names[i]);
+    }
+
+    put32(out, fn->consts.size);
+    for (uint32_t i = 0; i < fn->consts.size; ++i) {
+        const Variant value = fn->consts.values[i];
+        put8(out, (uint8_t) value.type);
+        if (value.type == TYPE_STRING) {
+            put_str(out, value.u.str);
+        } else {
+            put64(out, (uint64_t) value.u.lint);
+        }
+    }
+
+    put32(out, (uint32_t) fn->codesize);
+    put_bytes(out, fn->code, fn->codesize);
+
+    put32(out, fn->lines.size);
+    for (uint32_t i = 0; i < fn->lines.size; ++i) {
+        put32(out, fn->lines.runs[i].start);
+        put32(out, fn->lines.runs[i].line);
+    }
+}
+
+// Symbols are read back into the ids they have in this process
+typedef struct SymbolMap {
+    symbol_t* ids;
+    uint32_t size;
+} SymbolMap;
+
+static symbol_t get_symbol(Reader* in, const SymbolMap* symbols)
+{
+    const uint32_t idx = get32(in);
+    if (idx >= symbols->size) {
+        in->ok = false;
+        return 0;
+    }
+    return symbols->ids[idx];
+}
+
+static bool read_function(Reader* in, Function* fn, const SymbolMap* symbols)
+{
+    fn->lineno_defined = get32(in);
+    fn->paramlen = get8(in);
+    fn->lastline = get32(in);
+
+    // Loaded functions are never compiled into again, so the lookup buckets
+    // of the locals are left empty
+    const uint32_t localcount = get32(in);
+    if (!in->ok || localcount > in->size / 4 || fn->paramlen > localcount) {
+        return false;
+    }
+    fn->locals.names = malloc(localcount * sizeof(*fn->locals.names) + 1);
+    if (!fn->locals.names) cache_oom();
+    fn->locals.size = fn->locals.capacity = localcount;
+    for (uint32_t i = 0; i < localcount; ++i) {
+        fn->locals.names[i] = get_symbol(in, symbols);
+    }
+
+    const uint32_t constcount = get32(in);
+    for (uint32_t i = 0; i < constcount && in->ok; ++i) {
+        Variant value;
+        value.type = (VARIANTTYPE) get8(in);
+        if (value.type == TYPE_STRING) {
+            const uint32_t length = get32(in);
+            const char* str = get_bytes(in, length);
+            if (!str || memchr(str, '\0', length)) {
+                return false;
+            }
+            value.u.str = strndup(str, length);
+            if (!value.u.str) cache_oom();
+        } else if (value.type == TYPE_LONG) {
+            value.u.lint = (int64_t) get64(in);
+        } else {
+            return false;
+        }
+        if (add_const(&fn->consts, value) != i) {
+            return false; // Duplicates are never written
+        }
+    }
+
+    const uint32_t codesize = get32(in);
+    const void* code = get_bytes(in, codesize);
+    if (!code) {
+        return false;
+    }
+    if (codesize >= fn->codecapacity) {
+        codepoint_t* tmp = realloc(fn->code, codesize + 1);
+        if (!tmp) cache_oom();
+        fn->code = tmp;
+        fn->codecapacity = codesize + 1;
+    }
+    memcpy(fn->code, code, codesize);
+    fn->codesize = codesize;
+
+    const uint32_t runcount = get32(in);
+    for (uint32_t i = 0; i < runcount && in->ok; ++i) {
+        const uint32_t start = get32(in);
+        set_line(&fn->lines, start, get32(in));
+    }
+
+    return in->ok;
+}
+
+static void patch32(codepoint_t* at, uint32_t value)
+{
+    value = htole32(value);
+    memcpy(at, &value, 4);
+}
+
+// Rewrites symbol operands to this process and checks that every operand
+// stays in bounds. The checksum catches damaged files; these checks keep a
+// file that slipped through from indexing outside the Function.
+static bool link_function(const State* S, Function* fn, const SymbolMap* symbols)
+{
+    bool* starts = calloc(fn->codesize + 1, sizeof(*starts));
+    if (!starts) cache_oom();
+    bool ok = true;
+    size_t pos = 0;
+    while (ok && pos < fn->codesize) {
+        codepoint_t* ip = fn->code + pos;
+        const Operator op = (Operator) *ip;
+        if (op == OP_INVALID || op >= OP_MAX_VALUE || pos + op_len(op) > fn->codesize) {
+            ok = false;
+            break;
+        }
+        starts[pos] = true;
+        const uint32_t operand = op_len(op) >= 5 ? fetch32(ip + 1) : 0;
+        const FunctionWrapper* callee;
+        switch (op) {
+            case OP_CALL:
+            case OP_CLOOKUP:
+            case OP_CONSTDECL:
+                ok = operand < symbols->size;
+                if (ok) {
+                    patch32(ip + 1, symbols->ids[operand]);
+                }
+                break;
+            case OP_CALL_DIRECT:
+            case OP_TAILCALL:
+                callee = operand < S->funlen ? &S->functions[operand] : NULL;
+                ok = callee && (callee->type != FUNCTION
+                                || callee->u.function->paramlen == fetch8(ip + 5))
+                     && (op != OP_TAILCALL || callee->type == FUNCTION);
+                break;
+            case OP_CONST:
+                ok = operand < fn->consts.size;
+                break;
+            case OP_ADD_SLOT:
+                ok = fetch32(ip + 5) < fn->consts.size
+                     && fn->consts.values[fetch32(ip + 5)].type == TYPE_LONG;
+                break;
+            case OP_CAST:
+                ok = fetch8(ip + 1) < TYPE_MAX_VALUE;
+                break;
+            default:
+                break;
+        }
+        if (op_slot(ip) != NO_SLOT && op_slot(ip) >= fn->locals.size) {
+            ok = false;
+        }
+        pos += op_len(op);
+    }
+    starts[fn->codesize] = true; // Jumping to the end returns
+
+    for (pos = 0; ok && pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if (op_flags((Operator) fn->code[pos]) & OPF_JUMP) {
+            const uint32_t target = op_jump_target(fn->code + pos);
+            ok = target <= fn->codesize && starts[target];
+        }
+    }
+    free(starts);
+
+    return ok;
+}
+
+static bool read_state(State* S, Reader* in)
+{
+    SymbolMap symbols = {NULL, get32(in)};
+    if (!in->ok || symbols.size > in->size / 4) {
+        return false;
+    }
+    symbols.ids = malloc(symbols.size * sizeof(*symbols.ids) + 1);
+    if (!symbols.ids) cache_oom();
+    for (uint32_t i = 0; i < symbols.size && in->ok; ++i) {
+        const uint32_t length = get32(in);
+        const char* name = get_bytes(in, length);
+        symbols.ids[i] = name ? intern(name, length) : 0;
+    }
+
+    const size_t builtins = S->funlen; // Pseudomain and builtins
+    const uint32_t funcount = get32(in);
+    for (uint32_t i = 0; i < funcount && in->ok; ++i) {
+        const symbol_t name = get_symbol(in, &symbols);
+        const enum FUNCTION_TYPE type = (enum FUNCTION_TYPE) get8(in);
+        if (!in->ok) {
+            break;
+        }
+        if (i < builtins) {
+            if (S->functions[i].name != name || S->functions[i].type != type) {
+                in->ok = false;
+            } else if (type == FUNCTION) {
+                in->ok = read_function(in, S->functions[i].u.function, &symbols);
+            }
+        } else if (type == FUNCTION) {
+            Function* fn = create_function();
+            addfunction(S, wrap_function(fn, name)); // Owned by S from here on
+            in->ok = read_function(in, fn, &symbols);
+        } else {
+            in->ok = false;
+        }
+    }
+
+    bool ok = in->ok && funcount == S->funlen && in->pos == in->size;
+    for (size_t i = 0; ok && i < S->funlen; ++i) {
+        if (S->functions[i].type == FUNCTION) {
+            ok = link_function(S, S->functions[i].u.function, &symbols);
+        }
+    }
+    free(symbols.ids);
+
+    return ok;
+}
+
+#ifndef _WIN32
+
+// Entries are named after a hash of the absolute path, which is stored in
+// the entry as well, and the optimization tier. Runs with and without -O
+// keep an entry each.
+static char* cache_path(const char* dir, const char* path, Options options, char** fullpath)
+{
+    *fullpath = realpath(path, NULL);
+    if (!*fullpath) {
+        return NULL;
+    }
+
+    const size_t length = strlen(dir) + 32;
+    char* ret = malloc(length);
+    if (!ret) cache_oom();
+    snprintf(ret, length, "%s/%016llx%s.phpc", dir,
+             (unsigned long long) hash_bytes(*fullpath, strlen(*fullpath)),
+             options.optimize ? "-O" : "");
+    return ret;
+}
+
+static void write_header(Writer* out, const char* fullpath, const struct stat* st,
+                         const Source* source, Options options)
+{
+    put_bytes(out, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    put32(out, CACHE_VERSION);
+    put32(out, OP_MAX_VALUE);
+    put8(out, options.optimize);
+    put64(out, (uint64_t) st->st_mtime);
+    put64(out, (uint64_t) source->length);
+    put64(out, hash_bytes(source->data, source->length));
+    put_str(out, fullpath);
+}
+
+// Compares the header of the entry with a freshly written one
+static bool read_header(Reader* in, const char* fullpath, const struct stat* st,
+                        const Source* source, Options options)
+{
+    if ((uint64_t) st->st_size != source->length) {
+        return false;
+    }
+
+    Writer expected = {NULL, 0, 0};
+    write_header(&expected, fullpath, st, source, options);
+    const void* header = get_bytes(in, expected.size);
+    const bool ok = header && memcmp(header, expected.data, expected.size) == 0;
+    free(expected.data);
+    if (!ok) {
+        return false;
+    }
+
+    const uint64_t length = get64(in);
+    const uint64_t checksum = get64(in);
+    if (!in->ok || length != in->size - in->pos) {
+        return false;
+    }
+    return hash_bytes(in->data + in->pos, in->size - in->pos) == checksum;
+}
+
+bool load_cached(State* S, const char* dir, const char* path, const Source* source)
+{
+    char* fullpath;
+    char* entry = cache_path(dir, path, S->options, &fullpath);
+    struct stat st;
+    if (!entry || stat(fullpath, &st) != 0) {
+        free(entry);
+        free(fullpath);
+        return false;
+    }
+
+    bool ok = false;
+    struct stat entryst;
+    const int fd = open(entry, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &entryst) == 0 && entryst.st_size > 0) {
+        const size_t size = (size_t) entryst.st_size;
+        void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            Reader in = {data, size, 0, true};
+            ok = read_header(&in, fullpath, &st, source, S->options) && read_state(S, &in);
+            munmap(data, size);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(entry);
+    free(fullpath);
+
+    return ok;
+}
+
+void store_cached(const State* S, const char* dir, const char* path, const Source* source)
+{
+    char* fullpath;
+    char* entry = cache_path(dir, path, S->options, &fullpath);
+    struct stat st;
+    if (!entry || stat(fullpath, &st) != 0) {
+        free(entry);
+        free(fullpath);
+        return;
+    }
+
+    Writer body = {NULL, 0, 0};
+    const size_t symcount = symbol_count();
+    put32(&body, (uint32_t) symcount);
+    for (size_t i = 0; i < symcount; ++i) {
+        put_str(&body, symbol_name((symbol_t) i));
+    }
+    put32(&body, (uint32_t) S->funlen);
+    for (size_t i = 0; i < S->funlen; ++i) {
+        put32(&body, S->functions[i].name);
+        put8(&body, (uint8_t) S->functions[i].type);
+        if (S->functions[i].type == FUNCTION) {
+            write_function(&body, S->functions[i].u.function);
+        }
+    }
+
+    Writer out = {NULL, 0, 0};
+    write_header(&out, fullpath, &st, source, S->options);
+    put64(&out, body.size);
+    put64(&out, hash_bytes(body.data, body.size));
+    put_bytes(&out, body.data, body.size);
+
+    // Written next to the entry and renamed over it, so a concurrent run
+    // never maps a half written file
+    mkdir(dir, 0777);
+    const size_t length = strlen(entry) + 32;
+    char* tmppath = malloc(length);
+    if (!tmppath) cache_oom();
+    snprintf(tmppath, length, "%s.%ld.tmp", entry, (long) getpid());
+    FILE* file = fopen(tmppath, "wb");
+    if (file) {
+        const bool written = fwrite(out.data, 1, out.size, file) == out.size;
+        if (fclose(file) != 0 || !written || rename(tmppath, entry) != 0) {
+            remove(tmppath);
+        }
+    }
+
+    free(tmppath);
+    free(out.data);
+    free(body.data);
+    free(entry);
+    free(fullpath);
+}
+
+#else
+
+bool load_cached(State* S, const char* dir, const char* path, const Source* source)
+{
+    (void) S; (void) dir; (void) path; (void) source;
+    return false;
+}
+
+void store_cached(const State* S, const char* dir, const char* path, const Source* source)
+{
+    (void) S; (void) dir; (void) path; (void) source;
+}
+
+#endif
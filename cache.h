@@ -0,0 +1,22 @@
+#ifndef PHPINTERP_CACHE_H
+#define PHPINTERP_CACHE_H
+
+#include <stdbool.h>
+#include "compile.h"
+#include "source.h"
+
+// Compiled scripts are kept in a directory, one file per script path and
+// optimization tier. An entry is only used if the script still has the size,
+// modification time and content hash it was compiled from, and was written
+// by a build with the same bytecode version and optimization tier. Anything
+// else is treated as a miss.
+
+// Fills S, which holds just the pseudomain and the builtins, with the cached
+// functions of the script at path. On false S may be partially filled and
+// has to be thrown away.
+bool load_cached(State* S, const char* dir, const char* path, const Source* source);
+
+// Writes the linked functions of S, replacing an earlier entry for path
+void store_cached(const State* S, const char* dir, const char* path, const Source* source);
+
+#endif //PHPINTERP_CACHE_H
@@ -7,8 +7,10 @@
 #include <memory.h>
 #include "compile.h"
 #include "op_util.h"
+#include "optimize.h"
 #include "array-util.h"
 #include "run.h"
+#include "regcode.h"
 
 DEFINE_ENUM(Operator, ENUM_OPERATOR);
 
@@ -17,17 +19,23 @@ Function* create_function()
     Function* ret = malloc(sizeof(Function));
 
     ret->paramlen = 0;
-    ret->params = NULL;
+    ret->locals.names = NULL;
+    ret->locals.size = ret->locals.capacity = 0;
+    ret->locals.buckets = NULL;
+    ret->locals.bucketcount = 0;
     ret->lineno_defined = 0;
 
     ret->codesize = 0;
     ret->codecapacity = 1 << 8;
     ret->code = calloc(sizeof(*ret->code), ret->codecapacity);
-    ret->lineinfo = calloc(sizeof(*ret->lineinfo), ret->codecapacity);
+    init_linetable(&ret->lines);
 
-    ret->strcapacity = 4;
-    ret->strlen = 0;
-    ret->strs = calloc(sizeof(*ret->strs), ret->strcapacity);
+    init_constpool(&ret->consts);
+
+    ret->knownconsts = NULL;
+    ret->knownlen = ret->knowncapacity = 0;
+
+    ret->regcode = NULL;
 
     return ret;
 }
@@ -35,23 +43,33 @@ Function* create_function()
 void free_function(Function* fn)
 {
     free(fn->code);
-    free(fn->lineinfo);
+    free_linetable(&fn->lines);
 
-    for (int i = 0; i < fn->strlen; ++i) {
-        free(fn->strs[i]);
+    free_constpool(&fn->consts);
+    for (size_t i = 0; i < fn->knownlen; ++i) {
+        free_var(fn->knownconsts[i].value);
     }
-    free(fn->strs);
+    free(fn->knownconsts);
 
-
-    for (size_t i = 0; i < fn->paramlen; ++i) {
-        free(fn->params[i]);
-    }
-    free(fn->params);
+    free(fn->locals.names);
+    free(fn->locals.buckets);
+    free_regcode(fn->regcode);
 
     free(fn);
 }
 
-FunctionWrapper wrap_function(Function* fn, char* name)
+// Drops code and constants of fn so the next statement can be compiled into
+// it. Locals stay, since their values live on in the frame.
+void clear_code(Function* fn)
+{
+    clear_constpool(&fn->consts);
+    clear_linetable(&fn->lines);
+    fn->codesize = 0;
+    free_regcode(fn->regcode);
+    fn->regcode = NULL;
+}
+
+FunctionWrapper wrap_function(Function* fn, symbol_t name)
 {
     FunctionWrapper ret;
     ret.type = FUNCTION;
@@ -61,7 +79,7 @@ FunctionWrapper wrap_function(Function* fn, char* name)
     return ret;
 }
 
-FunctionWrapper wrap_cfunction(CFunction* fn, char* name)
+FunctionWrapper wrap_cfunction(CFunction* fn, symbol_t name)
 {
     FunctionWrapper ret;
     ret.type = CFUNCTION;
@@ -79,6 +97,14 @@ State* create_state()
     ret->funcapacity = 4;
     ret->functions = calloc(ret->funcapacity, sizeof(*ret->functions));
 
+    ret->calllen = 0;
+    ret->callcapacity = 0;
+    ret->calls = NULL;
+
+    ret->options.registers = false;
+    ret->options.verbose = false;
+    ret->options.optimize = false;
+
     return ret;
 }
 
@@ -89,9 +115,9 @@ void destroy_state(State* S)
         if (wrapper.type == FUNCTION) {
             free_function(wrapper.u.function);
         }
-        free(wrapper.name);
     }
     free(S->functions);
+    free(S->calls);
     free(S);
 }
 
@@ -118,30 +144,20 @@ static inline void try_code_resize(Function* fn, int n)
             fn->codecapacity *= 2;
         }
         codepoint_t* tmp = realloc(fn->code, sizeof(*fn->code) * fn->codecapacity);
-        lineno_t* lineinfotmp = realloc(fn->lineinfo, sizeof(*fn->lineinfo) * fn->codecapacity);
-        if (!tmp || !lineinfotmp) compiletimeerror("Out of memory");
-
-        fn->code = tmp;
-        fn->lineinfo = lineinfotmp;
-    }
-}
-
-static inline void try_strs_resize(Function* fn)
-{
-    if (fn->strlen+1 >= fn->strcapacity) {
-        fn->strcapacity *= 2;
-        char** tmp = realloc(fn->strs, sizeof(*fn->strs) * fn->strcapacity);
         if (!tmp) compiletimeerror("Out of memory");
 
-        fn->strs = tmp;
+        fn->code = tmp;
     }
 }
 
-static char* overtake_ast_str(AST* ast)
+// The AST only lives until compile is done, so strings are copied
+static char* copy_ast_str(const AST* ast)
 {
     assert(ast->val.str);
-    char* ret = ast->val.str;
-    ast->val.str = NULL;
+    char* ret = strdup(ast->val.str);
+    if (!ret) {
+        compiletimeerror("could not copy string");
+    }
 
     return ret;
 }
@@ -153,35 +169,18 @@ static inline size_t emitraw8(Function* fn, uint8_t op, lineno_t lineno)
     _Static_assert(OP_MAX_VALUE == (uint8_t)OP_MAX_VALUE, "Operator does not fit into 8 bit");
     try_code_resize(fn, 1);
     fn->code[fn->codesize] = op;
-    fn->lineinfo[fn->codesize] = lineno;
+    set_line(&fn->lines, fn->codesize, lineno);
 
     return fn->codesize++;
 }
 
-static inline size_t emitraw16(Function* fn, uint16_t op, lineno_t lineno)
-{
-    uint16_t le = htole16(op);
-    try_code_resize(fn, 2);
-    *(uint16_t*)(fn->code + fn->codesize) = le;
-    fn->lineinfo[fn->codesize] = lineno;
-    fn->lineinfo[fn->codesize + 1] = lineno;
-
-    const size_t ret = fn->codesize;
-    fn->codesize += 2;
-
-    return ret;
-}
-
 static inline size_t emitraw32(Function* fn, uint32_t op, lineno_t lineno)
 {
     uint32_t le = htole32(op);
 
     try_code_resize(fn, 4);
     *(uint32_t*)(fn->code + fn->codesize) = le;
-
-    for (int i = 0; i < 4; ++i) {
-        fn->lineinfo[fn->codesize + i] = lineno;
-    }
+    set_line(&fn->lines, fn->codesize, lineno);
 
     const size_t ret = fn->codesize;
     fn->codesize += 4;
@@ -189,23 +188,6 @@ static inline size_t emitraw32(Function* fn, uint32_t op, lineno_t lineno)
     return ret;
 }
 
-static inline size_t emitraw64(Function* fn, uint64_t op, lineno_t lineno)
-{
-    uint64_t le = htole64(op);
-
-    try_code_resize(fn, 8);
-    *(uint64_t*)(fn->code + fn->codesize) = le;
-
-    for (int i = 0; i < 8; ++i) {
-        fn->lineinfo[fn->codesize + i] = lineno;
-    }
-
-    const size_t ret = fn->codesize;
-    fn->codesize += 8;
-
-    return ret;
-}
-
 static inline size_t emit(Function* fn, Operator op, lineno_t lineno)
 {
     return emitraw8(fn, op, lineno);
@@ -220,27 +202,116 @@ static inline size_t emit_replace32(Function* fn, size_t position, uint32_t op)
     return position;
 }
 
+// Loads value from the constant pool, which owns it from now on
+static void emitconst(Function* fn, Variant value, lineno_t lineno)
+{
+    emit(fn, OP_CONST, lineno);
+    emitraw32(fn, add_const(&fn->consts, value), lineno);
+}
+
 static void emitlong(Function* fn, int64_t lint, lineno_t lineno)
 {
-    emit(fn, OP_LONG, lineno);
-    _Static_assert(sizeof(codepoint_t) == sizeof(lint)/8, "Long is not twice as long as Operator");
-    _Static_assert(sizeof(lint) == 8, "Long is not 8 bytes.");
-    emitraw64(fn, (uint64_t) lint, lineno);
+    Variant value = {.type = TYPE_LONG, .u.lint = lint};
+    emitconst(fn, value, lineno);
+}
+
+static void emitstring(Function* fn, char* str, lineno_t lineno)
+{
+    Variant value = {.type = TYPE_STRING, .u.str = str};
+    emitconst(fn, value, lineno);
+}
+
+// Pushes value, which is owned by fn from now on
+static void emitliteral(Function* fn, Variant value, lineno_t lineno)
+{
+    switch (value.type) {
+        case TYPE_BOOL:
+            emit(fn, value.u.boolean ? OP_TRUE : OP_FALSE, lineno);
+            break;
+        case TYPE_NULL:
+            emit(fn, OP_NULL, lineno);
+            break;
+        case TYPE_LONG:
+        case TYPE_STRING:
+            emitconst(fn, value, lineno);
+            break;
+        default:
+            assert(false && "Not a literal");
+            break;
+    }
 }
 
-static void emitcast(Function* fn, VARIANTTYPE type, lineno_t lineno)
+// Whether [start, end) is a single instruction pushing a literal, which is
+// stored in out. Strings are borrowed from the constant pool.
+static bool literal_between(const Function* fn, size_t start, size_t end, Variant* out)
+{
+    if (start >= end || start + op_len((Operator) fn->code[start]) != end) {
+        return false;
+    }
+
+    switch (fn->code[start]) {
+        case OP_CONST:
+            *out = fn->consts.values[fetch32(fn->code + start + 1)];
+            return true;
+        case OP_TRUE:
+        case OP_FALSE:
+            out->type = TYPE_BOOL;
+            out->u.boolean = fn->code[start] == OP_TRUE;
+            return true;
+        case OP_NULL:
+            out->type = TYPE_NULL;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Emits op for the operands compiled to [lhs, rhs) and [rhs, codesize), or
+// replaces them by the result if both are literals
+static void emit_binop(Function* fn, Operator op, size_t lhs, size_t rhs, lineno_t lineno)
+{
+    Variant lval, rval, result;
+    if (literal_between(fn, lhs, rhs, &lval) && literal_between(fn, rhs, fn->codesize, &rval)
+        && fold_binop(op, lval, rval, &result)) {
+        fn->codesize = lhs;
+        emitliteral(fn, result, lineno);
+    } else {
+        emit(fn, op, lineno);
+    }
+}
+
+static void emit_not(Function* fn, size_t operand, lineno_t lineno)
+{
+    Variant val, result;
+    if (literal_between(fn, operand, fn->codesize, &val)
+        && fold_unop(OP_NOT, TYPE_UNDEF, val, &result)) {
+        fn->codesize = operand;
+        emitliteral(fn, result, lineno);
+    } else {
+        emit(fn, OP_NOT, lineno);
+    }
+}
+
+// Casts the value compiled to [operand, codesize)
+static void emitcast(Function* fn, VARIANTTYPE type, size_t operand, lineno_t lineno)
 {
     _Static_assert((int8_t)TYPE_MAX_VALUE == TYPE_MAX_VALUE,
                    "VARIANTTYPE does not fit into 8 bit");
+    Variant val, result;
+    if (literal_between(fn, operand, fn->codesize, &val)
+        && fold_unop(OP_CAST, type, val, &result)) {
+        fn->codesize = operand;
+        emitliteral(fn, result, lineno);
+        return;
+    }
     emit(fn, OP_CAST, lineno);
     emitraw8(fn, type, lineno);
 }
 
-static void addstring(Function* fn, char* str, lineno_t lineno)
+static void emitsymbol(Function* fn, symbol_t sym, lineno_t lineno)
 {
-    try_strs_resize(fn);
-    fn->strs[fn->strlen] = str;
-    emitraw16(fn, fn->strlen++, lineno);
+    _Static_assert(sizeof(symbol_t) == sizeof(uint32_t), "Symbols are emitted as 32 bit");
+    emitraw32(fn, sym, lineno);
 }
 
 void addfunction(State* S, FunctionWrapper fn)
@@ -255,21 +326,118 @@ void addfunction(State* S, FunctionWrapper fn)
     S->functions[S->funlen++] = fn;
 }
 
-static void compile_string(Function* fn, AST* ast)
+// The first definition of name wins, as redefinitions are not rejected yet
+FunctionWrapper* find_function(State* S, symbol_t name)
 {
-    emit(fn, OP_STR, ast->lineno);
-    addstring(fn, overtake_ast_str(ast), ast->lineno);
+    for (size_t i = 0; i < S->funlen; ++i) {
+        if (S->functions[i].name == name) {
+            return &S->functions[i];
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t hash_local(symbol_t name)
+{
+    return name * 2654435761u; // Symbols are dense, spread them
+}
+
+static void insert_local_bucket(Locals* locals, uint32_t slot)
+{
+    const uint32_t mask = locals->bucketcount - 1;
+    uint32_t bucket = hash_local(locals->names[slot]) & mask;
+    while (locals->buckets[bucket] != NO_SLOT) {
+        bucket = (bucket + 1) & mask;
+    }
+    locals->buckets[bucket] = slot;
+}
+
+static uint32_t find_local(const Locals* locals, symbol_t name)
+{
+    if (!locals->bucketcount) {
+        return NO_SLOT;
+    }
+
+    const uint32_t mask = locals->bucketcount - 1;
+    for (uint32_t bucket = hash_local(name) & mask; locals->buckets[bucket] != NO_SLOT;
+         bucket = (bucket + 1) & mask) {
+        if (locals->names[locals->buckets[bucket]] == name) {
+            return locals->buckets[bucket];
+        }
+    }
+
+    return NO_SLOT;
+}
+
+static uint32_t add_local(Locals* locals, symbol_t name)
+{
+    if (locals->size + 1 >= NO_SLOT) compiletimeerror("Too many variables");
+    if (locals->size == locals->capacity) {
+        locals->capacity = locals->capacity ? locals->capacity * 2 : 8;
+        symbol_t* tmp = realloc(locals->names, locals->capacity * sizeof(*tmp));
+        if (!tmp) compiletimeerror("Out of memory");
+        locals->names = tmp;
+    }
+
+    const uint32_t ret = locals->size++;
+    locals->names[ret] = name;
+    if (locals->size * 2 > locals->bucketcount) { // Rehash, including the new one
+        const uint32_t count = locals->bucketcount ? locals->bucketcount * 2 : 16;
+        uint32_t* buckets = malloc(count * sizeof(*buckets));
+        if (!buckets) compiletimeerror("Out of memory");
+        for (uint32_t i = 0; i < count; ++i) {
+            buckets[i] = NO_SLOT;
+        }
+        free(locals->buckets);
+        locals->buckets = buckets;
+        locals->bucketcount = count;
+        for (uint32_t i = 0; i < locals->size; ++i) {
+            insert_local_bucket(locals, i);
+        }
+    } else {
+        insert_local_bucket(locals, ret);
+    }
+
+    return ret;
+}
+
+// New slot for a value the optimizer introduces. Its name cannot clash with
+// a variable of the script.
+uint32_t add_temp_slot(Function* fn)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "<tmp%u>", fn->locals.size);
+
+    return add_local(&fn->locals, intern_cstr(name));
+}
+
+// Slot of the variable name in fn, allocated on first use
+uint32_t local_slot(Function* fn, symbol_t name)
+{
+    const uint32_t slot = find_local(&fn->locals, name);
+
+    return slot != NO_SLOT ? slot : add_local(&fn->locals, name);
 }
 
-static void compile_function(State* S, AST* ast)
+static void compile_node(State* S, Function* fn, const Program* P, const AST* ast);
+static void compile_body(State* S, Function* fn, const Program* P, const AST* ast);
+static void compile_stmt(State* S, Function* fn, const Program* P, const AST* ast);
+static size_t compile_jump_unless(State* S, Function* fn, const Program* P,
+                                  const AST* condition, lineno_t lineno);
+
+static void compile_string(Function* fn, const AST* ast)
 {
-    assert(ast->node1 && ast->node2 && ast->node3);
-    AST* const name = ast->node1;
-    AST* const params = ast->node2;
-    AST* const body = ast->node3;
+    emitstring(fn, copy_ast_str(ast), ast->lineno);
+}
+
+static void compile_function(State* S, const Program* P, const AST* ast)
+{
+    assert(ast->type == AST_FUNCTION && ast->kidcount >= 1);
+    const AST* const body = ast_kid(P, ast, 0);
     Function* fn = create_function();
-    fn->lineno_defined = name->lineno;
-    size_t paramcount = ast_list_count(params);
+    fn->lineno_defined = ast->lineno;
+    size_t paramcount = ast->kidcount - 1;
 
     fn->paramlen = (uint8_t) paramcount;
     if (paramcount != fn->paramlen) {
@@ -277,285 +445,488 @@ static void compile_function(State* S, AST* ast)
         return;
     }
 
-    fn->params = malloc(sizeof(*fn->params) * paramcount);
-    AST* param = params->next;
-    for (int i = 0; param; ++i, param = param->next) {
+    for (uint32_t i = 0; i < paramcount; ++i) { // Parameters are slots 0..n-1
+        const AST* param = ast_kid(P, ast, i + 1);
         assert(param->type == AST_ARGUMENT);
-        fn->params[i] = overtake_ast_str(param);
+        if (find_local(&fn->locals, param->val.sym) != NO_SLOT) {
+            compiletimeerror("Redefinition of parameter $%s", symbol_name(param->val.sym));
+        }
+        add_local(&fn->locals, param->val.sym);
     }
 
-    addfunction(S, wrap_function(fn, overtake_ast_str(name)));
-    compile(S, fn, body);
+    addfunction(S, wrap_function(fn, ast->val.sym));
+    compile_body(S, fn, P, body);
 
-    emit(fn, OP_NULL, ast->node3->lineno); // Safeguard to guarantee that we have a return value
-    emit(fn, OP_RETURN, ast->node3->lineno);
+    emit(fn, OP_NULL, body->lineno); // Safeguard to guarantee that we have a return value
+    emit(fn, OP_RETURN, body->lineno);
 }
 
-static void compile_call(State* S, Function* fn, AST* ast)
+static void compile_call(State* S, Function* fn, const Program* P, const AST* ast)
 {
-    assert(ast->node1);
-    uint8_t argcount = 0;
-    AST* args = ast->node1->next;
-    while (args) { // Push args
-        compile(S, fn, args);
-        args = args->next;
-        if (argcount + 1 < argcount) {
-            compiletimeerror("Cannot compile functions with argument >255");
-        }
-        argcount++;
+    if (ast->kidcount > UINT8_MAX) {
+        compiletimeerror("Cannot compile functions with argument >255");
+    }
+    for (uint32_t i = 0; i < ast->kidcount; ++i) { // Push args
+        compile_node(S, fn, P, ast_kid(P, ast, i));
     }
 
-    emit(fn, OP_STR, ast->lineno); // function name
-    addstring(fn, overtake_ast_str(ast), ast->lineno);
+    // Callees may be defined further down, link_calls patches this later
+    const size_t position = emit(fn, OP_CALL, ast->lineno);
+    emitsymbol(fn, ast->val.sym, ast->lineno); // function name
+    emitraw8(fn, (uint8_t) ast->kidcount, ast->lineno); // Number of parameters
 
-    emit(fn, OP_CALL, ast->lineno);
-    emitraw8(fn, argcount, ast->lineno); // Number of parameters
+    if (!try_resize(&S->callcapacity, S->calllen,
+                    (void**)&S->calls, sizeof(*S->calls), NULL)) {
+        compiletimeerror("could not realloc call sites");
+    }
+    S->calls[S->calllen++] = (CallSite) {fn, position};
 }
 
-static void compile_blockstmt(State* S, Function* fn, AST* ast)
+static void compile_blockstmt(State* S, Function* fn, const Program* P, const AST* ast)
 {
     assert(ast->type == AST_LIST);
-    AST* current = ast->next;
-    while (current) {
-        compile(S, fn, current);
-        current = current->next;
+    for (uint32_t i = 0; i < ast->kidcount; ++i) {
+        compile_stmt(S, fn, P, ast_kid(P, ast, i));
     }
 }
 
-static void compile_echostmt(State* S, Function* fn, AST* ast)
+static void compile_echostmt(State* S, Function* fn, const Program* P, const AST* ast)
 {
     assert(ast->type == AST_ECHO);
-    assert(ast->node1);
-    compile(S, fn, ast->node1);
+    compile_node(S, fn, P, ast_kid(P, ast, 0));
     emit(fn, OP_ECHO, ast->lineno);
 }
 
-static void compile_html(Function* fn, AST* ast)
+static void compile_html(Function* fn, const AST* ast)
 {
-    emit(fn, OP_STR, ast->lineno);
-    addstring(fn, overtake_ast_str(ast), ast->lineno);
+    emitstring(fn, copy_ast_str(ast), ast->lineno);
     emit(fn, OP_ECHO, ast->lineno);
 }
 
-static void compile_assignmentexpr(State* S, Function* fn, AST* ast)
+static void emit_slot_op(Function* fn, Operator op, symbol_t name, lineno_t lineno)
+{
+    emit(fn, op, lineno);
+    emitraw32(fn, local_slot(fn, name), lineno);
+}
+
+// Collects the operators matching op down the left side of ast, innermost
+// first. Uses local if it has room for all 16, else the caller frees spine.
+static size_t left_spine(const Program* P, const AST* ast, int64_t op,
+                         const AST** local, const AST*** spine)
+{
+    size_t depth = 0;
+    for (const AST* lhs = ast; lhs->type == AST_BINOP && (!op || lhs->val.lint == op);
+         lhs = ast_kid(P, lhs, 0)) {
+        assert(lhs->kidcount == 2);
+        depth++;
+    }
+
+    *spine = depth <= 16 ? local : malloc(depth * sizeof(**spine));
+    if (!*spine) {
+        compiletimeerror("could not allocate operator chain");
+    }
+    const AST* node = ast;
+    for (size_t i = depth; i-- > 0; node = ast_kid(P, node, 0)) {
+        (*spine)[i] = node;
+    }
+
+    return depth;
+}
+
+// Drops the code emitted since start, and the calls recorded in it
+static void discard_code(State* S, Function* fn, size_t start, size_t calls)
+{
+    fn->codesize = start;
+    S->calllen = calls;
+}
+
+// $x = $x + literal and $x = $x - literal, updating x in place
+static bool compile_add_slot(State* S, Function* fn, const Program* P, const AST* ast)
+{
+    const AST* const value = ast_kid(P, ast, 0);
+    if (value->type != AST_BINOP || (value->val.lint != '+' && value->val.lint != '-')
+        || ast_kid(P, value, 0)->type != AST_VAR || ast_kid(P, value, 0)->val.sym != ast->val.sym) {
+        return false;
+    }
+
+    const size_t start = fn->codesize;
+    const size_t calls = S->calllen;
+    compile_node(S, fn, P, ast_kid(P, value, 1));
+    Variant rhs;
+    if (literal_between(fn, start, fn->codesize, &rhs)) {
+        int64_t n = vartolong(rhs);
+        if (value->val.lint == '+' || n != INT64_MIN) {
+            discard_code(S, fn, start, calls);
+            emit_slot_op(fn, OP_ADD_SLOT, ast->val.sym, ast->lineno);
+            Variant delta = {.type = TYPE_LONG, .u.lint = value->val.lint == '+' ? n : -n};
+            emitraw32(fn, add_const(&fn->consts, delta), ast->lineno);
+            return true;
+        }
+    }
+    discard_code(S, fn, start, calls);
+
+    return false;
+}
+
+// $s = $s . a . b appends a and b to s in place. The operands see s after
+// the earlier appends, so none of them may use s.
+static bool compile_append_slot(State* S, Function* fn, const Program* P, const AST* ast)
+{
+    const AST* local[16];
+    const AST** spine;
+    const size_t depth = left_spine(P, ast_kid(P, ast, 0), '.', local, &spine);
+    const AST* const lhs = depth ? ast_kid(P, spine[0], 0) : NULL;
+    bool ret = lhs && lhs->type == AST_VAR && lhs->val.sym == ast->val.sym;
+
+    const uint32_t slot = local_slot(fn, ast->val.sym);
+    const size_t start = fn->codesize;
+    const size_t calls = S->calllen;
+    for (size_t i = 0; i < depth && ret; ++i) {
+        const size_t operand = fn->codesize;
+        compile_node(S, fn, P, ast_kid(P, spine[i], 1));
+        for (size_t pos = operand; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+            ret &= op_slot(fn->code + pos) != slot;
+        }
+        emit(fn, OP_APPEND_SLOT, spine[i]->lineno);
+        emitraw32(fn, slot, spine[i]->lineno);
+    }
+    if (!ret) {
+        discard_code(S, fn, start, calls);
+    }
+
+    if (spine != local) {
+        free(spine);
+    }
+    return ret;
+}
+
+static void compile_assignmentexpr(State* S, Function* fn, const Program* P, const AST* ast)
 {
     assert(ast->type == AST_ASSIGNMENT);
-    assert(ast->node1);
-    assert(ast->val.str);
-    compile(S, fn, ast->node1);
-    emit(fn, OP_ASSIGN, ast->lineno);
-    addstring(fn, overtake_ast_str(ast), ast->lineno);
+    if (compile_add_slot(S, fn, P, ast) || compile_append_slot(S, fn, P, ast)) {
+        return;
+    }
+    compile_node(S, fn, P, ast_kid(P, ast, 0));
+    emit_slot_op(fn, OP_STORE_SLOT, ast->val.sym, ast->lineno);
 }
 
-static void compile_varexpr(Function* fn, AST* ast)
+static void compile_varexpr(Function* fn, const AST* ast)
 {
-    emit(fn, OP_LOOKUP, ast->lineno);
-    addstring(fn, overtake_ast_str(ast), ast->lineno);
+    emit_slot_op(fn, OP_LOAD_SLOT, ast->val.sym, ast->lineno);
 }
 
-static void compile_constdecl(State* S, Function* fn, AST* ast)
+static void compile_constdecl(State* S, Function* fn, const Program* P, const AST* ast)
 {
     assert(ast->type == AST_CONSTDECL);
-    assert(ast->node1 && ast->node2);
-    assert(ast->node1->val.str);
-    compile(S, fn, ast->node2);
+    compile_node(S, fn, P, ast_kid(P, ast, 0));
     emit(fn, OP_CONSTDECL, ast->lineno);
-    addstring(fn, overtake_ast_str(ast->node1), ast->lineno);
+    emitsymbol(fn, ast->val.sym, ast->lineno);
 }
 
-static void compile_ifstmt(State* S, Function* fn, AST* ast)
+static void compile_ifstmt(State* S, Function* fn, const Program* P, const AST* ast)
 {
     assert(ast->type == AST_IF);
-    assert(ast->node1 && ast->node2);
-    compile(S, fn, ast->node1);
-    emitcast(fn, TYPE_BOOL, ast->node1->lineno);
-    emit(fn, OP_JMPZ, ast->node1->lineno); // Jump over code if false
-    size_t placeholder = emitraw32(fn, OP_INVALID, -1); // Placeholder
-    compile(S, fn, ast->node2);
-    emit_replace32(fn, placeholder, (Operator) emit(fn, OP_NOP, ast->node2->lineno)); // place to jump over if
+    const AST* const condition = ast_kid(P, ast, 0);
+    const AST* const body = ast_kid(P, ast, 1);
+    const AST* const else_body = ast_kid(P, ast, 2);
+    size_t placeholder = compile_jump_unless(S, fn, P, condition, condition->lineno);
+    compile_stmt(S, fn, P, body);
+    emit_replace32(fn, placeholder, (Operator) emit(fn, OP_NOP, body->lineno)); // place to jump over if
     assert((Operator)fn->codesize == fn->codesize);
 
-    if (ast->node3) {
-        emit(fn, OP_JMP, ast->node3->lineno);
-        size_t else_placeholder = emitraw32(fn, OP_INVALID, ast->node3->lineno); // placeholder
+    if (else_body) {
+        emit(fn, OP_JMP, else_body->lineno);
+        size_t else_placeholder = emitraw32(fn, OP_INVALID, else_body->lineno); // placeholder
         // When we get here, we already assigned a jmp to here for the else branch
         // However, we need to increase it by one two jmp over this jmp
         emit_replace32(fn, placeholder, (Operator) fn->codesize);
 
-        compile(S, fn, ast->node3);
-        emit_replace32(fn, else_placeholder, (Operator) emit(fn, OP_NOP, ast->node3->lineno));
+        compile_stmt(S, fn, P, else_body);
+        emit_replace32(fn, else_placeholder, (Operator) emit(fn, OP_NOP, else_body->lineno));
     }
 }
 
-static void compile_binop(State* S, Function* fn, AST* ast)
+static Operator binop_operator(const AST* ast)
 {
-    assert(ast->type == AST_BINOP);
-    assert(ast->node1 && ast->node2);
-    compile(S, fn, ast->node1);
-    compile(S, fn, ast->node2);
     switch (ast->val.lint) {
         case '+':
-            emit(fn, OP_ADD, ast->lineno);
-            break;
+            return OP_ADD;
         case '-':
-            emit(fn, OP_SUB, ast->lineno);
-            break;
+            return OP_SUB;
         case '/':
-            emit(fn, OP_DIV, ast->lineno);
-            break;
+            return OP_DIV;
         case '*':
-            emit(fn, OP_MUL, ast->lineno);
-            break;
+            return OP_MUL;
         case '.':
-            emit(fn, OP_CONCAT, ast->lineno);
-            break;
+            return OP_CONCAT;
         case TK_SHL:
-            emit(fn, OP_SHL, ast->lineno);
-            break;
+            return OP_SHL;
         case TK_SHR:
-            emit(fn, OP_SHR, ast->lineno);
-            break;
+            return OP_SHR;
         case TK_LTEQ:
-            emit(fn, OP_LTE, ast->lineno);
-            break;
+            return OP_LTE;
         case TK_GTEQ:
-            emit(fn, OP_GTE, ast->lineno);
-            break;
+            return OP_GTE;
         case '<':
-            emit(fn, OP_LT, ast->lineno);
-            break;
+            return OP_LT;
         case '>':
-            emit(fn, OP_GT, ast->lineno);
-            break;
+            return OP_GT;
         case TK_EQ:
-            emit(fn, OP_EQ, ast->lineno);
-            break;
+            return OP_EQ;
         case TK_AND:
-            emit(fn, OP_AND, ast->lineno);
-            break;
+            return OP_AND;
         case TK_OR:
-            emit(fn, OP_OR, ast->lineno);
-            break;
+            return OP_OR;
         default:
             assert(false && "Undefined BINOP");
-            break;
+            return OP_INVALID;
     }
 }
 
-static void compile_prefixop(State* S, Function* fn, AST* ast)
+// Operator chains lean to the left, so the left spine is collected first and
+// compiled bottom-up in a loop instead of recursing once per operator
+static void compile_binop(State* S, Function* fn, const Program* P, const AST* ast)
 {
-    assert(ast->node1->type == AST_VAR);
-    compile(S, fn, ast->node1);
-    uint16_t nameidx = *(uint16_t*)(&fn->code[fn->codesize - 2]); // Next codepoint
-    assert(nameidx < fn->strlen);
-    emit(fn, OP_ADD1, ast->lineno);
-    emit(fn, OP_DUP, ast->lineno); // one for the assignment, one for returning val
-    emit(fn, OP_ASSIGN, ast->lineno);
-    emitraw16(fn, nameidx, ast->lineno);
+    assert(ast->type == AST_BINOP);
+    const AST* local[16];
+    const AST** spine;
+    const size_t depth = left_spine(P, ast, 0, local, &spine);
+
+    const size_t start = fn->codesize;
+    compile_node(S, fn, P, ast_kid(P, spine[0], 0));
+    for (size_t i = 0; i < depth; ++i) {
+        const size_t rhs = fn->codesize;
+        compile_node(S, fn, P, ast_kid(P, spine[i], 1));
+        emit_binop(fn, binop_operator(spine[i]), start, rhs, spine[i]->lineno);
+    }
+
+    if (spine != local) {
+        free(spine);
+    }
 }
-static void compile_postfixop(State* S, Function* fn, AST* ast)
+
+// Jump taken when the comparison op is false, or true if negated
+static Operator compare_jump(Operator op, bool negated)
 {
-    assert(ast->node1->type == AST_VAR);
-    compile(S, fn, ast->node1);
-    uint16_t nameidx = *(uint16_t*)(&fn->code[fn->codesize - 2]); // Next codepoint
-    assert(nameidx < fn->strlen);
-    emit(fn, OP_DUP, ast->lineno); // For returning the previous value
-    emit(fn, OP_ADD1, ast->lineno);
-    emit(fn, OP_ASSIGN, ast->lineno);
-    emitraw16(fn, nameidx, ast->lineno);
+    switch (op) {
+        case OP_LT:
+            return negated ? OP_JLT : OP_JGE;
+        case OP_LTE:
+            return negated ? OP_JLE : OP_JGT;
+        case OP_GT:
+            return negated ? OP_JGT : OP_JLE;
+        case OP_GTE:
+            return negated ? OP_JGE : OP_JLT;
+        case OP_EQ:
+            return negated ? OP_JEQ : OP_JNE;
+        default:
+            return OP_INVALID;
+    }
 }
 
-static void compile_whilestmt(State* S, Function* fn, AST* ast)
+// Emits a jump that is taken if condition is false and returns the position
+// of its target for patching. Comparisons jump directly on their operands.
+static size_t compile_jump_unless(State* S, Function* fn, const Program* P,
+                                  const AST* condition, lineno_t lineno)
+{
+    const bool negated = condition->type == AST_NOTOP;
+    const AST* const test = negated ? ast_kid(P, condition, 0) : condition;
+    const Operator op = test->type == AST_BINOP ? binop_operator(test) : OP_INVALID;
+    const size_t start = fn->codesize;
+    if (compare_jump(op, negated) != OP_INVALID) {
+        compile_node(S, fn, P, ast_kid(P, test, 0));
+        const size_t rhs = fn->codesize;
+        compile_node(S, fn, P, ast_kid(P, test, 1));
+        Variant lval, rval;
+        if (!literal_between(fn, start, rhs, &lval)
+            || !literal_between(fn, rhs, fn->codesize, &rval)) {
+            emit(fn, compare_jump(op, negated), lineno);
+            return emitraw32(fn, OP_INVALID, -1);
+        }
+        emit_binop(fn, op, start, rhs, test->lineno); // Folds
+        if (negated) {
+            emit_not(fn, start, condition->lineno);
+        }
+    } else {
+        compile_node(S, fn, P, condition);
+    }
+
+    emitcast(fn, TYPE_BOOL, start, lineno);
+    emit(fn, OP_JMPZ, lineno);
+    return emitraw32(fn, OP_INVALID, -1);
+}
+
+// Prefix and postfix ++ and --, the value is only pushed if used
+static void compile_incdec(Function* fn, const Program* P, const AST* ast, bool used)
+{
+    const AST* const var = ast_kid(P, ast, 0);
+    assert(var->type == AST_VAR);
+    if (used && ast->type == AST_POSTFIXOP) { // Previous value
+        emit_slot_op(fn, OP_LOAD_SLOT, var->val.sym, ast->lineno);
+    }
+    emit_slot_op(fn, ast->val.lint == '-' ? OP_DEC_SLOT : OP_INC_SLOT, var->val.sym, ast->lineno);
+    if (used && ast->type == AST_PREFIXOP) {
+        emit_slot_op(fn, OP_LOAD_SLOT, var->val.sym, ast->lineno);
+    }
+}
+
+static void compile_whilestmt(State* S, Function* fn, const Program* P, const AST* ast)
 {
     assert(ast->type == AST_WHILE);
-    assert(ast->node1 && ast->node2);
+    const AST* const body = ast_kid(P, ast, 1);
     size_t while_start = fn->codesize;
-    compile(S, fn, ast->node1);
-    emitcast(fn, TYPE_BOOL, ast->lineno);
-    emit(fn, OP_JMPZ, ast->lineno);                 // Jump over body if zero
-    size_t placeholder = emitraw32(fn, OP_INVALID, -1); // Placeholder
-    compile(S, fn, ast->node2);
+    // Jump over body if false
+    size_t placeholder = compile_jump_unless(S, fn, P, ast_kid(P, ast, 0), ast->lineno);
+    compile_stmt(S, fn, P, body);
 
-    emit(fn, OP_JMP, ast->node2->lineno); // Jump back to while start
+    emit(fn, OP_JMP, body->lineno); // Jump back to while start
     if ((uint32_t) while_start != while_start) {
         compiletimeerror("Jump address overflowed while compiling while statement");
     }
-    emitraw32(fn, (uint32_t) while_start, ast->node2->lineno);
+    emitraw32(fn, (uint32_t) while_start, body->lineno);
 
     emit_replace32(fn, placeholder, (Operator) emit(fn, OP_NOP, ast->lineno));
 }
 
 
-static void compile_forstmt(State* S, Function* fn, AST* ast) {
-    assert(ast->type == AST_FOR);
-    assert(ast->node1 && ast->node2 && ast->node3 && ast->node4);
-    compile(S, fn, ast->node1); // Init
+static void compile_forstmt(State* S, Function* fn, const Program* P, const AST* ast) {
+    assert(ast->type == AST_FOR && ast->kidcount == 4);
+    const AST* const post = ast_kid(P, ast, 2);
+    compile_stmt(S, fn, P, ast_kid(P, ast, 0)); // Init
     size_t for_start = fn->codesize;
-    compile(S, fn, ast->node2); // Condition
-    emitcast(fn, TYPE_BOOL, ast->lineno);
-    emit(fn, OP_JMPZ, ast->lineno);                 // Jump over body if zero
-    size_t placeholder = emitraw32(fn, OP_INVALID, -1); // Placeholder
-    compile(S, fn, ast->node4); // Body
-    compile(S, fn, ast->node3); // Post expression
-
-    emit(fn, OP_JMP, ast->node3->lineno); // Jump back to for start
+    // Jump over body if the condition is false
+    size_t placeholder = compile_jump_unless(S, fn, P, ast_kid(P, ast, 1), ast->lineno);
+    compile_stmt(S, fn, P, ast_kid(P, ast, 3)); // Body
+    compile_stmt(S, fn, P, post); // Post expression
+
+    emit(fn, OP_JMP, post->lineno); // Jump back to for start
     if ((uint32_t) for_start != for_start) {
         compiletimeerror("Jump address overflowed while compiling while statement");
     }
-    emitraw32(fn, (uint32_t) for_start, ast->node3->lineno);
+    emitraw32(fn, (uint32_t) for_start, post->lineno);
 
     emit_replace32(fn, placeholder, (Operator) emit(fn, OP_NOP, ast->lineno));
 }
 
-static void compile_constant(Function* fn, AST* ast) {
+static void compile_constant(Function* fn, const AST* ast) {
     assert(ast->type == AST_IDENTIFIER);
-    if (strcmp(ast->val.str, "__LINE__") == 0) {
+    if (ast->val.sym == intern_cstr("__LINE__")) {
         emit(fn, OP_GETLINE, ast->lineno);
-        free(ast->val.str);
-    } else {
-        emit(fn, OP_CLOOKUP, ast->lineno);
-        addstring(fn, overtake_ast_str(ast), ast->lineno);
+        return;
     }
+
+    for (size_t i = 0; i < fn->knownlen; ++i) {
+        if (fn->knownconsts[i].name == ast->val.sym) {
+            emitliteral(fn, cpy_var(fn->knownconsts[i].value), ast->lineno);
+            return;
+        }
+    }
+    emit(fn, OP_CLOOKUP, ast->lineno);
+    emitsymbol(fn, ast->val.sym, ast->lineno);
 }
 
-Function* compile(State* S, Function* fn, AST* ast)
+// Remembers the constant declared by the code at [start, codesize) if its
+// value is a literal. Only for declarations that always run before the
+// rest of the body; if an earlier declaration of the same name ran, this
+// one fails with "Cannot redeclare constant" and nothing after it runs.
+static void remember_const(Function* fn, symbol_t name, size_t start)
+{
+    Variant value;
+    if (!literal_between(fn, start, fn->codesize - op_len(OP_CONSTDECL), &value)) {
+        return;
+    }
+    for (size_t i = 0; i < fn->knownlen; ++i) {
+        if (fn->knownconsts[i].name == name) {
+            return;
+        }
+    }
+
+    if (!try_resize(&fn->knowncapacity, fn->knownlen,
+                    (void**)&fn->knownconsts, sizeof(*fn->knownconsts), NULL)) {
+        compiletimeerror("could not realloc constants");
+    }
+    fn->knownconsts[fn->knownlen++] = (Variable) {name, cpy_var(value), VAR_FLAG_CONST};
+}
+
+// Compiles ast where its value is not used, so nothing is left on the stack
+static void compile_stmt(State* S, Function* fn, const Program* P, const AST* ast)
+{
+    switch (ast->type) {
+        case AST_PREFIXOP:
+        case AST_POSTFIXOP:
+            compile_incdec(fn, P, ast, false);
+            break;
+        case AST_CALL:
+        case AST_STRING:
+        case AST_BINOP:
+        case AST_NOTOP:
+        case AST_LONG:
+        case AST_NULL:
+        case AST_TRUE:
+        case AST_FALSE:
+        case AST_VAR:
+        case AST_IDENTIFIER:
+            compile_node(S, fn, P, ast);
+            emit(fn, OP_POP, ast->lineno);
+            break;
+        default:
+            compile_node(S, fn, P, ast);
+            break;
+    }
+}
+
+// Compiles the statements at the top level of a function body
+static void compile_body(State* S, Function* fn, const Program* P, const AST* ast)
+{
+    const uint32_t count = ast->type == AST_LIST ? ast->kidcount : 1;
+    for (uint32_t i = 0; i < count; ++i) {
+        const AST* stmt = ast->type == AST_LIST ? ast_kid(P, ast, i) : ast;
+        const size_t start = fn->codesize;
+        compile_stmt(S, fn, P, stmt);
+        if (stmt->type == AST_CONSTDECL) {
+            remember_const(fn, stmt->val.sym, start);
+        }
+    }
+}
+
+static void compile_node(State* S, Function* fn, const Program* P, const AST* ast)
 {
     switch (ast->type) {
         case AST_FUNCTION:
-            compile_function(S, ast);
+            compile_function(S, P, ast);
             break;
         case AST_RETURN:
-            compile(S, fn, ast->node1);
+            compile_node(S, fn, P, ast_kid(P, ast, 0));
             emit(fn, OP_RETURN, ast->lineno);
             break;
         case AST_CALL:
-            compile_call(S, fn, ast);
+            compile_call(S, fn, P, ast);
             break;
         case AST_LIST:
-            compile_blockstmt(S, fn, ast);
+            compile_blockstmt(S, fn, P, ast);
             break;
         case AST_ECHO:
-            compile_echostmt(S, fn, ast);
+            compile_echostmt(S, fn, P, ast);
             break;
         case AST_IF:
-            compile_ifstmt(S, fn, ast);
+            compile_ifstmt(S, fn, P, ast);
             break;
         case AST_STRING:
             compile_string(fn, ast);
             break;
         case AST_BINOP:
-            compile_binop(S, fn, ast);
+            compile_binop(S, fn, P, ast);
             break;
         case AST_PREFIXOP:
-            compile_prefixop(S, fn, ast);
-            break;
         case AST_POSTFIXOP:
-            compile_postfixop(S, fn, ast);
+            compile_incdec(fn, P, ast, true);
             break;
-        case AST_NOTOP:
-            compile(S, fn, ast->node1);
-            emit(fn, OP_NOT, ast->lineno);
+        case AST_NOTOP: {
+            const size_t operand = fn->codesize;
+            compile_node(S, fn, P, ast_kid(P, ast, 0));
+            emit_not(fn, operand, ast->lineno);
             break;
+        }
         case AST_LONG:
             emitlong(fn, ast->val.lint, ast->lineno);
             break;
@@ -572,19 +943,19 @@ Function* compile(State* S, Function* fn, AST* ast)
             compile_varexpr(fn, ast);
             break;
         case AST_ASSIGNMENT:
-            compile_assignmentexpr(S, fn, ast);
+            compile_assignmentexpr(S, fn, P, ast);
             break;
         case AST_CONSTDECL:
-            compile_constdecl(S, fn, ast);
+            compile_constdecl(S, fn, P, ast);
             break;
         case AST_HTML:
             compile_html(fn, ast);
             break;
         case AST_WHILE:
-            compile_whilestmt(S, fn, ast);
+            compile_whilestmt(S, fn, P, ast);
             break;
         case AST_FOR:
-            compile_forstmt(S, fn, ast);
+            compile_forstmt(S, fn, P, ast);
             break;
         case AST_IDENTIFIER:
             compile_constant(fn, ast);
@@ -592,36 +963,148 @@ Function* compile(State* S, Function* fn, AST* ast)
         default:
             compiletimeerror("Unexpected Type '%s'", get_ASTTYPE_name(ast->type));
     }
+}
+
+static void optimize_function(State* S, Function* fn, const char* name, bool fresh_frame)
+{
+    size_t dead = optimize(S, fn);
+    if (S->options.optimize) {
+        const SsaStats stats = optimize_ssa(S, fn, fresh_frame);
+        dead += optimize(S, fn); // Branches decided by constants
+        if (S->options.verbose && (stats.folded || stats.reused || stats.copies || stats.stores)) {
+            fprintf(stderr, "%s: folded %zu, reused %zu, propagated %zu copies, removed %zu stores\n",
+                    name, stats.folded, stats.reused, stats.copies, stats.stores);
+        }
+    }
+    if (S->options.verbose && dead) {
+        fprintf(stderr, "%s: removed %zu bytes of dead code\n", name, dead);
+    }
+    const size_t hoisted = hoist_invariants(S, fn);
+    if (S->options.verbose && hoisted) {
+        fprintf(stderr, "%s: hoisted %zu loop invariants\n", name, hoisted);
+    }
+}
+
+// Compiles the root of program into fn and optimizes the resulting code
+Function* compile(State* S, Function* fn, const Program* program)
+{
+    const size_t first = S->funlen;
+    compile_body(S, fn, program, ast_node(program, program->root));
+
+    optimize_function(S, fn, "<pseudomain>", false);
+    specialize_types(fn, false);
+    for (size_t i = first; i < S->funlen; ++i) { // Functions declared in program
+        if (S->functions[i].type == FUNCTION) {
+            optimize_function(S, S->functions[i].u.function, symbol_name(S->functions[i].name), true);
+            specialize_types(S->functions[i].u.function, true);
+        }
+    }
 
     return fn;
 }
 
+// A call to a user Function right before OP_RETURN becomes OP_TAILCALL,
+// which runs the callee in the frame of fn. The pseudomain keeps its frame,
+// it holds the globals.
+static void mark_tail_calls(State* S, Function* fn)
+{
+    if (fn == S->functions[0].u.function) {
+        return;
+    }
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        codepoint_t* ip = fn->code + pos;
+        if (*ip == OP_CALL_DIRECT && pos + op_len(OP_CALL_DIRECT) < fn->codesize
+            && ip[op_len(OP_CALL_DIRECT)] == OP_RETURN
+            && S->functions[fetch32(ip + 1)].type == FUNCTION) {
+            *ip = OP_TAILCALL;
+        }
+    }
+}
+
+// Rewrites every OP_CALL compiled since the last call into OP_CALL_DIRECT
+// with the index of its callee in S->functions, then inlines the small ones,
+// see inline_calls, and marks tail calls. Calls to functions that are still
+// unknown stay OP_CALL, which looks the name up again when executed, and are
+// linked again by the next call. Returns false after reporting a parameter
+// count mismatch.
+bool link_calls(State* S, const char* file)
+{
+    bool ret = true;
+    for (size_t i = 0; i < S->calllen && ret; ++i) {
+        codepoint_t* call = S->calls[i].fn->code + S->calls[i].position;
+        assert(*call == OP_CALL);
+        const FunctionWrapper* callee = find_function(S, fetch32(call + 1));
+        if (!callee) {
+            continue;
+        }
+
+        const uint8_t param_count = fetch8(call + 5);
+        if (callee->type == FUNCTION && param_count != callee->u.function->paramlen) {
+            printf("Fatal Error: Parameter number mismatch. %u expected, %u given in %s:%u\n",
+                   callee->u.function->paramlen, param_count, file,
+                   find_line(&S->calls[i].fn->lines, S->calls[i].position));
+            ret = false;
+        }
+        const size_t index = (size_t) (callee - S->functions);
+        if ((uint32_t) index != index) {
+            compiletimeerror("Too many functions");
+        }
+        *call = OP_CALL_DIRECT;
+        *(uint32_t*)(call + 1) = htole32((uint32_t) index);
+    }
+    for (size_t i = 0; i < S->calllen && ret; ++i) {
+        Function* fn = S->calls[i].fn;
+        bool seen = false; // Each caller once, if it has a call linked now
+        bool linked = false;
+        for (size_t j = 0; j < S->calllen && !seen; ++j) {
+            seen = j < i && S->calls[j].fn == fn;
+            linked |= S->calls[j].fn == fn && fn->code[S->calls[j].position] != OP_CALL;
+        }
+        if (!seen && linked) {
+            inline_calls(S, fn);
+            mark_tail_calls(S, fn);
+            free_regcode(fn->regcode); // Translated when it ran before
+            fn->regcode = NULL;
+        }
+    }
+
+    size_t kept = 0; // Sites still waiting for their callee
+    for (size_t i = 0; i < S->calllen; ++i) {
+        if (S->calls[i].fn->code[S->calls[i].position] == OP_CALL) {
+            S->calls[kept++] = S->calls[i];
+        }
+    }
+    S->calllen = kept;
+
+    return ret;
+}
+
 void print_state(State* S)
 {
     for (size_t i = 0; i < S->funlen; ++i) {
         FunctionWrapper fn = S->functions[i];
         if (S->functions[i].type == FUNCTION) {
-            print_code(fn.u.function, fn.name);
+            print_code(fn.u.function, symbol_name(fn.name));
         } else {
-            printf("CFunction %s\n", fn.name);
+            printf("CFunction %s\n", symbol_name(fn.name));
         }
     }
 }
 
-void print_code(Function* fn, char* name)
+void print_code(Function* fn, const char* name)
 {
     codepoint_t* ip = fn->code;
-    int64_t lint;
     fprintf(stderr, "Function: %s (line %u)\n", name, fn->lineno_defined);
 
     fprintf(stderr, "Addr:lineno| code                                   ; Bytecode");
     fprintf(stderr, "\n---------------------------------------------------------------------\n");
     while ((size_t)(ip - fn->code) < fn->codesize) {
         fprintf(stderr, "%04lx: ", ip - fn->code);
-        if (ip > fn->code && fn->lineinfo[ip - fn->code] == fn->lineinfo[ip - fn->code - 1]) {
+        const lineno_t line = find_line(&fn->lines, ip - fn->code);
+        if (ip > fn->code && line == find_line(&fn->lines, ip - fn->code - 1)) {
             fprintf(stderr, "     |");
         } else {
-            fprintf(stderr, "%04d |", fn->lineinfo[ip - fn->code]);
+            fprintf(stderr, "%04d |", line);
         }
         Operator op = (Operator)*ip;
         const char* opname = get_Operator_name(op);
@@ -633,54 +1116,88 @@ void print_code(Function* fn, char* name)
             chars_written += fprintf(stderr, "%s ", opname);
         }
         switch (*ip++) {
-            case OP_STR:
-                assert(*ip < fn->strlen);
-                uint16_t strpos = fetch16(ip);
-                bytes[1] = *ip++;
-                bytes[2] = *ip++;
-                char* escaped_string = malloc((strlen(fn->strs[strpos]) * 2 + 1) * sizeof(char));
-                escaped_str(escaped_string, fn->strs[strpos]);
+            case OP_CONST:
+                assert(fetch32(ip) < fn->consts.size);
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                Variant value = fn->consts.values[fetch32(ip)];
+                ip += 4;
+                if (value.type == TYPE_LONG) {
+                    chars_written += fprintf(stderr, "%" PRId64, value.u.lint);
+                    break;
+                }
+                char* escaped_string = malloc((strlen(value.u.str) * 2 + 1) * sizeof(char));
+                escaped_str(escaped_string, value.u.str);
                 chars_written += fprintf(stderr, "\"%s\"", escaped_string);
                 free(escaped_string);
                 break;
             case OP_CALL:
-                bytes[1] = fetch8(ip);
-                chars_written += fprintf(stderr, "%d", fetch8(ip));
-                ++ip;
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                bytes[5] = fetch8(ip + 4);
+                chars_written += fprintf(stderr, "%s(%d)", symbol_name(fetch32(ip)), fetch8(ip + 4));
+                ip += 5;
                 break;
-            case OP_LONG:
-                lint = (int64_t) fetch64(ip);
-                *(uint64_t*)(bytes + 1) = *(uint64_t*)ip;
-                ip += 8;
-                chars_written += fprintf(stderr, "%" PRId64, lint);
+            case OP_CALL_DIRECT:
+            case OP_TAILCALL:
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                bytes[5] = fetch8(ip + 4);
+                chars_written += fprintf(stderr, "#%u(%d)", fetch32(ip), fetch8(ip + 4));
+                ip += 5;
                 break;
-            case OP_ASSIGN:
-                *(uint16_t*)(bytes + 1) = fetch16(ip);
-                assert(*ip < fn->strlen);
-                chars_written += fprintf(stderr, "$%s = pop()", fn->strs[fetch16(ip)]);
-                ip += 2;
+            case OP_STORE_SLOT:
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                chars_written += fprintf(stderr, "$%s = pop()",
+                                         symbol_name(fn->locals.names[fetch32(ip)]));
+                ip += 4;
                 break;
-            case OP_LOOKUP:
-                *(uint16_t*)(bytes + 1) = fetch16(ip);
-                assert(*ip < fn->strlen);
-                chars_written += fprintf(stderr, "$%s", fn->strs[fetch16(ip)]);
-                ip += 2;
+            case OP_LOAD_SLOT:
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                chars_written += fprintf(stderr, "$%s", symbol_name(fn->locals.names[fetch32(ip)]));
+                ip += 4;
+                break;
+            case OP_INC_SLOT:
+            case OP_DEC_SLOT:
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                chars_written += fprintf(stderr, "$%s%s", symbol_name(fn->locals.names[fetch32(ip)]),
+                                         op == OP_INC_SLOT ? "++" : "--");
+                ip += 4;
+                break;
+            case OP_ADD_SLOT:
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                *(uint32_t*)(bytes + 5) = fetch32(ip + 4);
+                chars_written += fprintf(stderr, "$%s += %" PRId64,
+                                         symbol_name(fn->locals.names[fetch32(ip)]),
+                                         fn->consts.values[fetch32(ip + 4)].u.lint);
+                ip += 8;
+                break;
+            case OP_APPEND_SLOT:
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                chars_written += fprintf(stderr, "$%s .= pop()",
+                                         symbol_name(fn->locals.names[fetch32(ip)]));
+                ip += 4;
                 break;
             case OP_CLOOKUP:
-                *(uint16_t*)(bytes + 1) = fetch16(ip);
-                assert(*ip < fn->strlen);
-                chars_written += fprintf(stderr, "%s", fn->strs[fetch16(ip)]);
-                ip += 2;
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
+                chars_written += fprintf(stderr, "%s", symbol_name(fetch32(ip)));
+                ip += 4;
                 break;
             case OP_CONSTDECL:
-                *(uint16_t*)(bytes + 1) = fetch16(ip);
-                assert(*ip < fn->strlen);
+                *(uint32_t*)(bytes + 1) = fetch32(ip);
                 chars_written +=
-                    fprintf(stderr, "%s = pop()", fn->strs[fetch16(ip)]);
-                ip += 2;
+                    fprintf(stderr, "%s = pop()", symbol_name(fetch32(ip)));
+                ip += 4;
                 break;
             case OP_JMP:
             case OP_JMPZ:
+            case OP_JLT:
+            case OP_JLE:
+            case OP_JGT:
+            case OP_JGE:
+            case OP_JEQ:
+            case OP_JNE:
+            case OP_JLT_LL:
+            case OP_JLE_LL:
+            case OP_JGT_LL:
+            case OP_JGE_LL:
                 *(uint32_t*)(bytes+1) = fetch32(ip);
                 chars_written += fprintf(stderr, ":%04x", fetch32(ip));
                 ip += 4;
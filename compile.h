@@ -8,14 +8,17 @@
 #include "crossplatform/stdnoreturn.h"
 #include "crossplatform/std.h"
 #include "stack.h"
+#include "constpool.h"
+#include "linetable.h"
 
 #define ENUM_OPERATOR(ENUM_EL) \
         ENUM_EL(OP_INVALID, = 0) \
         ENUM_EL(OP_RETURN,) \
         ENUM_EL(OP_CALL,)  \
+        ENUM_EL(OP_CALL_DIRECT,) \
+        ENUM_EL(OP_TAILCALL,) /* OP_CALL_DIRECT of return f(...), reuses the frame */ \
         ENUM_EL(OP_ECHO,) \
-        ENUM_EL(OP_STR,) \
-        ENUM_EL(OP_LONG,) \
+        ENUM_EL(OP_CONST,) \
         ENUM_EL(OP_TRUE,) \
         ENUM_EL(OP_FALSE,) \
         ENUM_EL(OP_NULL,)  \
@@ -30,47 +33,105 @@
         ENUM_EL(OP_CONCAT,) \
         ENUM_EL(OP_SUB,) \
         ENUM_EL(OP_ADD,) \
-        ENUM_EL(OP_ADD1,) \
-        ENUM_EL(OP_SUB1,) \
         ENUM_EL(OP_MUL,) \
         ENUM_EL(OP_DIV,) \
         ENUM_EL(OP_SHL,) \
         ENUM_EL(OP_SHR,) \
-        ENUM_EL(OP_ASSIGN,) \
-        ENUM_EL(OP_LOOKUP,) \
+        ENUM_EL(OP_LOAD_SLOT,) \
+        ENUM_EL(OP_STORE_SLOT,) \
+        ENUM_EL(OP_INC_SLOT,) \
+        ENUM_EL(OP_DEC_SLOT,) \
+        ENUM_EL(OP_ADD_SLOT,) \
+        ENUM_EL(OP_APPEND_SLOT,) \
         ENUM_EL(OP_CLOOKUP,) \
         ENUM_EL(OP_CONSTDECL,) \
         ENUM_EL(OP_DUP,)    \
+        ENUM_EL(OP_POP,) \
         ENUM_EL(OP_JMP,) \
         ENUM_EL(OP_JMPZ,) \
+        ENUM_EL(OP_JLT,) \
+        ENUM_EL(OP_JLE,) \
+        ENUM_EL(OP_JGT,) \
+        ENUM_EL(OP_JGE,) \
+        ENUM_EL(OP_JEQ,) \
+        ENUM_EL(OP_JNE,) \
         ENUM_EL(OP_CAST,) \
         ENUM_EL(OP_GETLINE,) \
         ENUM_EL(OP_NOP,) \
+        ENUM_EL(OP_ADD_LL,) /* Operands proven to be longs, see specialize_types */ \
+        ENUM_EL(OP_SUB_LL,) \
+        ENUM_EL(OP_MUL_LL,) \
+        ENUM_EL(OP_LT_LL,) \
+        ENUM_EL(OP_LTE_LL,) \
+        ENUM_EL(OP_GT_LL,) \
+        ENUM_EL(OP_GTE_LL,) \
+        ENUM_EL(OP_JLT_LL,) \
+        ENUM_EL(OP_JLE_LL,) \
+        ENUM_EL(OP_JGT_LL,) \
+        ENUM_EL(OP_JGE_LL,) \
         ENUM_EL(OP_MAX_VALUE,)
 
 DECLARE_ENUM(Operator, ENUM_OPERATOR);
 
+// OP_CALL waiting for link_calls to resolve its callee
+typedef struct CallSite {
+    struct Function* fn;
+    size_t position;
+} CallSite;
+
+// Switches from the command line
+typedef struct Options {
+    bool registers; // Run Functions through their RegCode
+    bool verbose; // Report what the optimizer did on stderr
+    bool optimize; // Run the SSA tier on every Function, see optimize_ssa
+} Options;
+
 typedef struct State {
     struct FunctionWrapper* functions;
     size_t funlen;
     size_t funcapacity;
+
+    CallSite* calls;
+    size_t calllen;
+    size_t callcapacity;
+
+    Options options;
 } State;
 
+// Variables of a Function, each one gets a slot in the frame. Parameters
+// take the first slots.
+typedef struct Locals {
+    symbol_t* names; // Indexed by slot
+    uint32_t size;
+    uint32_t capacity;
+
+    uint32_t* buckets; // Open addressing over names, NO_SLOT if empty
+    uint32_t bucketcount;
+} Locals;
+
+#define NO_SLOT ((uint32_t) -1)
+
 typedef struct Function {
     lineno_t lineno_defined;
     uint8_t paramlen;
-    char** params;
+    Locals locals;
 
     size_t codesize;
     size_t codecapacity;
     codepoint_t* code;
-    lineno_t* lineinfo;
+    LineTable lines;
 
-    char** strs;
-    uint16_t strlen;
-    uint16_t strcapacity;
+    ConstPool consts;
+
+    // Constants declared with a literal at the top level of the body, so
+    // OP_CLOOKUP after the declaration can be replaced by the value
+    Variable* knownconsts;
+    size_t knownlen;
+    size_t knowncapacity;
 
     lineno_t lastline;
+
+    struct RegCode* regcode; // Translated on the first run with registers
 } Function;
 
 enum FUNCTION_TYPE {
@@ -79,7 +140,7 @@ enum FUNCTION_TYPE {
 };
 
 typedef struct FunctionWrapper {
-    char* name;
+    symbol_t name;
     enum FUNCTION_TYPE type;
     union {
         Function* function;
@@ -93,19 +154,24 @@ _Static_assert((codepoint_t) OP_MAX_VALUE == OP_MAX_VALUE, "OP must fit into cod
 
 Function* create_function();
 void free_function(Function* fn);
-FunctionWrapper wrap_function(Function* fn, char* name);
-FunctionWrapper wrap_cfunction(CFunction* fn, char* name);
+void clear_code(Function* fn);
+FunctionWrapper wrap_function(Function* fn, symbol_t name);
+FunctionWrapper wrap_cfunction(CFunction* fn, symbol_t name);
 
 State* create_state();
 void destroy_state(State*);
 
-Function* compile(State* S, Function* fn, AST* root);
+Function* compile(State* S, Function* fn, const Program* program);
+bool link_calls(State* S, const char* file);
 void addfunction(State* S, FunctionWrapper fn);
+FunctionWrapper* find_function(State* S, symbol_t name);
 
 _Noreturn void compiletimeerror(char* fmt, ...);
 
 void print_state(State*);
-void print_code(Function* fn, char* name);
+void print_code(Function* fn, const char* name);
+uint32_t add_temp_slot(Function* fn);
+uint32_t local_slot(Function* fn, symbol_t name);
 
 
 static inline uint8_t fetch8(const codepoint_t* ip)
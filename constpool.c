@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include "constpool.h"
+
+static _Noreturn void constpool_oom(void)
+{
+    puts("Out of memory in constant pool");
+    abort();
+}
+
+static uint32_t hash_const(Variant value)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    if (value.type == TYPE_STRING) {
+        for (const char* c = value.u.str; *c; ++c) {
+            hash ^= (unsigned char) *c;
+            hash *= 16777619u;
+        }
+    } else {
+        uint64_t lint = (uint64_t) value.u.lint;
+        for (int i = 0; i < 8; ++i, lint >>= 8) {
+            hash ^= (uint32_t) (lint & 0xff);
+            hash *= 16777619u;
+        }
+    }
+
+    return hash ^ (uint32_t) value.type;
+}
+
+static bool const_equal(Variant lhs, Variant rhs)
+{
+    if (lhs.type != rhs.type) {
+        return false;
+    }
+    if (lhs.type == TYPE_STRING) {
+        return strcmp(lhs.u.str, rhs.u.str) == 0;
+    }
+
+    return lhs.u.lint == rhs.u.lint;
+}
+
+static void insert_bucket(ConstPool* pool, uint32_t idx)
+{
+    const uint32_t mask = pool->bucketcount - 1;
+    uint32_t bucket = hash_const(pool->values[idx]) & mask;
+    while (pool->buckets[bucket] != NO_CONST) {
+        bucket = (bucket + 1) & mask;
+    }
+    pool->buckets[bucket] = idx;
+}
+
+static void grow_buckets(ConstPool* pool)
+{
+    const uint32_t count = pool->bucketcount ? pool->bucketcount * 2 : 16;
+    uint32_t* buckets = malloc(count * sizeof(*buckets));
+    if (!buckets) constpool_oom();
+    for (uint32_t i = 0; i < count; ++i) {
+        buckets[i] = NO_CONST;
+    }
+
+    free(pool->buckets);
+    pool->buckets = buckets;
+    pool->bucketcount = count;
+    for (uint32_t i = 0; i < pool->size; ++i) {
+        insert_bucket(pool, i);
+    }
+}
+
+void init_constpool(ConstPool* pool)
+{
+    pool->values = NULL;
+    pool->size = pool->capacity = 0;
+    pool->buckets = NULL;
+    pool->bucketcount = 0;
+}
+
+// Takes ownership of a string value, which is freed if it is a duplicate.
+// Only strings and longs are pooled.
+uint32_t add_const(ConstPool* pool, Variant value)
+{
+    assert(value.type == TYPE_STRING || value.type == TYPE_LONG);
+    if (pool->bucketcount) {
+        const uint32_t mask = pool->bucketcount - 1;
+        for (uint32_t bucket = hash_const(value) & mask; pool->buckets[bucket] != NO_CONST;
+             bucket = (bucket + 1) & mask) {
+            const uint32_t idx = pool->buckets[bucket];
+            if (const_equal(pool->values[idx], value)) {
+                if (value.type == TYPE_STRING) {
+                    free(value.u.str);
+                }
+                return idx;
+            }
+        }
+    }
+
+    if (pool->size + 1 >= NO_CONST) constpool_oom();
+    if (pool->size == pool->capacity) {
+        pool->capacity = pool->capacity ? pool->capacity * 2 : 8;
+        Variant* tmp = realloc(pool->values, pool->capacity * sizeof(*tmp));
+        if (!tmp) constpool_oom();
+        pool->values = tmp;
+    }
+
+    const uint32_t ret = pool->size++;
+    pool->values[ret] = value;
+    if (pool->size * 2 > pool->bucketcount) {
+        grow_buckets(pool); // Inserts the new constant as well
+    } else {
+        insert_bucket(pool, ret);
+    }
+
+    return ret;
+}
+
+// Drops all constants but keeps the memory
+void clear_constpool(ConstPool* pool)
+{
+    for (uint32_t i = 0; i < pool->size; ++i) {
+        if (pool->values[i].type == TYPE_STRING) {
+            free(pool->values[i].u.str);
+        }
+    }
+    pool->size = 0;
+    for (uint32_t i = 0; i < pool->bucketcount; ++i) {
+        pool->buckets[i] = NO_CONST;
+    }
+}
+
+void free_constpool(ConstPool* pool)
+{
+    clear_constpool(pool);
+    free(pool->values);
+    free(pool->buckets);
+    init_constpool(pool);
+}
@@ -0,0 +1,25 @@
+#ifndef PHPINTERP_CONSTPOOL_H
+#define PHPINTERP_CONSTPOOL_H
+
+#include <stdint.h>
+#include "stack.h"
+
+// Literals of a Function, loaded by OP_CONST <u32 index>. Equal constants
+// share one entry.
+typedef struct ConstPool {
+    Variant* values;
+    uint32_t size;
+    uint32_t capacity;
+
+    uint32_t* buckets; // Open addressing over values, NO_CONST if empty
+    uint32_t bucketcount;
+} ConstPool;
+
+#define NO_CONST ((uint32_t) -1)
+
+void init_constpool(ConstPool*);
+uint32_t add_const(ConstPool*, Variant value);
+void clear_constpool(ConstPool*);
+void free_constpool(ConstPool*);
+
+#endif //PHPINTERP_CONSTPOOL_H
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "optimize.h"
+#include "op_util.h"
+#include "run.h"
+#include "symbol.h"
+
+// Inlining of small user functions. A linked call to a leaf Function, one
+// that calls nothing, neither declares nor looks up constants and writes
+// every local before reading it, is replaced by the body of the callee. The
+// arguments are stored to slots of the caller named after the callee's
+// locals, and returns jump past the body with the value on the stack. The
+// body keeps the lines of the callee.
+
+#define INLINE_MAX_SIZE 160 // Bytes of callee code
+
+typedef struct Flow {
+    bool visited;
+    uint32_t depth;
+    bool* assigned; // Per slot
+} Flow;
+
+static bool reads_slot(Operator op)
+{
+    switch (op) {
+        case OP_LOAD_SLOT:
+        case OP_INC_SLOT:
+        case OP_DEC_SLOT:
+        case OP_ADD_SLOT:
+        case OP_APPEND_SLOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Merges into the state at target, returns whether it has to be visited
+// (again). Stack depths have to agree.
+static bool flow_to(Flow* flow, const Flow* from, uint32_t slots, bool* ok)
+{
+    if (!flow->visited) {
+        flow->visited = true;
+        flow->depth = from->depth;
+        memcpy(flow->assigned, from->assigned, slots);
+        return true;
+    }
+    *ok &= flow->depth == from->depth;
+
+    bool changed = false;
+    for (uint32_t i = 0; i < slots; ++i) {
+        changed |= flow->assigned[i] && !from->assigned[i];
+        flow->assigned[i] &= from->assigned[i];
+    }
+    return changed;
+}
+
+// Checks every path through callee, which is small enough to track a state
+// per position. Locals are only read where all paths wrote them before and
+// every OP_RETURN leaves just the return value on the stack.
+static bool well_formed(const Function* callee)
+{
+    const size_t size = callee->codesize;
+    const uint32_t slots = callee->locals.size;
+    Flow* flows = calloc(size, sizeof(*flows));
+    bool* assigned = calloc(size * slots + 1, sizeof(*assigned));
+    size_t* worklist = malloc(size * sizeof(*worklist));
+    bool* queued = calloc(size, sizeof(*queued));
+    Flow current = {true, 0, malloc(slots + 1)};
+    if (!flows || !assigned || !worklist || !queued || !current.assigned) optimizer_oom();
+    for (size_t pos = 0; pos < size; ++pos) {
+        flows[pos].assigned = assigned + pos * slots;
+    }
+
+    bool ok = true;
+    size_t pending = 0;
+    memset(current.assigned, 0, slots);
+    memset(current.assigned, 1, callee->paramlen);
+    flow_to(&flows[0], &current, slots, &ok);
+    worklist[pending++] = 0;
+    queued[0] = true;
+    while (pending && ok) {
+        const size_t pos = worklist[--pending];
+        queued[pos] = false;
+        const codepoint_t* ip = callee->code + pos;
+        const Operator op = (Operator) *ip;
+        current.depth = flows[pos].depth;
+        memcpy(current.assigned, flows[pos].assigned, slots);
+
+        if (reads_slot(op) && !current.assigned[op_slot(ip)]) {
+            ok = false;
+        } else if (op_pops(ip) > current.depth || (op == OP_RETURN && current.depth != 1)) {
+            ok = false;
+        }
+        if (!ok || op == OP_RETURN) {
+            continue;
+        }
+        if (op_slot(ip) != NO_SLOT) {
+            current.assigned[op_slot(ip)] = true;
+        }
+        current.depth += op_pushes(ip) - op_pops(ip);
+
+        size_t targets[2];
+        size_t count = 0;
+        if (!(op_flags(op) & OPF_TERMINATOR)) {
+            targets[count++] = pos + op_len(op);
+        }
+        if (op_flags(op) & OPF_JUMP) {
+            targets[count++] = op_jump_target(ip);
+        }
+        for (size_t i = 0; i < count && ok; ++i) {
+            ok = targets[i] < size; // Falling off the end returns nothing
+            if (ok && flow_to(&flows[targets[i]], &current, slots, &ok) && !queued[targets[i]]) {
+                queued[targets[i]] = true;
+                worklist[pending++] = targets[i];
+            }
+        }
+    }
+
+    free(flows);
+    free(assigned);
+    free(worklist);
+    free(queued);
+    free(current.assigned);
+    return ok;
+}
+
+static bool inlinable(const Function* callee)
+{
+    if (!callee->codesize || callee->codesize > INLINE_MAX_SIZE) {
+        return false;
+    }
+    for (size_t pos = 0; pos < callee->codesize; pos += op_len((Operator) callee->code[pos])) {
+        switch ((Operator) callee->code[pos]) {
+            case OP_CALL:
+            case OP_CALL_DIRECT:
+            case OP_TAILCALL:
+            case OP_CLOOKUP:
+            case OP_CONSTDECL:
+                return false;
+            default:
+                break;
+        }
+    }
+    return well_formed(callee);
+}
+
+// Callee of the linked call at ip if it can be inlined into fn, else NULL
+static const FunctionWrapper* inline_callee(const State* S, const Function* fn, const codepoint_t* ip)
+{
+    if ((Operator) *ip != OP_CALL_DIRECT) {
+        return NULL;
+    }
+    const FunctionWrapper* callee = &S->functions[fetch32(ip + 1)];
+    if (callee->type != FUNCTION || callee->u.function == fn || !inlinable(callee->u.function)) {
+        return NULL;
+    }
+    return callee;
+}
+
+// Slot of fn standing for slot of the callee. Every call site of a callee
+// shares them, as inlined bodies never overlap.
+static uint32_t renamed_slot(Function* fn, const FunctionWrapper* callee, uint32_t slot)
+{
+    const char* calleename = symbol_name(callee->name);
+    const char* localname = symbol_name(callee->u.function->locals.names[slot]);
+    const size_t length = strlen(calleename) + strlen(localname) + 4;
+    char* name = malloc(length);
+    if (!name) optimizer_oom();
+    snprintf(name, length, "<%s:%s>", calleename, localname);
+    const uint32_t ret = local_slot(fn, intern_cstr(name));
+    free(name);
+    return ret;
+}
+
+static const char* function_name(const State* S, const Function* fn)
+{
+    for (size_t i = 0; i < S->funlen; ++i) {
+        if (S->functions[i].type == FUNCTION && S->functions[i].u.function == fn) {
+            return symbol_name(S->functions[i].name);
+        }
+    }
+    return "?";
+}
+
+typedef struct Emitter {
+    codepoint_t* code;
+    size_t size;
+    size_t capacity;
+    LineTable lines;
+} Emitter;
+
+static void emit_bytes(Emitter* E, const codepoint_t* bytes, size_t length, lineno_t line)
+{
+    if (E->size + length > E->capacity) {
+        E->capacity = (E->size + length) * 2;
+        E->code = realloc(E->code, E->capacity);
+        if (!E->code) optimizer_oom();
+    }
+    memcpy(E->code + E->size, bytes, length);
+    set_line(&E->lines, E->size, line);
+    E->size += length;
+}
+
+static void emit_slot(Emitter* E, Operator op, uint32_t slot, lineno_t line)
+{
+    codepoint_t bytes[5] = {(codepoint_t) op};
+    *(uint32_t*)(bytes + 1) = htole32(slot);
+    emit_bytes(E, bytes, op_len(op), line);
+}
+
+// Copies the body of callee in place of a call with its arguments on the
+// stack. Jumps inside the body are fixed right away, as they never leave it.
+static void emit_body(Emitter* E, Function* fn, const FunctionWrapper* wrapper, lineno_t line)
+{
+    const Function* callee = wrapper->u.function;
+    for (uint32_t i = callee->paramlen; i-- > 0;) { // Last argument on top
+        emit_slot(E, OP_STORE_SLOT, renamed_slot(fn, wrapper, i), line);
+    }
+
+    // A return becomes a jump past the body. At the very end it becomes
+    // nothing, or an OP_NOP behind an instruction of one byte: the line of
+    // that one is looked up at the position after it, see OP_GETLINE.
+    size_t* map = malloc((callee->codesize + 1) * sizeof(*map));
+    if (!map) optimizer_oom();
+    const size_t start = E->size;
+    size_t size = 0;
+    size_t previous = 0;
+    for (size_t pos = 0; pos < callee->codesize; pos += op_len((Operator) callee->code[pos])) {
+        const Operator op = (Operator) callee->code[pos];
+        const bool last = pos + op_len(op) == callee->codesize;
+        map[pos] = size;
+        if (op != OP_RETURN) {
+            size += op_len(op);
+        } else if (!last) {
+            size += op_len(OP_JMP);
+        } else if (pos - previous == 1) {
+            size += op_len(OP_NOP);
+        }
+        previous = pos;
+    }
+    map[callee->codesize] = size;
+
+    for (size_t pos = 0; pos < callee->codesize; pos += op_len((Operator) callee->code[pos])) {
+        const codepoint_t* ip = callee->code + pos;
+        const Operator op = (Operator) *ip;
+        const lineno_t calleeline = find_line(&callee->lines, pos);
+        codepoint_t bytes[9];
+        memcpy(bytes, ip, op_len(op));
+        if (op == OP_RETURN) {
+            if (pos + op_len(op) == callee->codesize) {
+                if (start + size > E->size) {
+                    bytes[0] = OP_NOP;
+                    emit_bytes(E, bytes, op_len(OP_NOP), calleeline);
+                }
+                continue;
+            }
+            bytes[0] = OP_JMP;
+            *(uint32_t*)(bytes + 1) = htole32((uint32_t) (start + size));
+            emit_bytes(E, bytes, op_len(OP_JMP), calleeline);
+            continue;
+        }
+        if (op_slot(ip) != NO_SLOT) {
+            *(uint32_t*)(bytes + 1) = htole32(renamed_slot(fn, wrapper, op_slot(ip)));
+        }
+        if (op == OP_CONST) {
+            const uint32_t index = add_const(&fn->consts, cpy_var(callee->consts.values[fetch32(ip + 1)]));
+            *(uint32_t*)(bytes + 1) = htole32(index);
+        } else if (op == OP_ADD_SLOT) {
+            const uint32_t index = add_const(&fn->consts, cpy_var(callee->consts.values[fetch32(ip + 5)]));
+            *(uint32_t*)(bytes + 5) = htole32(index);
+        }
+        if (op_flags(op) & OPF_JUMP) {
+            op_set_jump_target(bytes, (uint32_t) (start + map[op_jump_target(ip)]));
+        }
+        emit_bytes(E, bytes, op_len(op), calleeline);
+    }
+    free(map);
+}
+
+// Replaces the calls in fn that can be inlined by the body of the callee.
+// Returns their number.
+size_t inline_calls(State* S, Function* fn)
+{
+    size_t sites = 0;
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        sites += inline_callee(S, fn, fn->code + pos) != NULL;
+    }
+    if (!sites) {
+        return 0;
+    }
+
+    Emitter E = {NULL, 0, 0, {0}};
+    init_linetable(&E.lines);
+    uint32_t* map = malloc((fn->codesize + 1) * sizeof(*map)); // Old to new position
+    if (!map) optimizer_oom();
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        const codepoint_t* ip = fn->code + pos;
+        const lineno_t line = find_line(&fn->lines, pos);
+        const FunctionWrapper* callee = inline_callee(S, fn, ip);
+        map[pos] = (uint32_t) E.size;
+        if (callee) {
+            if (S->options.verbose) {
+                fprintf(stderr, "%s: inlined %s at line %u\n", function_name(S, fn),
+                        symbol_name(callee->name), line);
+            }
+            emit_body(&E, fn, callee, line);
+            continue;
+        }
+        emit_bytes(&E, ip, op_len((Operator) *ip), line);
+    }
+    map[fn->codesize] = (uint32_t) E.size;
+    for (size_t i = 0; i < S->calllen; ++i) {
+        if (S->calls[i].fn == fn) {
+            S->calls[i].position = map[S->calls[i].position];
+        }
+    }
+
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if (op_flags((Operator) fn->code[pos]) & OPF_JUMP) {
+            op_set_jump_target(E.code + map[pos], map[op_jump_target(fn->code + pos)]);
+        }
+    }
+
+    free(fn->code);
+    free_linetable(&fn->lines);
+    fn->code = E.code;
+    fn->codesize = E.size;
+    fn->codecapacity = E.capacity;
+    fn->lines = E.lines;
+    free(map);
+    return sites;
+}
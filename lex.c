@@ -7,38 +7,81 @@
 #include <string.h>
 #include "lex.h"
 #include "util.h"
+#include "scan.h"
+#include "array-util.h"
 
 
-static char* resize_str(char* str, size_t previous_size, size_t new_size)
+static int is_whitespace(int c)
 {
-    assert(new_size > previous_size);
-    char* tmp = realloc(str, new_size);
-    if (!tmp) {
-        perror("resizing str failed.");
-        free(str);
-        return NULL;
-    }
-    memset(&tmp[previous_size], 0, new_size - 1 - previous_size);
-
-    return tmp;
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
-static int is_not_open_tag(int c)
+// Window of a stream lexer. Tokens up to half of it never grow the window,
+// longer ones do and it shrinks back once they are consumed.
+#define STREAM_WINDOW (64 * 1024)
+
+// Appends more input to a stream window, growing it if it is full.
+// Offsets into the window stay valid. Returns false at the end of input.
+static bool refill(Lexer* S)
 {
-    return c != '<';
-}
+    if (!S->stream) {
+        return false;
+    }
+    if (S->srclen == S->capacity) {
+        char* window = realloc(S->window, S->capacity * 2);
+        if (!window) {
+            return false;
+        }
+        S->window = window;
+        S->src = window;
+        S->capacity *= 2;
+    }
 
+    fflush(stdout); // Output so far shows up before waiting for more input
+    const size_t read = read_available(S->stream, S->window + S->srclen,
+                                       S->capacity - S->srclen);
+    if (read == 0) {
+        S->stream = NULL; // Not owned, the caller closes it
+        return false;
+    }
+    S->srclen += read;
 
-static int is_whitespace(int c)
+    return true;
+}
+
+// Drops the consumed front of a stream window. Only called between tokens,
+// when no offsets into the window are held anymore.
+static void compact_window(Lexer* S)
 {
-    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    const size_t consumed = S->pos - 1; // lexchar has been read already
+    if (!S->window || consumed < S->capacity / 2) {
+        return;
+    }
+
+    const size_t remaining = S->srclen - consumed;
+    memmove(S->window, S->window + consumed, remaining);
+    S->srclen = remaining;
+    S->pos -= consumed;
+    if (S->capacity > STREAM_WINDOW && remaining < STREAM_WINDOW / 2) {
+        char* window = realloc(S->window, STREAM_WINDOW);
+        if (window) {
+            S->window = window;
+            S->src = window;
+            S->capacity = STREAM_WINDOW;
+        }
+    }
 }
 
 static int get_next_char(Lexer* S)
 {
-    S->lexchar = fgetc(S->file);
-    if (S->lexchar == '\n') {
-        S->lineno++;
+    if (S->pos < S->srclen || (S->pos == S->srclen && refill(S))) {
+        S->lexchar = (unsigned char) S->src[S->pos++];
+        if (S->lexchar == '\n') {
+            S->lineno++;
+        }
+    } else {
+        S->pos = S->srclen + 1;
+        S->lexchar = EOF;
     }
 
     return S->lexchar;
@@ -88,152 +131,279 @@ static Token syntax_error(Lexer* S, char* fmt, ...)
 }
 
 
-static char* str_append(char* str, char append, size_t* size, size_t* capacity)
+// Consumes characters while proceed_condition holds.
+// Returns the offset of the first consumed character.
+static size_t skip_while(Lexer* S, int (*proceed_condition)(int))
 {
-    assert(capacity != NULL && size != NULL);
-    if (*size >= *capacity) {
-        char* tmp = resize_str(str, *capacity, *capacity * 2);
-        if (!tmp) return NULL;
-        *capacity *= 2;
-        str = tmp;
+    const size_t start = S->pos - 1;
+    while (proceed_condition(S->lexchar)) {
+        get_next_char(S);
     }
 
-    str[(*size)++] = append;
+    return start;
+}
+
+// Consumes characters up to the next stop1 or stop2 (or EOF) using the
+// vectorized scanner. Returns the offset of the first consumed character.
+// A stream window is only refilled while the scan is below the offset limit,
+// past it the scan stops with the last byte of the window as lexchar.
+static size_t skip_until(Lexer* S, char stop1, char stop2, size_t limit)
+{
+    const size_t start = S->pos - 1;
+    if (S->lexchar == EOF || S->lexchar == stop1 || S->lexchar == stop2) {
+        return start;
+    }
 
-    return str;
+    size_t stop;
+    for (;;) {
+        size_t newlines = 0;
+        stop = S->pos + scan_until(S->src + S->pos, S->srclen - S->pos,
+                                   stop1, stop2, &newlines);
+        S->lineno += (lineno_t) newlines;
+        S->pos = stop;
+        if (stop < S->srclen || !S->stream) {
+            break;
+        }
+        if (stop >= limit) { // Newlines up to here are counted already
+            S->lexchar = (unsigned char) S->src[stop - 1];
+            return start;
+        }
+        if (!refill(S)) {
+            break;
+        }
+    }
+    get_next_char(S);
+
+    return start;
 }
 
-static char* fetch_str(Lexer* S, int (*proceed_condition)(int))
+// Whether lexchar is the < of a <?php open tag
+static bool at_open_tag(Lexer* S)
 {
-    size_t pos = 0;
-    size_t capacity = 5;
-    char* ret = calloc(capacity, sizeof(char));
-    while (proceed_condition(S->lexchar)) {
-        ret = str_append(ret, (char) S->lexchar, &pos, &capacity);
-        get_next_char(S);
+    if (S->lexchar != '<') {
+        return false;
     }
+    while (S->pos + 4 > S->srclen && refill(S))
+        ;
 
-    ret = str_append(ret, '\0', &pos, &capacity);
+    return S->pos + 4 <= S->srclen && memcmp(S->src + S->pos, "?php", 4) == 0;
+}
+
+static inline size_t span_length(Lexer* S, size_t start)
+{
+    return S->pos - 1 - start;
+}
+
+static char* copy_span(const char* src, size_t length)
+{
+    char* ret = malloc((length + 1) * sizeof(char));
+    if (!ret) {
+        return NULL;
+    }
+    memcpy(ret, src, length);
+    ret[length] = '\0';
 
     return ret;
 }
 
+char* token_strdup(const char* src, Token token)
+{
+    return copy_span(src + token.offset, token.length);
+}
+
+typedef struct Keyword {
+    const char* name;
+    size_t length;
+    TOKENTYPE type;
+} Keyword;
+
+// Perfect hash over first char, last char and length of all keywords.
+// A collision shows up as an overridden initializer in the table below.
+#define KEYWORD_HASH(first, last, length) (((first) + 7 * (last) + (length)) & 15)
+#define KEYWORD(str, first, last, tok)                                         \
+    [KEYWORD_HASH(first, last, sizeof(str) - 1)] = {str, sizeof(str) - 1, tok}
+
+static const Keyword keywords[16] = {
+    KEYWORD("echo", 'e', 'o', TK_ECHO),
+    KEYWORD("function", 'f', 'n', TK_FUNCTION),
+    KEYWORD("return", 'r', 'n', TK_RETURN),
+    KEYWORD("if", 'i', 'f', TK_IF),
+    KEYWORD("else", 'e', 'e', TK_ELSE),
+    KEYWORD("true", 't', 'e', TK_TRUE),
+    KEYWORD("false", 'f', 'e', TK_FALSE),
+    KEYWORD("null", 'n', 'l', TK_NULL),
+    KEYWORD("while", 'w', 'e', TK_WHILE),
+    KEYWORD("for", 'f', 'r', TK_FOR),
+    KEYWORD("const", 'c', 't', TK_CONST),
+};
+
+static TOKENTYPE keyword_type(const char* str, size_t length)
+{
+    if (length < 2 || length > 8) {
+        return TK_IDENTIFIER;
+    }
+
+    const Keyword* keyword = &keywords[KEYWORD_HASH(
+        (unsigned char) str[0], (unsigned char) str[length - 1], length)];
+    if (keyword->length == length && memcmp(keyword->name, str, length) == 0) {
+        return keyword->type;
+    }
+
+    return TK_IDENTIFIER;
+}
 
 static Token lex_ident(Lexer* S)
 {
-    char* str = fetch_str(S, is_str);
-    if (!str) {
-        return syntax_error(S, "Fetching str failed.");
-    }
-
-    TOKENTYPE ret;
-    if (strcmp(str, "echo") == 0) {
-        ret = TK_ECHO;
-    } else if (strcmp(str, "function") == 0) {
-        ret = TK_FUNCTION;
-    } else if (strcmp(str, "return") == 0) {
-        ret = TK_RETURN;
-    } else if (strcmp(str, "if") == 0) {
-        ret = TK_IF;
-    } else if (strcmp(str, "else") == 0) {
-        ret = TK_ELSE;
-    } else if (strcmp(str, "true") == 0) {
-        ret = TK_TRUE;
-    } else if (strcmp(str, "false") == 0) {
-        ret = TK_FALSE;
-    } else if (strcmp(str, "null") == 0) {
-        ret = TK_NULL;
-    } else if (strcmp(str, "while") == 0) {
-        ret = TK_WHILE;
-    } else if (strcmp(str, "for") == 0) {
-        ret = TK_FOR;
-    } else if(strcmp(str, "const") == 0) {
-        ret = TK_CONST;
-    } else {
-        ret = TK_IDENTIFIER;
-        S->u.string = str;
-        str = NULL; // overtake
-        S->val = MALLOCSTR;
+    const size_t start = skip_while(S, is_str);
+    const size_t length = span_length(S, start);
+
+    TOKENTYPE ret = keyword_type(S->src + start, length);
+    if (ret != TK_IDENTIFIER) {
+        return create_token(ret, S->lineno);
     }
 
-    free(str);
-    return create_token(ret, S->lineno);
+    if (S->materialize) {
+        state_set_symbol(S, intern(S->src + start, length));
+    }
+    return create_span_token(TK_IDENTIFIER, S->lineno, start, length);
 }
 
 static Token lex_var(Lexer* S)
 {
     assert(is_var_start(S->lexchar));
     get_next_char(S); // Skip $
-    char* str = fetch_str(S, is_str);
-    state_set_string(S, str);
+    const size_t start = skip_while(S, is_str);
+    const size_t length = span_length(S, start);
+    if (S->materialize) {
+        state_set_symbol(S, intern(S->src + start, length));
+    }
 
-    return create_token(TK_VAR, S->lineno);
+    return create_span_token(TK_VAR, S->lineno, start, length);
 }
 
-static Token lex_str(Lexer* S)
+// Writes the value of an escaped string to dst, which needs room for
+// length + 1 bytes
+static void unescape_into(char* dst, const char* src, size_t length)
 {
-    assert(S->lexchar == '"');
-    int escape = false;
     size_t pos = 0;
-    size_t capacity = 5;
-    char* str = calloc(capacity, sizeof(char));
-    int c = get_next_char(S);
-    while ((c != '"' || escape) && c != EOF) {
-        if (S->lexchar == '\\') {
+    int escape = false;
+    for (size_t i = 0; i < length; ++i) {
+        char c = src[i];
+        if (c == '\\') {
             escape = true;
-        } else {
-            if (escape) {
-                switch (S->lexchar) {
-                    case 'n':
-                        S->lexchar = '\n';
-                        break;
-                    case 't':
-                        S->lexchar = '\t';
-                        break;
-                    case 'r':
-                        S->lexchar = '\r';
-                        break;
-                    default:
-                        str = str_append(str, '\\', &pos, &capacity);
-                        break;
-                }
+            continue;
+        }
+        if (escape) {
+            switch (c) {
+                case 'n':
+                    c = '\n';
+                    break;
+                case 't':
+                    c = '\t';
+                    break;
+                case 'r':
+                    c = '\r';
+                    break;
+                default:
+                    dst[pos++] = '\\';
+                    break;
             }
-            str = str_append(str, (char) S->lexchar, &pos, &capacity);
-            escape = false;
         }
-        c = get_next_char(S);
+        dst[pos++] = c;
+        escape = false;
     }
+    dst[pos] = '\0';
+}
 
-    str = str_append(str, '\0', &pos, &capacity);
+static char* unescape_str(const char* src, size_t length)
+{
+    char* str = malloc((length + 1) * sizeof(char));
+    if (!str) {
+        return NULL;
+    }
+    unescape_into(str, src, length);
 
-    if (S->lexchar != '"') {
-        char* errormsg = malloc((strlen("Expected \", got ") + 4) * sizeof(char));
+    return str;
+}
+
+static Token lex_str(Lexer* S)
+{
+    assert(S->lexchar == '"');
+    bool has_escapes = false;
+    const size_t start = S->pos;
+    get_next_char(S);
+    skip_until(S, '"', '\\', SIZE_MAX);
+    while (S->lexchar == '\\') {
+        has_escapes = true;
+        while (get_next_char(S) == '\\') // A run of \ escapes the next char
+            ;
         if (S->lexchar == EOF) {
-            sprintf(errormsg, "Expected \", got %s", "EOF");
-        } else {
-            sprintf(errormsg, "Expected \", got %c", S->lexchar);
+            break;
         }
-        free(str);
-        Token ret = syntax_error(S, errormsg);
-        free(errormsg);
-        return ret;
+        get_next_char(S); // Skip escaped char
+        skip_until(S, '"', '\\', SIZE_MAX);
     }
 
-    state_set_string(S, str);
+    if (S->lexchar != '"') {
+        return syntax_error(S, "Expected \", got %s", "EOF");
+    }
+
+    const size_t length = span_length(S, start);
+    if (has_escapes && S->materialize) { // Only escape sequences need a copy
+        char* str = unescape_str(S->src + start, length);
+        if (!str) {
+            return syntax_error(S, "Fetching str failed.");
+        }
+        state_set_string(S, str);
+    } else {
+        state_set_span(S);
+    }
 
     get_next_char(S); // Skip "
 
-    return create_token(TK_STRING, S->lineno);
+    return create_span_token(TK_STRING, S->lineno, start, length);
+}
+
+static int64_t parse_long(const char* src, size_t length)
+{
+    int64_t n = 0;
+    for (size_t i = 0; i < length; ++i) {
+        const int digit = src[i] - '0';
+        if (n > (INT64_MAX - digit) / 10) { // Saturate like strtoll
+            return INT64_MAX;
+        }
+        n = n * 10 + digit;
+    }
+
+    return n;
 }
 
 Token lex_num(Lexer* S)
 {
-    char* numstr = fetch_str(S, isdigit);
-    int64_t n = (int64_t) strtoll(numstr, NULL, 10);
-    free(numstr);
-    state_set_long(S, n);
+    const size_t start = skip_while(S, isdigit);
+    const size_t length = span_length(S, start);
+    if (S->materialize) {
+        state_set_long(S, parse_long(S->src + start, length));
+    }
+
+    return create_span_token(TK_LONG, S->lineno, start, length);
+}
+
+void token_unescape(char* dst, const char* src, Token token)
+{
+    assert(token.type == TK_STRING);
+    if (memchr(src + token.offset, '\\', token.length)) {
+        unescape_into(dst, src + token.offset, token.length);
+    } else {
+        memcpy(dst, src + token.offset, token.length);
+        dst[token.length] = '\0';
+    }
+}
 
-    return create_token(TK_LONG, S->lineno);
+int64_t token_long(const char* src, Token token)
+{
+    assert(token.type == TK_LONG);
+    return parse_long(src + token.offset, token.length);
 }
 
 #define LEX_TWICE(current, expected, TOKENTYPE)                                \
@@ -251,28 +421,38 @@ Token get_token(Lexer* S)
         return create_token(TK_END, S->lineno);
     }
 
+    compact_window(S);
     if (S->mode == NONPHP) {
-        char* html = fetch_str(S, is_not_open_tag);
-        if (get_next_char(S) != '?') {
-            free(html);
-            return syntax_error(S, "Expected ? after <.");
+        // Streamed html is cut into chunks of half a window
+        const size_t limit = S->window ? S->pos - 1 + STREAM_WINDOW / 2 : SIZE_MAX;
+        const size_t start = skip_until(S, '<', '<', limit);
+        while (S->lexchar == '<' && !at_open_tag(S)) { // Any other < is html
+            get_next_char(S);
+            skip_until(S, '<', '<', limit);
         }
-        int c1 = get_next_char(S);
-        int c2 = get_next_char(S);
-        int c3 = get_next_char(S);
-        if (c1 != 'p' || c2 != 'h' || c3 != 'p') {
-            free(html);
-            return syntax_error(S, "Expected php after <?");
+        const size_t length = span_length(S, start);
+        if (S->lexchar != EOF && S->lexchar != '<') { // Cut at the limit
+            state_set_span(S);
+            return create_span_token(TK_HTML, S->lineno, start, length);
+        }
+        if (S->lexchar == EOF) { // Trailing html without an open tag
+            if (length == 0) {
+                return create_token(TK_END, S->lineno);
+            }
+            state_set_span(S);
+            return create_span_token(TK_HTML, S->lineno, start, length);
+        }
+        for (int i = 0; i < 4; ++i) { // Skip over ?php
+            get_next_char(S);
         }
 
         S->mode = EMITOPENTAG;
         get_next_char(S); // Skip over last p
-        if (*html == '\0') { // We do not need to emit an empty str
-            free(html);
+        if (length == 0) { // We do not need to emit an empty str
             return get_token(S);
         }
-        S->u.string = html;
-        return create_token(TK_HTML, S->lineno);
+        state_set_span(S);
+        return create_span_token(TK_HTML, S->lineno, start, length);
     } else if (S->mode == EMITOPENTAG) {
         S->mode = PHP;
         return create_token(TK_OPENTAG, S->lineno);
@@ -334,9 +514,21 @@ Token get_token(Lexer* S)
         return create_token('>', S->lineno);
     }
 
+    if (c == '?') {
+        if ('>' == get_next_char(S)) { // Close tag, acts as a ;
+            S->mode = NONPHP;
+            if (get_next_char(S) == '\n') { // A single newline is swallowed
+                get_next_char(S);
+            }
+            return create_token(';', S->lineno);
+        }
+
+        return create_token('?', S->lineno);
+    }
+
     if (c == '/') {
         if ('/' == get_next_char(S)) {
-            while (get_next_char(S) != '\n')
+            while ((c = get_next_char(S)) != '\n' && c != EOF)
                 ;
             S->lineno++;
             return get_token(S);
@@ -349,7 +541,7 @@ Token get_token(Lexer* S)
     return create_token(c, S->lineno);
 }
 
-Lexer* create_lexer(FILE *file)
+Lexer* create_lexer_from_buffer(const char* buf, size_t len)
 {
     Lexer* ret = malloc(sizeof(Lexer));
     if (!ret) {
@@ -359,21 +551,120 @@ Lexer* create_lexer(FILE *file)
     ret->val = NONE;
     ret->lineno = 1;
     ret->mode = NONPHP;
-    ret->file = file;
+    ret->src = buf;
+    ret->srclen = len;
+    ret->pos = 0;
+    ret->source = NULL;
+    ret->stream = NULL;
+    ret->window = NULL;
+    ret->capacity = 0;
+    ret->error = NULL;
+    ret->materialize = true;
     ret->token = create_token(0, 1);
     get_next_char(ret);
     return ret;
 }
 
+Lexer* create_lexer(FILE *file)
+{
+    Source* source = read_source(file);
+    fclose(file);
+    if (!source) {
+        return NULL;
+    }
+
+    Lexer* ret = create_lexer_from_buffer(source->data, source->length);
+    if (!ret) {
+        close_source(source);
+        return NULL;
+    }
+    ret->source = source;
+    return ret;
+}
+
+// Lexes the stream through a fixed window instead of reading it up front.
+// The stream stays open.
+Lexer* create_stream_lexer(FILE* stream)
+{
+    char* window = malloc(STREAM_WINDOW);
+    if (!window) {
+        perror("malloc for lexer window failed.");
+        return NULL;
+    }
+
+    Lexer* ret = create_lexer_from_buffer(NULL, 0); // Starts out at EOF
+    if (!ret) {
+        free(window);
+        return NULL;
+    }
+    ret->src = window;
+    ret->stream = stream;
+    ret->window = window;
+    ret->capacity = STREAM_WINDOW;
+    ret->pos = 0;
+    get_next_char(ret);
+
+    return ret;
+}
+
 void destroy_lexer(Lexer *S)
 {
-    fclose(S->file);
+    if (S->source) {
+        close_source(S->source);
+    }
+    free(S->window);
     if (S->val == MALLOCSTR) {
         free(S->u.string);
     }
+    free(S->error);
     free(S);
 }
 
+TokenArray* tokenize(const char* buf, size_t len)
+{
+    if (len >= UINT32_MAX) { // Spans are stored as 32 bit
+        return NULL;
+    }
+
+    TokenArray* ret = malloc(sizeof(TokenArray));
+    Lexer* S = create_lexer_from_buffer(buf, len);
+    if (!ret || !S) {
+        free(ret);
+        return NULL;
+    }
+    S->materialize = false;
+
+    ret->src = buf;
+    ret->size = 0;
+    ret->capacity = len / 8 + 16;
+    ret->tokens = malloc(ret->capacity * sizeof(*ret->tokens));
+
+    Token token;
+    do {
+        token = get_token(S);
+        if (!try_resize(&ret->capacity, ret->size, (void**)&ret->tokens,
+                        sizeof(*ret->tokens), NULL)) {
+            destroy_lexer(S);
+            destroy_tokens(ret);
+            return NULL;
+        }
+        TokenSpan* span = &ret->tokens[ret->size++];
+        span->type = (uint16_t) token.type;
+        span->lineno = token.lineno;
+        span->offset = (uint32_t) token.offset;
+        span->length = (uint32_t) token.length;
+    } while (token.type != TK_END);
+
+    destroy_lexer(S);
+    return ret;
+}
+
+void destroy_tokens(TokenArray* tokens)
+{
+    free(tokens->tokens);
+    free(tokens);
+}
+
 static char* tokennames[] = {
     "EOF",
     "'\\x01'", "'\\x02'", "'\\x03'", "'\\x04'", "'\\x05'", "'\\x06'", "'\\x07'",
@@ -5,6 +5,9 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include "source.h"
+#include "symbol.h"
 
 typedef enum TOKENTYPE {
     TK_OPENTAG = 256, // Make them outside ascii range
@@ -48,10 +51,18 @@ typedef uint32_t lineno_t;
 typedef struct Token {
     TOKENTYPE type;
     lineno_t lineno;
+    size_t offset; // Span of the token's value in the source buffer
+    size_t length;
 } Token;
 
 static inline Token create_token(TOKENTYPE type, lineno_t lineno) {
-    Token ret = { .type = type, .lineno = lineno };
+    Token ret = { .type = type, .lineno = lineno, .offset = 0, .length = 0 };
+    return ret;
+}
+
+static inline Token create_span_token(TOKENTYPE type, lineno_t lineno,
+                                      size_t offset, size_t length) {
+    Token ret = { .type = type, .lineno = lineno, .offset = offset, .length = length };
     return ret;
 }
 
@@ -60,6 +71,8 @@ typedef enum VALTYPE {
     MALLOCSTR,
     STATICSTR,
     LONGVAL,
+    SPAN, // Value is the token's span in the source buffer
+    SYMBOL,
     ERROR
 } VALTYPE;
 
@@ -67,24 +80,69 @@ typedef enum VALTYPE {
 typedef struct Lexer {
     enum MODE mode;
     lineno_t lineno;
-    FILE* file;
+    const char* src;
+    size_t srclen;
+    size_t pos; // Offset behind lexchar
+    Source* source; // Owned, NULL if the buffer belongs to the caller
+    FILE* stream; // Refills the window src points into, NULL for buffers
+    char* window;
+    size_t capacity;
     Token token;
     int lexchar;
+    bool materialize; // Fill in values, otherwise tokens only carry spans
     VALTYPE val;
     union {
         char* string;
         int64_t lint;
+        symbol_t sym;
     } u;
     char* error;
 } Lexer;
 
 Lexer* create_lexer(FILE *);
+Lexer* create_lexer_from_buffer(const char* buf, size_t len);
+Lexer* create_stream_lexer(FILE *);
 void destroy_lexer(Lexer *);
 
 Token get_token(Lexer*);
+char* token_strdup(const char* src, Token);
+// Writes the value of a string token to dst, which needs room for
+// token.length + 1 bytes
+void token_unescape(char* dst, const char* src, Token);
+int64_t token_long(const char* src, Token);
 char* get_token_name(int);
 void print_tokenstream(Lexer*);
 
+// Compact form of a token for lexing a whole buffer up front
+typedef struct TokenSpan {
+    uint16_t type;
+    lineno_t lineno;
+    uint32_t offset;
+    uint32_t length;
+} TokenSpan;
+_Static_assert(TK_END <= UINT16_MAX, "TOKENTYPE must fit into TokenSpan.type");
+
+typedef struct TokenArray {
+    const char* src;
+    TokenSpan* tokens;
+    size_t size;
+    size_t capacity;
+} TokenArray;
+
+TokenArray* tokenize(const char* buf, size_t len);
+void destroy_tokens(TokenArray*);
+
+static inline Token token_at(const TokenArray* tokens, size_t idx)
+{
+    assert(tokens->size > 0);
+    if (idx >= tokens->size) { // Stay on TK_END
+        idx = tokens->size - 1;
+    }
+    const TokenSpan* span = &tokens->tokens[idx];
+    return create_span_token((TOKENTYPE) span->type, span->lineno,
+                             span->offset, span->length);
+}
+
 static inline void state_set_string(Lexer* S, char* str)
 {
     if (S->val == MALLOCSTR) {
@@ -105,4 +163,24 @@ static inline void state_set_long(Lexer* S, int64_t n)
     S->u.lint = n;
 }
 
+static inline void state_set_symbol(Lexer* S, symbol_t sym)
+{
+    if (S->val == MALLOCSTR) {
+        free(S->u.string);
+    }
+
+    S->val = SYMBOL;
+    S->u.sym = sym;
+}
+
+static inline void state_set_span(Lexer* S)
+{
+    if (S->val == MALLOCSTR) {
+        free(S->u.string);
+    }
+
+    S->val = SPAN;
+    S->u.string = NULL;
+}
+
 #endif //PHPINTERP_LEX_H
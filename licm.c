@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <string.h>
+#include "optimize.h"
+#include "op_util.h"
+#include "array-util.h"
+
+// Loop-invariant code motion. A loop is the code from the target of a
+// backward OP_JMP up to that jump, as long as nothing outside jumps into
+// its middle. Expressions in it that only read constants, slots the loop
+// never writes and constants it never declares are computed once in a
+// pre-header into a temporary slot, and the loop loads the slot instead.
+// Only operations without side effects or errors move, so evaluating them
+// before the loop is not visible even if it never iterates.
+
+#define MAX_HOIST_ROUNDS 64
+
+typedef struct Hoist {
+    size_t start;
+    size_t end;
+    uint32_t slot;
+} Hoist;
+
+// Value on the stack while walking the loop, computed by [start, end)
+typedef struct Value {
+    size_t start;
+    size_t end;
+    Operator root;
+    bool invariant;
+} Value;
+
+typedef struct Loop {
+    size_t head;
+    size_t end; // Past the back edge
+    bool* written; // Slots assigned in the loop
+    bool declares; // Has OP_CONSTDECL
+
+    Value* stack;
+    size_t depth;
+    size_t capacity;
+
+    Hoist* hoists;
+    size_t hoistlen;
+    size_t hoistcapacity;
+} Loop;
+
+static bool is_pure(const codepoint_t* ip)
+{
+    switch ((Operator) *ip) {
+        case OP_LTE:
+        case OP_GTE:
+        case OP_LT:
+        case OP_GT:
+        case OP_NOT:
+        case OP_AND:
+        case OP_OR:
+        case OP_EQ:
+        case OP_CONCAT:
+        case OP_SUB:
+        case OP_ADD:
+        case OP_MUL:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_ADD_LL:
+        case OP_SUB_LL:
+        case OP_MUL_LL:
+        case OP_LT_LL:
+        case OP_LTE_LL:
+        case OP_GT_LL:
+        case OP_GTE_LL:
+            return true; // Not OP_DIV, which fails on zero
+        case OP_CAST:
+            return fetch8(ip + 1) != TYPE_FUNCTION && fetch8(ip + 1) != TYPE_CFUNCTION;
+        default:
+            return false;
+    }
+}
+
+// Only the head may be entered from outside
+static bool single_entry(const Function* fn, size_t head, size_t end)
+{
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if ((pos < head || pos >= end) && op_flags((Operator) fn->code[pos]) & OPF_JUMP) {
+            const size_t target = op_jump_target(fn->code + pos);
+            if (target > head && target < end) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// A load or literal on its own is as cheap as loading the temporary
+static void consider(Loop* L, Value value)
+{
+    if (!value.invariant || value.root == OP_CONST || value.root == OP_LOAD_SLOT) {
+        return;
+    }
+    if (!try_resize(&L->hoistcapacity, L->hoistlen, (void**)&L->hoists, sizeof(*L->hoists), NULL)) {
+        optimizer_oom();
+    }
+    L->hoists[L->hoistlen++] = (Hoist) {value.start, value.end, NO_SLOT};
+}
+
+static void push_value(Loop* L, Value value)
+{
+    if (!try_resize(&L->capacity, L->depth, (void**)&L->stack, sizeof(*L->stack), NULL)) {
+        optimizer_oom();
+    }
+    L->stack[L->depth++] = value;
+}
+
+// Evaluates the loop symbolically, values are only followed within a basic
+// block. Every invariant value that is used by something that cannot move
+// becomes a hoist. Returns false if the stack does not add up.
+static bool find_invariants(const Function* fn, const bool* targets, Loop* L)
+{
+    for (size_t pos = L->head; pos < L->end; pos += op_len((Operator) fn->code[pos])) {
+        const codepoint_t* ip = fn->code + pos;
+        const Operator op = (Operator) *ip;
+        if (op_slot(ip) != NO_SLOT && op != OP_LOAD_SLOT) {
+            L->written[op_slot(ip)] = true;
+        }
+        L->declares |= op == OP_CONSTDECL;
+    }
+
+    bool boundary = true;
+    for (size_t pos = L->head; pos < L->end; pos += op_len((Operator) fn->code[pos])) {
+        const codepoint_t* ip = fn->code + pos;
+        const Operator op = (Operator) *ip;
+        if (boundary || targets[pos]) {
+            for (size_t i = 0; i < L->depth; ++i) {
+                L->stack[i].invariant = false;
+            }
+        }
+        boundary = op_flags(op) & (OPF_JUMP | OPF_TERMINATOR);
+
+        const unsigned pops = op_pops(ip);
+        if (pops > L->depth) {
+            return false;
+        }
+        Value* operands = L->stack + L->depth - pops;
+        Value result = {pos, pos + op_len(op), op, false};
+        switch (op) {
+            case OP_CONST:
+                result.invariant = true;
+                break;
+            case OP_LOAD_SLOT:
+                result.invariant = !L->written[fetch32(ip + 1)];
+                break;
+            case OP_CLOOKUP:
+                result.invariant = !L->declares;
+                break;
+            default:
+                result.invariant = is_pure(ip) && pops > 0;
+                for (unsigned i = 0; i < pops && result.invariant; ++i) {
+                    // Contiguous code, so the whole expression can be moved
+                    result.invariant = operands[i].invariant
+                        && operands[i].end == (i + 1 < pops ? operands[i + 1].start : pos);
+                }
+                if (result.invariant) {
+                    result.start = operands[0].start;
+                }
+                break;
+        }
+        if (!result.invariant) {
+            for (unsigned i = 0; i < pops; ++i) {
+                consider(L, operands[i]);
+            }
+        }
+
+        L->depth -= pops;
+        if (op_pushes(ip)) {
+            push_value(L, result);
+        }
+    }
+
+    return true;
+}
+
+static int compare_hoists(const void* lhs, const void* rhs)
+{
+    const Hoist* l = lhs;
+    const Hoist* r = rhs;
+    return l->start < r->start ? -1 : l->start > r->start;
+}
+
+static size_t emit_slot(codepoint_t* code, size_t size, Operator op, uint32_t slot)
+{
+    code[size] = (codepoint_t) op;
+    *(uint32_t*)(code + size + 1) = htole32(slot);
+    return size + op_len(op);
+}
+
+// Whether an earlier hoist already computes the slot of hoist i
+static bool shares_slot(const Loop* L, size_t i)
+{
+    for (size_t j = 0; j < i; ++j) {
+        if (L->hoists[j].slot == L->hoists[i].slot) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Rebuilds fn with the hoisted expressions computed between the code before
+// the loop and its head. Jumps from outside to the head now enter the
+// pre-header, the back edges still go to the head.
+static void hoist(State* S, Function* fn, const Loop* L)
+{
+    size_t newsize = fn->codesize;
+    for (size_t i = 0; i < L->hoistlen; ++i) {
+        newsize += op_len(OP_STORE_SLOT) + op_len(OP_LOAD_SLOT);
+    }
+    const size_t capacity = newsize + 1 > fn->codecapacity ? newsize + 1 : fn->codecapacity;
+    uint32_t* map = malloc((fn->codesize + 1) * sizeof(*map)); // Old to new position
+    codepoint_t* code = calloc(capacity, sizeof(*code));
+    if (!map || !code) optimizer_oom();
+    LineTable lines;
+    init_linetable(&lines);
+
+    size_t size = 0;
+    size_t pos = 0;
+    for (; pos < L->head; pos += op_len((Operator) fn->code[pos])) {
+        map[pos] = (uint32_t) size;
+        memcpy(code + size, fn->code + pos, op_len((Operator) fn->code[pos]));
+        set_line(&lines, size, find_line(&fn->lines, pos));
+        size += op_len((Operator) fn->code[pos]);
+    }
+
+    const size_t preheader = size;
+    for (size_t i = 0; i < L->hoistlen; ++i) {
+        const Hoist* h = &L->hoists[i];
+        if (shares_slot(L, i)) {
+            continue;
+        }
+        for (size_t from = h->start; from < h->end; from += op_len((Operator) fn->code[from])) {
+            memcpy(code + size, fn->code + from, op_len((Operator) fn->code[from]));
+            set_line(&lines, size, find_line(&fn->lines, from));
+            size += op_len((Operator) fn->code[from]);
+        }
+        size = emit_slot(code, size, OP_STORE_SLOT, h->slot);
+    }
+
+    size_t next = 0;
+    while (pos < fn->codesize) {
+        map[pos] = (uint32_t) size;
+        if (next < L->hoistlen && pos == L->hoists[next].start) {
+            set_line(&lines, size, find_line(&fn->lines, pos));
+            size = emit_slot(code, size, OP_LOAD_SLOT, L->hoists[next].slot);
+            pos = L->hoists[next++].end;
+            continue;
+        }
+        memcpy(code + size, fn->code + pos, op_len((Operator) fn->code[pos]));
+        set_line(&lines, size, find_line(&fn->lines, pos));
+        size += op_len((Operator) fn->code[pos]);
+        pos += op_len((Operator) fn->code[pos]);
+    }
+    map[fn->codesize] = (uint32_t) size;
+
+    for (pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        const codepoint_t* ip = fn->code + pos;
+        if (op_flags((Operator) *ip) & OPF_JUMP) {
+            const size_t target = op_jump_target(ip);
+            const bool outside = pos < L->head || pos >= L->end;
+            op_set_jump_target(code + map[pos], target == L->head && outside
+                                                ? (uint32_t) preheader : map[target]);
+        }
+    }
+    for (size_t i = 0; i < S->calllen; ++i) {
+        if (S->calls[i].fn == fn) {
+            S->calls[i].position = map[S->calls[i].position];
+        }
+    }
+
+    free(fn->code);
+    free_linetable(&fn->lines);
+    fn->code = code;
+    fn->lines = lines;
+    fn->codesize = size;
+    fn->codecapacity = capacity;
+    free(map);
+}
+
+// Hoists from the first loop that has invariants, returns their number
+static size_t hoist_round(State* S, Function* fn, const bool* targets)
+{
+    size_t ret = 0;
+    for (size_t pos = 0; pos < fn->codesize && !ret; pos += op_len((Operator) fn->code[pos])) {
+        if (fn->code[pos] != OP_JMP || op_jump_target(fn->code + pos) > pos) {
+            continue;
+        }
+
+        Loop L = {0};
+        L.head = op_jump_target(fn->code + pos);
+        L.end = pos + op_len(OP_JMP);
+        L.written = calloc(fn->locals.size + 1, sizeof(*L.written));
+        if (!L.written) optimizer_oom();
+        if (single_entry(fn, L.head, L.end) && find_invariants(fn, targets, &L) && L.hoistlen) {
+            qsort(L.hoists, L.hoistlen, sizeof(*L.hoists), compare_hoists);
+            for (size_t i = 0; i < L.hoistlen; ++i) { // Equal expressions share a slot
+                const Hoist* h = &L.hoists[i];
+                for (size_t j = 0; j < i && h->slot == NO_SLOT; ++j) {
+                    const Hoist* other = &L.hoists[j];
+                    if (other->end - other->start == h->end - h->start
+                        && memcmp(fn->code + other->start, fn->code + h->start, h->end - h->start) == 0) {
+                        L.hoists[i].slot = other->slot;
+                    }
+                }
+                if (h->slot == NO_SLOT) {
+                    L.hoists[i].slot = add_temp_slot(fn);
+                    ++ret;
+                }
+            }
+            hoist(S, fn, &L);
+        }
+        free(L.written);
+        free(L.stack);
+        free(L.hoists);
+    }
+
+    return ret;
+}
+
+// Returns the number of expressions moved out of loops
+size_t hoist_invariants(State* S, Function* fn)
+{
+    size_t ret = 0;
+    for (int round = 0; round < MAX_HOIST_ROUNDS; ++round) {
+        bool* targets = find_jump_targets(fn);
+        const size_t hoisted = hoist_round(S, fn, targets);
+        free(targets);
+        if (!hoisted) {
+            break;
+        }
+        ret += hoisted;
+    }
+
+    return ret;
+}
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "crossplatform/stdnoreturn.h"
+#include "linetable.h"
+
+static _Noreturn void linetable_oom(void)
+{
+    puts("Out of memory in line table");
+    abort();
+}
+
+void init_linetable(LineTable* table)
+{
+    table->runs = NULL;
+    table->size = table->capacity = 0;
+}
+
+void set_line(LineTable* table, size_t pos, lineno_t line)
+{
+    while (table->size && table->runs[table->size - 1].start >= pos) {
+        table->size--;
+    }
+    if (table->size && table->runs[table->size - 1].line == line) {
+        return;
+    }
+
+    if ((uint32_t) pos != pos) linetable_oom();
+    if (table->size == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 8;
+        LineRun* tmp = realloc(table->runs, table->capacity * sizeof(*tmp));
+        if (!tmp) linetable_oom();
+        table->runs = tmp;
+    }
+    table->runs[table->size++] = (LineRun) {(uint32_t) pos, line};
+}
+
+// Binary search for the last run starting at or before pos
+lineno_t find_line(const LineTable* table, size_t pos)
+{
+    uint32_t lo = 0;
+    uint32_t hi = table->size;
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (table->runs[mid].start <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo ? table->runs[lo - 1].line : 0;
+}
+
+void clear_linetable(LineTable* table)
+{
+    table->size = 0;
+}
+
+void free_linetable(LineTable* table)
+{
+    free(table->runs);
+    init_linetable(table);
+}
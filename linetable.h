@@ -0,0 +1,29 @@
+#ifndef PHPINTERP_LINETABLE_H
+#define PHPINTERP_LINETABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "lex.h"
+
+// Source lines of a code array. Only positions where the line changes are
+// recorded; each run covers the code up to the start of the next one.
+typedef struct LineRun {
+    uint32_t start;
+    lineno_t line;
+} LineRun;
+
+typedef struct LineTable {
+    LineRun* runs; // Sorted by start
+    uint32_t size;
+    uint32_t capacity;
+} LineTable;
+
+void init_linetable(LineTable*);
+// Code from pos on is on line. Runs at or after pos are dropped, so code
+// that was emitted and discarded again does not leave stale entries.
+void set_line(LineTable*, size_t pos, lineno_t line);
+lineno_t find_line(const LineTable*, size_t pos);
+void clear_linetable(LineTable*);
+void free_linetable(LineTable*);
+
+#endif //PHPINTERP_LINETABLE_H
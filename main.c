@@ -1,15 +1,89 @@
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "run.h"
+#include "parse.h"
+#include "source.h"
+#include "symbol.h"
 
-int main(int argc, char** argv)
+static double elapsed_ms(clock_t start)
+{
+    return (double) (clock() - start) * 1000 / CLOCKS_PER_SEC;
+}
+
+// Parses the file with both front ends without running it and reports the
+// time each one takes
+static int time_parse(const char* filename)
 {
-    if (argc != 2) {
-        puts("Supported syntax: ./program filename");
+    Source* source = open_source(filename);
+    if (!source) {
+        printf("Could not open input file: %s\n", filename);
         return 1;
     }
-    const char* filename = argv[1];
 
-    run_file(filename);
+    clock_t start = clock();
+    Program* program = parse_lexer(create_lexer_from_buffer(source->data, source->length));
+    printf("pull lexer:   %8.2f ms\n", elapsed_ms(start));
+    destroy_program(program);
+
+    start = clock();
+    TokenArray* tokens = tokenize(source->data, source->length);
+    const double tokenize_ms = elapsed_ms(start);
+    if (tokens) {
+        program = parse_tokens(tokens);
+        printf("token array:  %8.2f ms (tokenize %.2f ms, %zu tokens)\n",
+               elapsed_ms(start), tokenize_ms, tokens->size);
+        destroy_program(program);
+        destroy_tokens(tokens);
+    }
 
+    close_source(source);
     return 0;
-}
\ No newline at end of file
+}
+
+static int usage(void)
+{
+    puts("Supported syntax: ./program [-p] [-r] [-v] [-O] filename");
+    puts("  -p  Only parse the file and time the front end");
+    puts("  -r  Run the register translation of the bytecode");
+    puts("  -v  Report what the optimizer did on stderr");
+    puts("  -O  Optimize through SSA form, compiling slower");
+    puts("  Use - as filename to stream the script from stdin");
+    puts("  Set PHPINTERP_CACHE to a directory to cache compiled scripts");
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    bool parse_only = false;
+    Options options = {false, false, false};
+    for (int i = 1; i < argc - 1; ++i) {
+        if (strcmp(argv[i], "-p") == 0) {
+            parse_only = true;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            options.registers = true;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            options.verbose = true;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            options.optimize = true;
+        } else {
+            return usage();
+        }
+    }
+    if (argc < 2) {
+        return usage();
+    }
+    const char* filename = argv[argc - 1];
+
+    int ret = 0;
+    if (parse_only) {
+        ret = time_parse(filename);
+    } else if (strcmp(filename, "-") == 0) {
+        run_stream(stdin, filename, options);
+    } else {
+        run_file(filename, options);
+    }
+    free_symbols();
+
+    return ret;
+}
@@ -5,27 +5,203 @@
 #include "compile.h"
 #include "util.h"
 
+#define OPF_JUMP       (1 << 0) // Followed by a 32 bit absolute target
+#define OPF_BRANCH     (1 << 1) // Jump that may fall through
+#define OPF_TERMINATOR (1 << 2) // Never continues with the next instruction
+#define OPF_BOOL       (1 << 3) // Pushes a TYPE_BOOL
 
 static inline size_t op_len(Operator op)
 {
     switch (op) {
-        case OP_STR:
-        case OP_ASSIGN:
-        case OP_LOOKUP:
+        case OP_CONST:
+        case OP_LOAD_SLOT:
+        case OP_STORE_SLOT:
+        case OP_INC_SLOT:
+        case OP_DEC_SLOT:
+        case OP_APPEND_SLOT:
         case OP_CLOOKUP:
         case OP_CONSTDECL:
-            return 3;
+            return 5;
+        case OP_ADD_SLOT:
+            return 9;
         case OP_CALL:
+        case OP_CALL_DIRECT:
+        case OP_TAILCALL:
+            return 6;
         case OP_CAST:
             return 2;
         case OP_JMP:
         case OP_JMPZ:
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JGT:
+        case OP_JGE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JLT_LL:
+        case OP_JLE_LL:
+        case OP_JGT_LL:
+        case OP_JGE_LL:
             return 5;
-        case OP_LONG:
-            return 9;
         default:
             return 1;
     }
 }
 
+static inline unsigned op_flags(Operator op)
+{
+    switch (op) {
+        case OP_RETURN:
+        case OP_TAILCALL:
+            return OPF_TERMINATOR;
+        case OP_JMP:
+            return OPF_JUMP | OPF_TERMINATOR;
+        case OP_JMPZ:
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JGT:
+        case OP_JGE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JLT_LL:
+        case OP_JLE_LL:
+        case OP_JGT_LL:
+        case OP_JGE_LL:
+            return OPF_JUMP | OPF_BRANCH;
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_LTE:
+        case OP_GTE:
+        case OP_LT:
+        case OP_GT:
+        case OP_AND:
+        case OP_OR:
+        case OP_EQ:
+        case OP_LT_LL:
+        case OP_LTE_LL:
+        case OP_GT_LL:
+        case OP_GTE_LL:
+            return OPF_BOOL;
+        default:
+            return 0;
+    }
+}
+
+// Number of values the instruction at ip takes from the stack
+static inline unsigned op_pops(const codepoint_t* ip)
+{
+    switch ((Operator) *ip) {
+        case OP_CALL:
+        case OP_CALL_DIRECT:
+        case OP_TAILCALL:
+            return fetch8(ip + 5);
+        case OP_LTE:
+        case OP_GTE:
+        case OP_LT:
+        case OP_GT:
+        case OP_AND:
+        case OP_OR:
+        case OP_EQ:
+        case OP_CONCAT:
+        case OP_SUB:
+        case OP_ADD:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_ADD_LL:
+        case OP_SUB_LL:
+        case OP_MUL_LL:
+        case OP_LT_LL:
+        case OP_LTE_LL:
+        case OP_GT_LL:
+        case OP_GTE_LL:
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JGT:
+        case OP_JGE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JLT_LL:
+        case OP_JLE_LL:
+        case OP_JGT_LL:
+        case OP_JGE_LL:
+            return 2;
+        case OP_RETURN:
+        case OP_ECHO:
+        case OP_NOT:
+        case OP_STORE_SLOT:
+        case OP_APPEND_SLOT:
+        case OP_CONSTDECL:
+        case OP_CAST:
+        case OP_POP:
+        case OP_JMPZ:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Number of values the instruction at ip leaves on the stack
+static inline unsigned op_pushes(const codepoint_t* ip)
+{
+    switch ((Operator) *ip) {
+        case OP_RETURN:
+        case OP_ECHO:
+        case OP_STORE_SLOT:
+        case OP_INC_SLOT:
+        case OP_DEC_SLOT:
+        case OP_ADD_SLOT:
+        case OP_APPEND_SLOT:
+        case OP_CONSTDECL:
+        case OP_POP:
+        case OP_JMP:
+        case OP_JMPZ:
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JGT:
+        case OP_JGE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JLT_LL:
+        case OP_JLE_LL:
+        case OP_JGT_LL:
+        case OP_JGE_LL:
+        case OP_NOP:
+        case OP_INVALID:
+        case OP_MAX_VALUE:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+// Local slot the instruction at ip reads or writes, NO_SLOT if none
+static inline uint32_t op_slot(const codepoint_t* ip)
+{
+    switch ((Operator) *ip) {
+        case OP_LOAD_SLOT:
+        case OP_STORE_SLOT:
+        case OP_INC_SLOT:
+        case OP_DEC_SLOT:
+        case OP_ADD_SLOT:
+        case OP_APPEND_SLOT:
+            return fetch32(ip + 1);
+        default:
+            return NO_SLOT;
+    }
+}
+
+static inline uint32_t op_jump_target(const codepoint_t* ip)
+{
+    assert(op_flags((Operator) *ip) & OPF_JUMP);
+    return fetch32(ip + 1);
+}
+
+static inline void op_set_jump_target(codepoint_t* ip, uint32_t target)
+{
+    assert(op_flags((Operator) *ip) & OPF_JUMP);
+    *(uint32_t*)(ip + 1) = htole32(target);
+}
+
 #endif //PHPINTERP_OP_UTIL_H
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include "optimize.h"
+#include "op_util.h"
+
+// Peephole pass over the finished bytecode of a Function. Instructions are
+// only ever removed, jumps retargeted or made unconditional, so every kept
+// instruction keeps its source line.
+
+#define MAX_JUMP_HOPS 16
+
+_Noreturn void optimizer_oom(void)
+{
+    compiletimeerror("Out of memory while optimizing");
+}
+
+// Follows chains of OP_JMP, bounded since jumps may form a loop
+static uint32_t thread_jump(const Function* fn, uint32_t target)
+{
+    for (int hops = 0; hops < MAX_JUMP_HOPS && target < fn->codesize
+                       && fn->code[target] == OP_JMP; ++hops) {
+        target = op_jump_target(fn->code + target);
+    }
+
+    return target;
+}
+
+static void thread_jumps(Function* fn)
+{
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        codepoint_t* ip = fn->code + pos;
+        if (op_flags((Operator) *ip) & OPF_JUMP) {
+            op_set_jump_target(ip, thread_jump(fn, op_jump_target(ip)));
+        }
+    }
+}
+
+bool* find_jump_targets(const Function* fn)
+{
+    bool* targets = calloc(fn->codesize + 1, sizeof(*targets));
+    if (!targets) optimizer_oom();
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if (op_flags((Operator) fn->code[pos]) & OPF_JUMP) {
+            targets[op_jump_target(fn->code + pos)] = true;
+        }
+    }
+
+    return targets;
+}
+
+bool* find_block_starts(const Function* fn)
+{
+    bool* starts = find_jump_targets(fn);
+    starts[0] = true;
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if (op_flags((Operator) fn->code[pos]) & (OPF_JUMP | OPF_TERMINATOR)) {
+            starts[pos + op_len((Operator) fn->code[pos])] = true;
+        }
+    }
+
+    return starts;
+}
+
+// Marks instructions that can be removed without changing behaviour,
+// returns whether there were any
+static bool mark_removable(const Function* fn, const bool* targets, bool* drop)
+{
+    bool ret = false;
+    size_t prev = fn->codesize;
+    for (size_t pos = 0; pos < fn->codesize; prev = pos, pos += op_len((Operator) fn->code[pos])) {
+        const codepoint_t* ip = fn->code + pos;
+        switch ((Operator) *ip) {
+            case OP_NOP:
+                drop[pos] = true;
+                break;
+            case OP_CAST: // Only reached from prev, which already pushes a bool
+                drop[pos] |= fetch8(ip + 1) == TYPE_BOOL && !targets[pos] && prev < pos
+                             && op_flags((Operator) fn->code[prev]) & OPF_BOOL;
+                break;
+            case OP_JMP:
+                drop[pos] |= op_jump_target(ip) == pos + op_len(OP_JMP);
+                break;
+            default:
+                break;
+        }
+        ret |= drop[pos];
+    }
+
+    return ret;
+}
+
+// A literal condition decides a branch at compile time: the jump is either
+// always taken or dropped together with the condition. Returns the number
+// of bytes dropped.
+static size_t fold_constant_branches(Function* fn, const bool* targets, bool* drop)
+{
+    size_t ret = 0;
+    size_t prev = fn->codesize;
+    for (size_t pos = 0; pos < fn->codesize; prev = pos, pos += op_len((Operator) fn->code[pos])) {
+        if (fn->code[pos] != OP_JMPZ || targets[pos] || prev >= pos || drop[prev]) {
+            continue;
+        }
+        if (fn->code[prev] == OP_TRUE) {
+            drop[prev] = drop[pos] = true;
+            ret += op_len(OP_TRUE) + op_len(OP_JMPZ);
+        } else if (fn->code[prev] == OP_FALSE) {
+            drop[prev] = true;
+            fn->code[pos] = OP_JMP;
+            ret += op_len(OP_FALSE);
+        }
+    }
+
+    return ret;
+}
+
+// Marks the code no path from the entry reaches, returns its size in bytes
+static size_t mark_unreachable(const Function* fn, bool* drop)
+{
+    bool* reached = calloc(fn->codesize + 1, sizeof(*reached));
+    size_t* pending = malloc((fn->codesize + 1) * sizeof(*pending));
+    if (!reached || !pending) optimizer_oom();
+    size_t pendinglen = 0;
+    pending[pendinglen++] = 0;
+    while (pendinglen) {
+        for (size_t pos = pending[--pendinglen]; pos < fn->codesize && !reached[pos];) {
+            const Operator op = (Operator) fn->code[pos];
+            reached[pos] = true;
+            if (op_flags(op) & OPF_JUMP) {
+                pending[pendinglen++] = op_jump_target(fn->code + pos);
+            }
+            if (op_flags(op) & OPF_TERMINATOR) {
+                break;
+            }
+            pos += op_len(op);
+        }
+    }
+
+    size_t ret = 0;
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if (!reached[pos] && !drop[pos]) {
+            drop[pos] = true;
+            ret += op_len((Operator) fn->code[pos]);
+        }
+    }
+    free(pending);
+    free(reached);
+
+    return ret;
+}
+
+// Moves the kept instructions together and relocates jumps and call sites
+static void compact(State* S, Function* fn, const bool* drop)
+{
+    uint32_t* map = malloc((fn->codesize + 1) * sizeof(*map)); // Old to new position
+    codepoint_t* code = calloc(fn->codecapacity, sizeof(*code));
+    LineTable lines;
+    init_linetable(&lines);
+    if (!map || !code) optimizer_oom();
+
+    size_t size = 0;
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        const size_t len = op_len((Operator) fn->code[pos]);
+        map[pos] = (uint32_t) size; // Removed ones continue with the next instruction
+        if (!drop[pos]) {
+            memcpy(code + size, fn->code + pos, len * sizeof(*code));
+            set_line(&lines, size, find_line(&fn->lines, pos));
+            size += len;
+        }
+    }
+    map[fn->codesize] = (uint32_t) size;
+
+    for (size_t pos = 0; pos < size; pos += op_len((Operator) code[pos])) {
+        if (op_flags((Operator) code[pos]) & OPF_JUMP) {
+            op_set_jump_target(code + pos, map[op_jump_target(code + pos)]);
+        }
+    }
+    size_t calls = 0;
+    for (size_t i = 0; i < S->calllen; ++i) {
+        if (S->calls[i].fn == fn) {
+            if (drop[S->calls[i].position]) {
+                continue; // Unreachable call, nothing to link
+            }
+            S->calls[i].position = map[S->calls[i].position];
+        }
+        S->calls[calls++] = S->calls[i];
+    }
+    S->calllen = calls;
+
+    free(fn->code);
+    free_linetable(&fn->lines);
+    fn->code = code;
+    fn->lines = lines;
+    fn->codesize = size;
+    free(map);
+}
+
+// Returns the number of bytes removed as dead code
+size_t optimize(State* S, Function* fn)
+{
+    size_t dead = 0;
+    bool changed = true;
+    while (changed) {
+        thread_jumps(fn);
+        bool* targets = find_jump_targets(fn);
+        bool* drop = calloc(fn->codesize + 1, sizeof(*drop));
+        if (!drop) optimizer_oom();
+
+        const size_t removed = fold_constant_branches(fn, targets, drop)
+                               + mark_unreachable(fn, drop);
+        dead += removed;
+        changed = mark_removable(fn, targets, drop) || removed;
+        if (changed) {
+            compact(S, fn, drop);
+        }
+        free(drop);
+        free(targets);
+    }
+
+    return dead;
+}
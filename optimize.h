@@ -0,0 +1,27 @@
+#ifndef PHPINTERP_OPTIMIZE_H
+#define PHPINTERP_OPTIMIZE_H
+
+#include "compile.h"
+
+_Noreturn void optimizer_oom(void);
+
+// Both return codesize + 1 flags by position, which the caller frees
+bool* find_jump_targets(const Function* fn);
+bool* find_block_starts(const Function* fn); // Also 0 and after jumps and terminators
+
+size_t optimize(State* S, Function* fn);
+size_t hoist_invariants(State* S, Function* fn);
+
+// What optimize_ssa changed, for -v
+typedef struct SsaStats {
+    size_t folded; // Values and branches replaced by constants
+    size_t reused; // Expressions loaded from where they were computed before
+    size_t copies; // Loads from the slot a copy was made from
+    size_t stores; // Dead writes to slots
+} SsaStats;
+
+SsaStats optimize_ssa(State* S, Function* fn, bool fresh_frame);
+void specialize_types(Function* fn, bool fresh_frame);
+size_t inline_calls(State* S, Function* fn);
+
+#endif //PHPINTERP_OPTIMIZE_H
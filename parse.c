@@ -8,22 +8,104 @@
 #include <inttypes.h>
 #include "parse.h"
 #include "util.h"
+#include "array-util.h"
 
 DEFINE_ENUM(ASTTYPE, ENUM_ASTTYPE);
 
-#define EXP0(type, token) new_ast(type, token, NULL, NULL, NULL, NULL)
-#define EXP1(type, token, one) new_ast(type, token, one, NULL, NULL, NULL)
-#define EXP2(type, token, one, two) new_ast(type, token, one, two, NULL, NULL)
-#define EXP3(type, token, one, two, three) new_ast(type, token, one, two, three, NULL)
-#define EXP4(type, token, one, two, three, four) new_ast(type, token, one, two, three, four)
+// Nodes are appended to the program of the Parser S in scope
+#define EXP0(type, token) new_ast(S, type, token, 0, NULL)
+#define EXP1(type, token, one) new_ast(S, type, token, 1, (ast_t[]) {one})
+#define EXP2(type, token, one, two) new_ast(S, type, token, 2, (ast_t[]) {one, two})
+#define EXP3(type, token, one, two, three) new_ast(S, type, token, 3, (ast_t[]) {one, two, three})
+#define EXP4(type, token, one, two, three, four) new_ast(S, type, token, 4, (ast_t[]) {one, two, three, four})
+
+// Tokens are either pulled from a lexer one at a time or read from an
+// array that was lexed up front
+struct Parser {
+    Lexer* lexer;
+    const TokenArray* tokens;
+    size_t next; // Index of the token after token
+    Token token;
+    bool consumed; // Token was passed, the next one is read on demand
+    Program program; // Being built
+
+    // Children of the lists being parsed. They are only appended to the
+    // program once a list is complete, so the kids of a node stay consecutive.
+    ast_t* scratch;
+    size_t scratchsize;
+    size_t scratchcapacity;
+};
+
+// Passes the current token. The next one is only read when the parser looks
+// at it, so a streamed statement is complete without waiting for the input
+// that follows it.
+static void get_next_token(Parser* S)
+{
+    S->consumed = true;
+}
+
+static Token* current(Parser* S)
+{
+    if (S->consumed) {
+        S->consumed = false;
+        if (S->lexer) {
+            S->token = get_token(S->lexer);
+        } else {
+            S->token = token_at(S->tokens, S->next++);
+        }
+    }
+    return &S->token;
+}
+
+// Copies the value of the current string or html token into the arena
+static char* overtake_str(Parser* S)
+{
+    Lexer* L = S->lexer;
+    if (L && L->val == MALLOCSTR) { // Unescaped by the lexer already
+        char* ret = arena_strndup(&S->program.arena, L->u.string, strlen(L->u.string));
+        free(L->u.string);
+        L->val = NONE;
+        L->u.string = NULL;
+        return ret;
+    }
+
+    const char* src = L ? L->src : S->tokens->src;
+    if (L) {
+        assert(L->val == SPAN);
+        L->val = NONE;
+    }
+    if (current(S)->type == TK_STRING && !L) {
+        char* ret = arena_alloc(&S->program.arena, current(S)->length + 1);
+        token_unescape(ret, src, *current(S));
+        return ret;
+    }
 
-static Token get_next_token(Lexer* S)
+    return arena_strndup(&S->program.arena, src + current(S)->offset, current(S)->length);
+}
+
+static symbol_t overtake_symbol(Parser* S)
 {
-    S->token = get_token(S);
-    return S->token;
+    if (!S->lexer) {
+        return intern(S->tokens->src + current(S)->offset, current(S)->length);
+    }
+
+    assert(S->lexer->val == SYMBOL);
+    S->lexer->val = NONE;
+
+    return S->lexer->u.sym;
 }
 
-_Noreturn static inline void parseerror(Lexer* S, char* fmt, ...)
+static int64_t token_long_value(Parser* S)
+{
+    if (!S->lexer) {
+        return token_long(S->tokens->src, *current(S));
+    }
+
+    assert(S->lexer->val == LONGVAL);
+    return S->lexer->u.lint;
+}
+
+_Noreturn static inline void parseerror(Parser* S, char* fmt, ...)
 {
     va_list ap;
     char msgbuf[256];
@@ -32,18 +114,16 @@ _Noreturn static inline void parseerror(Lexer* S, char* fmt, ...)
     va_end(ap);
 
     char buf[256];
-    snprintf(buf, sizeof(buf), "Parse error: %s on line %d.", msgbuf, S->lineno);
+    snprintf(buf, sizeof(buf), "Parse error: %s on line %d.", msgbuf, current(S)->lineno);
 
-    S->val = ERROR;
-    S->error = strdup(buf);
-    puts(S->error);
+    puts(buf);
 
     abort();
 }
 
-static inline bool accept(Lexer* S, int tok)
+static inline bool accept(Parser* S, int tok)
 {
-    if (S->token.type == tok) {
+    if (current(S)->type == tok) {
         get_next_token(S);
         return true;
     }
@@ -51,17 +131,17 @@ static inline bool accept(Lexer* S, int tok)
     return false;
 }
 
-static inline bool expect(Lexer* S, int tok)
+static inline bool expect(Parser* S, int tok)
 {
     if (!accept(S, tok)) {
-        parseerror(S, "Expected %s, got %s", get_token_name(tok), get_token_name(S->token.type));
+        parseerror(S, "Expected %s, got %s", get_token_name(tok), get_token_name(current(S)->type));
         return false;
     }
 
     return true;
 }
 
-static inline bool expect_one_of(Lexer* S, int count, ...)
+static inline bool expect_one_of(Parser* S, int count, ...)
 {
     va_list ap;
     va_start(ap, count);
@@ -82,51 +162,77 @@ static inline bool expect_one_of(Lexer* S, int count, ...)
         }
     }
 
-    parseerror(S, "Expected one of %s got %s", expectstr, get_token_name(S->token.type));
+    parseerror(S, "Expected one of %s got %s", expectstr, get_token_name(current(S)->type));
     return false;
 }
 
-static AST* new_ast(ASTTYPE type, Token token, AST* one, AST* two, AST* three,
-                    AST* four)
+static void destroy_program_data(Program* program);
+
+static ast_t new_ast(Parser* S, ASTTYPE type, Token token, uint32_t kidcount,
+                     const ast_t* kids)
 {
-    AST* ret = malloc(sizeof(AST));
+    Program* P = &S->program;
+    if (P->nodecount >= NO_AST - 1 || P->kidcount >= NO_AST - kidcount ||
+        !try_resize(&P->nodecapacity, P->nodecount, (void**) &P->nodes, sizeof(AST), NULL)) {
+        parseerror(S, "Out of memory for AST");
+    }
+    while (P->kidcapacity < P->kidcount + kidcount) {
+        if (!try_resize(&P->kidcapacity, P->kidcapacity, (void**) &P->kids, sizeof(ast_t), NULL)) {
+            parseerror(S, "Out of memory for AST");
+        }
+    }
 
+    AST* ret = &P->nodes[P->nodecount];
     ret->type = type;
-    ret->node1 = one;
-    ret->node2 = two;
-    ret->node3 = three;
-    ret->node4 = four;
-    ret->next = NULL;
-    ret->val.str = NULL;
     ret->lineno = token.lineno;
+    ret->kids = (uint32_t) P->kidcount;
+    ret->kidcount = kidcount;
+    ret->val.str = NULL;
+    if (kidcount) {
+        memcpy(&P->kids[P->kidcount], kids, kidcount * sizeof(ast_t));
+        P->kidcount += kidcount;
+    }
 
-    return ret;
+    return (ast_t) P->nodecount++;
 }
 
-static AST* ast_list_append(AST *block, AST *ast)
+// Only valid until the next node is added
+static inline AST* node(Parser* S, ast_t ast)
 {
-    assert(block);
-    assert(block->type == AST_LIST);
-    AST* current = block;
-    while (current->next) {
-        current = current->next;
+    return &S->program.nodes[ast];
+}
+
+static void push_scratch(Parser* S, ast_t ast)
+{
+    if (!try_resize(&S->scratchcapacity, S->scratchsize, (void**) &S->scratch,
+                    sizeof(ast_t), NULL)) {
+        parseerror(S, "Out of memory for AST");
     }
-    current->next = ast;
-    return block;
+    S->scratch[S->scratchsize++] = ast;
 }
 
-static AST* parse_expr(Lexer* S);
-static AST* parse_echostmt(Lexer* S);
-static AST* parse_const(Lexer* S);
-static AST* parse_ifstmt(Lexer* S);
-static AST* parse_whilestmt(Lexer* S);
-static AST* parse_forstmt(Lexer* S);
-static AST* parse_blockstmt(Lexer* S);
-static AST* parse_function(Lexer* S);
-static AST* parse_paramlist(Lexer* S);
-static AST* parse_identifier(Lexer* S);
+// Creates a node whose kids are the scratch entries from base on
+static ast_t end_list(Parser* S, ASTTYPE type, Token token, size_t base)
+{
+    const ast_t ret = new_ast(S, type, token, (uint32_t) (S->scratchsize - base),
+                              S->scratch + base);
+    S->scratchsize = base;
+
+    return ret;
+}
 
-static AST* parse_stmt(Lexer* S)
+static ast_t parse_expr(Parser* S);
+static ast_t parse_echostmt(Parser* S);
+static ast_t parse_const(Parser* S);
+static ast_t parse_ifstmt(Parser* S);
+static ast_t parse_whilestmt(Parser* S);
+static ast_t parse_forstmt(Parser* S);
+static ast_t parse_blockstmt(Parser* S);
+static ast_t parse_function(Parser* S);
+static ast_t parse_call(Parser* S, symbol_t name);
+static symbol_t parse_identifier(Parser* S);
+
+static ast_t parse_stmt(Parser* S)
 {
     if (accept(S, TK_ECHO)) {
         return parse_echostmt(S);
@@ -149,105 +255,114 @@ static AST* parse_stmt(Lexer* S)
     if (accept(S, '{')) {
         return parse_blockstmt(S);
     }
+    if (current(S)->type == TK_HTML) {
+        ast_t html = EXP0(AST_HTML, *current(S));
+        char* str = overtake_str(S);
+        node(S, html)->val.str = str;
+        get_next_token(S);
+        return html;
+    }
 
-    AST* ret = parse_expr(S);
+    ast_t ret = parse_expr(S);
     expect(S, ';');
     return ret;
 }
 
-static AST* parse_varexpr(Lexer* S)
+// Empty statements only occur in statement lists, e.g. around tags
+static void accept_empty_stmts(Parser* S)
 {
-    if (S->token.type == TK_VAR) {
-        AST* ret;
-        ret = EXP0(AST_VAR, S->token);
-        ret->val.str = overtake_str(S);
+    while (accept(S, ';') || accept(S, TK_OPENTAG))
+        ;
+}
+
+static ast_t parse_varexpr(Parser* S)
+{
+    if (current(S)->type == TK_VAR) {
+        Token token = *current(S);
+        symbol_t name = overtake_symbol(S);
         expect(S, TK_VAR); // Skip
+
+        ast_t ret;
         if (accept(S, '=')) {
-            ret->type = AST_ASSIGNMENT;
-            ret->node1 = parse_expr(S);
+            ret = EXP1(AST_ASSIGNMENT, token, parse_expr(S));
+        } else {
+            ret = EXP0(AST_VAR, token);
         }
+        node(S, ret)->val.sym = name;
         return ret;
     }
 
-    return NULL;
+    return NO_AST;
 }
 
-static AST* parse_primary(Lexer* S)
+static ast_t parse_primary(Parser* S)
 {
-    AST* ret;
-    if (S->token.type == TK_STRING) {
-        ret = EXP0(AST_STRING, S->token);
-        ret->val.str = overtake_str(S);
+    ast_t ret;
+    if (current(S)->type == TK_STRING) {
+        ret = EXP0(AST_STRING, *current(S));
+        char* str = overtake_str(S);
+        node(S, ret)->val.str = str;
         expect(S, TK_STRING);
         return ret;
     }
 
-    if (S->token.type == TK_LONG) {
-        ret = EXP0(AST_LONG, S->token);
-        ret->val.lint = S->u.lint;
+    if (current(S)->type == TK_LONG) {
+        ret = EXP0(AST_LONG, *current(S));
+        node(S, ret)->val.lint = token_long_value(S);
         expect(S, TK_LONG);
         return ret;
     }
 
     if (accept(S, TK_TRUE)) {
-        return EXP0(AST_TRUE, S->token);
+        return EXP0(AST_TRUE, *current(S));
     }
     if (accept(S, TK_FALSE)) {
-        return EXP0(AST_FALSE, S->token);
+        return EXP0(AST_FALSE, *current(S));
     }
     if (accept(S, TK_NULL)) {
-        return EXP0(AST_NULL, S->token);
+        return EXP0(AST_NULL, *current(S));
     }
     if (accept(S, TK_PLUSPLUS)) {
-        if (S->token.type == TK_VAR) {
-            Token token = S->token;
+        if (current(S)->type == TK_VAR) {
+            Token token = *current(S);
             ret = EXP1(AST_PREFIXOP, token, parse_varexpr(S));
-            ret->val.lint = '+';
+            node(S, ret)->val.lint = '+';
             return ret;
         } else {
             expect(S, TK_VAR); // Error
-            return NULL;
+            return NO_AST;
         }
     }
     if (accept(S, TK_MINUSMINUS)) {
-        if (S->token.type == TK_VAR) {
-            Token token = S->token;
+        if (current(S)->type == TK_VAR) {
+            Token token = *current(S);
             ret = EXP1(AST_PREFIXOP, token, parse_varexpr(S));
-            ret->val.lint = '-';
+            node(S, ret)->val.lint = '-';
             return ret;
         } else {
             expect(S, TK_VAR); // Error
-            return NULL;
+            return NO_AST;
         }
     }
-    if (accept(S, '!')) {
-        Token token = S->token;
-        return EXP1(AST_NOTOP, token, parse_expr(S));
-    }
     if (accept(S, TK_RETURN)) {
-        Token token = S->token;
+        Token token = *current(S);
         return EXP1(AST_RETURN, token, parse_expr(S));
     }
-    if (S->token.type == TK_IDENTIFIER) {
-        char* name = overtake_str(S);
+    if (current(S)->type == TK_IDENTIFIER) {
+        symbol_t name = overtake_symbol(S);
         expect(S, TK_IDENTIFIER);
         if (accept(S, '(')) { // function
-            AST* paramlist = parse_paramlist(S);
-            expect(S, ')');
-            Token token = S->token;
-            ret = EXP1(AST_CALL, token, paramlist);
-            ret->val.str = name;
-            return ret;
+            return parse_call(S, name);
         } else { // constant
-            Token token = S->token;
+            Token token = *current(S);
             ret = EXP0(AST_IDENTIFIER, token);
-            ret->val.str = name;
+            node(S, ret)->val.sym = name;
             return ret;
         }
     }
 
-    AST* varexpr = NULL;
-    if ((varexpr = parse_varexpr(S)) != NULL) {
+    ast_t varexpr = parse_varexpr(S);
+    if (varexpr != NO_AST) {
         return varexpr;
     }
 
@@ -257,327 +372,423 @@ static AST* parse_primary(Lexer* S)
         return ret;
     }
 
-    parseerror(S, "Unexpected token '%s', expected primary", get_token_name(S->token.type));
-    return NULL;
+    parseerror(S, "Unexpected token '%s', expected primary", get_token_name(current(S)->type));
+    return NO_AST;
 }
 
 
-static AST* parse_expr(Lexer* S)
+// Binding power of binary operators, 0 if the token ends an expression.
+// Follows PHP 5, highest first: * /, + - ., << >>, < <= > >=, ==, &&, ||.
+// Assignment binds weakest and is handled by parse_varexpr.
+static int binop_precedence(int type)
 {
-    AST* ret = parse_primary(S);
-    Token token = S->token;
-
-    if (accept(S, '.')) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = '.';
-    }
-    if (accept(S, '+')) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = '+';
-    }
-    if (accept(S, '-')) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = '-';
-    }
-    if (accept(S, '*')) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = '*';
-    }
-    if (accept(S, '/')) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = '/';
-    }
-    if (accept(S, TK_SHL)) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = TK_SHL;
-    }
-    if (accept(S, TK_SHR)) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = TK_SHR;
+    switch (type) {
+        case '*':
+        case '/':
+            return 7;
+        case '+':
+        case '-':
+        case '.':
+            return 6;
+        case TK_SHL:
+        case TK_SHR:
+            return 5;
+        case '<':
+        case '>':
+        case TK_LTEQ:
+        case TK_GTEQ:
+            return 4;
+        case TK_EQ:
+            return 3;
+        case TK_AND:
+            return 2;
+        case TK_OR:
+            return 1;
+        default:
+            return 0;
     }
+}
 
-    if (accept(S, TK_AND)) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = TK_AND;
-    }
-    if (accept(S, TK_OR)) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = TK_OR;
+// A primary followed by postfix ++ or --, or a negated operand
+static ast_t parse_unary(Parser* S)
+{
+    if (accept(S, '!')) {
+        Token token = *current(S);
+        return EXP1(AST_NOTOP, token, parse_unary(S));
+    }
+
+    ast_t ret = parse_primary(S);
+    for (;;) {
+        Token token = *current(S);
+        if (accept(S, TK_PLUSPLUS)) {
+            ret = EXP1(AST_POSTFIXOP, token, ret);
+            node(S, ret)->val.lint = '+';
+        } else if (accept(S, TK_MINUSMINUS)) {
+            ret = EXP1(AST_POSTFIXOP, token, ret);
+            node(S, ret)->val.lint = '-';
+        } else {
+            return ret;
+        }
     }
+}
 
-    if (accept(S, TK_EQ)) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = TK_EQ;
-    }
-    if (accept(S, '<')) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = '<';
-    }
-    if (accept(S, '>')) {
-        ret = EXP2(AST_BINOP, token, parse_expr(S), ret);
-        ret->val.lint = '<';
-    }
-    if (accept(S, TK_LTEQ)) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = TK_LTEQ;
-    }
-    if (accept(S, TK_GTEQ)) {
-        ret = EXP2(AST_BINOP, token, ret, parse_expr(S));
-        ret->val.lint = TK_GTEQ;
-    }
+// Precedence climbing. Operators of the same level are folded into a left
+// leaning tree in the loop, so recursion only goes as deep as the number of
+// levels and not as long as the chain.
+static ast_t parse_binop(Parser* S, int min_precedence)
+{
+    ast_t ret = parse_unary(S);
+    for (;;) {
+        const int op = current(S)->type;
+        const int precedence = binop_precedence(op);
+        if (precedence == 0 || precedence < min_precedence) {
+            return ret;
+        }
 
-    if (accept(S, TK_PLUSPLUS)) {
-        ret = EXP1(AST_POSTFIXOP, token, ret);
-        ret->val.lint = '+';
-    }
-    if (accept(S, TK_MINUSMINUS)) {
-        ret = EXP1(AST_POSTFIXOP, token, ret);
-        ret->val.lint = '-';
+        Token token = *current(S);
+        get_next_token(S);
+        ret = EXP2(AST_BINOP, token, ret, parse_binop(S, precedence + 1));
+        node(S, ret)->val.lint = op;
     }
+}
 
-    return ret;
+static ast_t parse_expr(Parser* S)
+{
+    return parse_binop(S, 1);
 }
 
-static AST* parse_echostmt(Lexer* S)
+static ast_t parse_echostmt(Parser* S)
 {
-    Token token = S->token;
-    AST* expr = parse_expr(S);
+    Token token = *current(S);
+    ast_t expr = parse_expr(S);
 
     expect(S, ';');
 
-    AST* ret = EXP1(AST_ECHO, token, expr);
-    return ret;
+    return EXP1(AST_ECHO, token, expr);
 }
 
-static AST* parse_const(Lexer* S) 
+static ast_t parse_const(Parser* S)
 {
-    Token token = S->token;
-    AST* identifier = parse_identifier(S);
+    Token token = *current(S);
+    symbol_t name = parse_identifier(S);
     expect(S, '=');
-    AST* expr = parse_expr(S);
+    ast_t expr = parse_expr(S);
     expect(S, ';');
 
-    return EXP2(AST_CONSTDECL, token, identifier, expr);
+    ast_t ret = EXP1(AST_CONSTDECL, token, expr);
+    node(S, ret)->val.sym = name;
+    return ret;
 }
 
-static AST* parse_blockstmt(Lexer* S)
+static ast_t parse_blockstmt(Parser* S)
 {
-    AST* ret = EXP0(AST_LIST, S->token);
-    while (S->token.type != '}') {
-        ast_list_append(ret, parse_stmt(S));
+    Token token = *current(S);
+    const size_t base = S->scratchsize;
+    accept_empty_stmts(S);
+    while (current(S)->type != '}') {
+        push_scratch(S, parse_stmt(S));
+        accept_empty_stmts(S);
     }
     expect(S, '}');
 
-    return ret;
+    return end_list(S, AST_LIST, token, base);
 }
 
-static AST* parse_ifstmt(Lexer* S)
+static ast_t parse_ifstmt(Parser* S)
 {
-    Token token = S->token;
+    Token token = *current(S);
     expect(S, '(');
-    AST* expr = parse_expr(S);
+    ast_t expr = parse_expr(S);
     expect(S, ')');
 
-    AST* body = parse_stmt(S);
+    ast_t body = parse_stmt(S);
 
-    AST* else_body = NULL;
     if (accept(S, TK_ELSE)) {
-        else_body = parse_stmt(S);
+        ast_t else_body = parse_stmt(S);
+        return EXP3(AST_IF, token, expr, body, else_body);
     }
 
-    AST* ret = EXP3(AST_IF, token, expr, body, else_body);
-    return ret;
+    return EXP2(AST_IF, token, expr, body);
 }
 
-static AST* parse_whilestmt(Lexer* S)
+static ast_t parse_whilestmt(Parser* S)
 {
-    Token token = S->token;
+    Token token = *current(S);
     expect(S, '(');
-    AST* expr = parse_expr(S);
+    ast_t expr = parse_expr(S);
     expect(S, ')');
 
-    AST* body = parse_stmt(S);
+    ast_t body = parse_stmt(S);
 
     return EXP2(AST_WHILE, token, expr, body);
 }
 
-static AST* parse_forstmt(Lexer* S)
+static ast_t parse_forstmt(Parser* S)
 {
-    Token token = S->token;
+    Token token = *current(S);
     expect(S, '(');
-    AST* init = parse_expr(S);
+    ast_t init = parse_expr(S);
     expect(S, ';');
-    AST* condition = parse_expr(S);
+    ast_t condition = parse_expr(S);
     expect(S, ';');
-    AST* post = parse_expr(S);
+    ast_t post = parse_expr(S);
     expect(S, ')');
 
-    AST* body = parse_stmt(S);
+    ast_t body = parse_stmt(S);
     return EXP4(AST_FOR, token, init, condition, post, body);
 }
 
-static AST* parse_identifier(Lexer* S)
+static symbol_t parse_identifier(Parser* S)
 {
     // This function is used so we can get better line numbers for error messages
-    if (S->token.type != TK_IDENTIFIER) {
+    if (current(S)->type != TK_IDENTIFIER) {
         expect(S, TK_IDENTIFIER); // Raise error
-        return NULL;
+        return NO_SYMBOL;
     }
 
-    AST* ret = EXP0(AST_IDENTIFIER, S->token);
-    ret->val.str = overtake_str(S);
+    symbol_t ret = overtake_symbol(S);
     expect(S, TK_IDENTIFIER); // Skip
 
     return ret;
 }
 
-static AST* parse_arglist(Lexer* S)
+// The arguments become the kids of the call
+static ast_t parse_call(Parser* S, symbol_t name)
 {
-    AST* ret = EXP0(AST_LIST, S->token);
-
-    if (S->token.type == ')') {
-        return ret;
-    }
-
-    while (true) {
-        if (S->token.type == TK_VAR) {
-            AST* arg = EXP0(AST_ARGUMENT, S->token);
-            arg->val.str = overtake_str(S);
-            ast_list_append(ret, arg);
-        }
-        expect(S, TK_VAR);
-
-        if (S->token.type != ',') {
-            break;
+    const size_t base = S->scratchsize;
+    if (current(S)->type != ')') {
+        while (true) {
+            push_scratch(S, parse_expr(S));
+
+            if (current(S)->type != ',') {
+                break;
+            }
+            get_next_token(S);
         }
-        get_next_token(S);
     }
+    expect(S, ')');
+    Token token = *current(S);
 
+    ast_t ret = end_list(S, AST_CALL, token, base);
+    node(S, ret)->val.sym = name;
     return ret;
 }
 
-static AST* parse_paramlist(Lexer* S)
+// The kids of a function are its body followed by one AST_ARGUMENT per
+// parameter
+static ast_t parse_function(Parser* S)
 {
-    AST* ret = EXP0(AST_LIST, S->token);
-
-    if (S->token.type == ')') {
-        return ret;
+    if (current(S)->type != TK_IDENTIFIER) {
+        parseerror(S, "Expected IDENTIFIER, %s given.", get_token_name(current(S)->type));
+        return NO_AST;
     }
+    Token token = *current(S);
+    symbol_t name = parse_identifier(S);
+    expect(S, '(');
 
-    while (true) {
-        ast_list_append(ret, parse_expr(S));
-
-        if (S->token.type != ',') {
-            break;
+    const size_t base = S->scratchsize;
+    push_scratch(S, NO_AST); // Body, filled in below
+    if (current(S)->type != ')') {
+        while (true) {
+            if (current(S)->type == TK_VAR) {
+                ast_t arg = EXP0(AST_ARGUMENT, *current(S));
+                node(S, arg)->val.sym = overtake_symbol(S);
+                push_scratch(S, arg);
+            }
+            expect(S, TK_VAR);
+
+            if (current(S)->type != ',') {
+                break;
+            }
+            get_next_token(S);
         }
-        get_next_token(S);
     }
+    expect(S, ')');
+    const ast_t body = parse_stmt(S);
+    S->scratch[base] = body;
 
+    ast_t ret = end_list(S, AST_FUNCTION, token, base);
+    node(S, ret)->val.sym = name;
     return ret;
 }
 
-static AST* parse_function(Lexer* S)
+static void init_program(Program* P)
 {
-    if (S->token.type != TK_IDENTIFIER) {
-        parseerror(S, "Expected IDENTIFIER, %s given.", get_token_name(S->token.type));
-        return NULL;
-    }
-    Token token = S->token;
-    AST* name = parse_identifier(S);
-    expect(S, '(');
-    AST* parameters = parse_arglist(S);
-    expect(S, ')');
-    AST* body = parse_stmt(S);
+    P->nodes = NULL;
+    P->nodecount = P->nodecapacity = 0;
+    P->kids = NULL;
+    P->kidcount = P->kidcapacity = 0;
+    P->root = NO_AST;
+    init_arena(&P->arena);
+}
 
-    AST* ret = EXP3(AST_FUNCTION, token, name, parameters, body);
+static void init_parser(Parser* S, Lexer* lexer, const TokenArray* tokens)
+{
+    S->lexer = lexer;
+    S->tokens = tokens;
+    S->next = 0;
+    S->token = lexer ? lexer->token : create_token(0, 1);
+    S->consumed = false;
+    init_program(&S->program);
+    S->scratch = NULL;
+    S->scratchsize = S->scratchcapacity = 0;
+}
 
-    return ret;
+// Statements up to the end of input as a list
+static ast_t parse_stmts(Parser* S, Token token)
+{
+    const size_t base = S->scratchsize;
+    accept_empty_stmts(S);
+    while (current(S)->type != TK_END) {
+        push_scratch(S, parse_stmt(S));
+        accept_empty_stmts(S);
+    }
+    return end_list(S, AST_LIST, token, base);
 }
 
-AST* parse(FILE* file)
+static Program* parse_program(Parser* S)
 {
-    Lexer* S = create_lexer(file);
-    AST* ret = EXP0(AST_LIST, S->token);
+    Token token = *current(S);
     get_next_token(S); // init
-    while (S->token.type != TK_END) {
-        if (S->token.type == TK_HTML) {
-            AST* html = EXP0(AST_HTML, S->token);
-            html->val.str = S->u.string;
-            ast_list_append(ret, html);
-        }
-        if (S->mode != PHP || S->token.type == TK_OPENTAG) {
-            get_next_token(S);
-            continue;
-        }
+    S->program.root = parse_stmts(S, token);
+    free(S->scratch);
 
-        ast_list_append(ret, parse_stmt(S));
+    Program* ret = malloc(sizeof(Program));
+    if (!ret) {
+        destroy_program_data(&S->program);
+        return NULL;
     }
-    destroy_lexer(S);
+    *ret = S->program; // Handed over to the result
+
+    return ret;
+}
+
+Program* parse_lexer(Lexer* lexer)
+{
+    Parser S;
+    init_parser(&S, lexer, NULL);
+    Program* ret = parse_program(&S);
+    destroy_lexer(lexer);
 
     return ret;
 }
 
-size_t ast_list_count(AST* ast)
+Program* parse_tokens(const TokenArray* tokens)
 {
-    assert(ast->type == AST_LIST);
-    size_t ret = 0;
+    Parser S;
+    init_parser(&S, NULL, tokens);
+    return parse_program(&S);
+}
 
-    while (ast->next) {
-        ret++;
-        ast = ast->next;
+Parser* create_parser(Lexer* lexer)
+{
+    Parser* ret = malloc(sizeof(Parser));
+    if (!ret) {
+        destroy_lexer(lexer);
+        return NULL;
     }
+    init_parser(ret, lexer, NULL);
+    get_next_token(ret); // init
 
     return ret;
 }
 
-void destroy_ast(AST* ast)
+// Returns NULL at the end of input. The statement is the root of the
+// returned program, which is cleared by the next call.
+// Does not read past the statement, except for an if statement, which looks
+// for an else.
+const Program* parse_next_stmt(Parser* S)
 {
-    if (ast->type == AST_STRING || ast->type == AST_VAR ||
-        ast->type == AST_ASSIGNMENT || ast->type == AST_ARGUMENT) {
-        free(ast->val.str);
-    }
-    if (ast->next) {
-        destroy_ast(ast->next);
+    Program* P = &S->program;
+    P->nodecount = P->kidcount = 0;
+    reset_arena(&P->arena);
+    accept_empty_stmts(S);
+    if (current(S)->type == TK_END) {
+        return NULL;
     }
 
-    if (ast->node1) {
-        destroy_ast(ast->node1);
-    }
-    if (ast->node2) {
-        destroy_ast(ast->node2);
-    }
+    P->root = parse_stmt(S);
+    return P;
+}
+
+// Parses the rest of the input into one list, like parse does for a whole
+// file. The program is cleared by the next call.
+const Program* parse_remaining(Parser* S)
+{
+    Program* P = &S->program;
+    P->nodecount = P->kidcount = 0;
+    reset_arena(&P->arena);
+    P->root = parse_stmts(S, *current(S));
+    return P;
+}
+
+void destroy_parser(Parser* S)
+{
+    destroy_lexer(S->lexer);
+    destroy_program_data(&S->program);
+    free(S->scratch);
+    free(S);
+}
 
-    if (ast->node3) {
-        destroy_ast(ast->node3);
+Program* parse(FILE* file)
+{
+    Lexer* S = create_lexer(file);
+    if (!S) {
+        return NULL;
     }
 
-    if (ast->node4) {
-        destroy_ast(ast->node4);
+    return parse_lexer(S);
+}
+
+Program* parse_buffer(const char* buf, size_t len)
+{
+    Lexer* S = create_lexer_from_buffer(buf, len);
+    if (!S) {
+        return NULL;
     }
 
-    free(ast);
+    return parse_lexer(S);
+}
+
+static void destroy_program_data(Program* program)
+{
+    free(program->nodes);
+    free(program->kids);
+    free_arena(&program->arena);
 }
 
+void destroy_program(Program* program)
+{
+    destroy_program_data(program);
+    free(program);
+}
 
-void print_ast(AST* ast, int level)
+void print_ast(const Program* P, ast_t idx, int level)
 {
+    const AST* ast = ast_node(P, idx);
     for (int i = 0; i < level; ++i) {
         putchar('|');
         putchar(' ');
     }
-    printf("%p %s (%d): ", ast, get_ASTTYPE_name(ast->type), ast->lineno);
+    printf("#%u %s (%d): ", idx, get_ASTTYPE_name(ast->type), ast->lineno);
 
     char* escaped;
     switch (ast->type) {
         case AST_STRING:
-        case AST_VAR:
-        case AST_ASSIGNMENT:
-        case AST_FUNCTION:
-        case AST_CALL:
+        case AST_HTML:
             escaped = malloc((strlen(ast->val.str) * 2 + 1) * sizeof(char));
             puts(escaped_str(escaped, ast->val.str));
             free(escaped);
             break;
+        case AST_VAR:
+        case AST_ASSIGNMENT:
+        case AST_ARGUMENT:
+        case AST_IDENTIFIER:
+        case AST_CALL:
+        case AST_CONSTDECL:
+        case AST_FUNCTION:
+            puts(symbol_name(ast->val.sym));
+            break;
         case AST_LONG:
             printf("%" PRId64 "\n", ast->val.lint);
             break;
@@ -589,27 +800,7 @@ void print_ast(AST* ast, int level)
             break;
     }
 
-    if (ast->type == AST_LIST) {
-        while (ast->next) {
-            print_ast(ast->next, level+1);
-            ast = ast->next;
-        }
-        return;
-    }
-
-    if (ast->node1) {
-        print_ast(ast->node1, level+1);
-    }
-
-    if (ast->node2) {
-        print_ast(ast->node2, level+1);
+    for (uint32_t i = 0; i < ast->kidcount; ++i) {
+        print_ast(P, P->kids[ast->kids + i], level + 1);
     }
-
-    if (ast->node3) {
-        print_ast(ast->node3, level+1);
-    }
-
-    if (ast->node4) {
-        print_ast(ast->node4, level+1);
-    }
-}
\ No newline at end of file
+}
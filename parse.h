@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include "lex.h"
+#include "arena.h"
 #include "enum-util.h"
 
 #define ENUM_ASTTYPE(ENUM_EL)   \
@@ -32,37 +33,65 @@
 
 DECLARE_ENUM(ASTTYPE, ENUM_ASTTYPE);
 
+// Nodes refer to each other by their index in Program.nodes
+typedef uint32_t ast_t;
+
+#define NO_AST ((ast_t) -1)
+
 typedef struct AST {
     ASTTYPE type;
+    lineno_t lineno;
+    uint32_t kids; // Offset of the first child in Program.kids
+    uint32_t kidcount;
     union {
         char* str;
         int64_t lint;
+        symbol_t sym;
     } val;
-    lineno_t lineno;
-    struct AST* node1;
-    struct AST* node2;
-    struct AST* node3;
-    struct AST* node4;
-    struct AST* next;
 } AST;
 
-AST* parse(FILE*);
+// A parsed script. All nodes live in one vector and the children of a node
+// are consecutive entries of kids. Strings are kept in the arena.
+typedef struct Program {
+    AST* nodes;
+    size_t nodecount;
+    size_t nodecapacity;
+    ast_t* kids;
+    size_t kidcount;
+    size_t kidcapacity;
+    ast_t root;
+    Arena arena;
+} Program;
 
-size_t ast_list_count(AST*);
-void print_ast(AST*, int level);
+Program* parse(FILE*);
+Program* parse_buffer(const char* buf, size_t len);
+Program* parse_lexer(Lexer*);
+Program* parse_tokens(const TokenArray*);
+void destroy_program(Program*);
 
-void destroy_ast(AST*);
+// Parses one top-level statement at a time, for running a script while it
+// is still being read
+typedef struct Parser Parser;
+Parser* create_parser(Lexer*);
+const Program* parse_next_stmt(Parser*);
+const Program* parse_remaining(Parser*);
+void destroy_parser(Parser*);
 
-static inline char* overtake_str(Lexer* S)
-{
-    assert(S->val == MALLOCSTR || S->val == STATICSTR);
+void print_ast(const Program*, ast_t, int level);
 
-    char* ret = S->u.string;
-
-    S->val = NONE;
-    S->u.string = NULL;
+static inline const AST* ast_node(const Program* P, ast_t idx)
+{
+    assert(idx < P->nodecount);
+    return &P->nodes[idx];
+}
 
-    return ret;
+// The i-th child of ast, NULL if it has fewer
+static inline const AST* ast_kid(const Program* P, const AST* ast, uint32_t i)
+{
+    if (i >= ast->kidcount) {
+        return NULL;
+    }
+    return ast_node(P, P->kids[ast->kids + i]);
 }
 
 #endif //PHPINTERP_PARSE_H
@@ -0,0 +1,95 @@
+#ifndef PHPINTERP_REGCODE_H
+#define PHPINTERP_REGCODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "compile.h"
+
+// Register form of a Function for the -r backend. It is translated from the
+// finished stack bytecode when the Function first runs. Registers are the
+// local slots followed by one temporary per stack depth, so operands are
+// addressed in the frame instead of going through the stack.
+
+#define ENUM_REGOP(ENUM_EL) \
+        ENUM_EL(R_INVALID, = 0) \
+        ENUM_EL(R_MOVE,)        /* a = b */ \
+        ENUM_EL(R_BOOL,)        /* a = extra */ \
+        ENUM_EL(R_NULL,)        /* a = null */ \
+        ENUM_EL(R_LTE,)         /* a = b op c */ \
+        ENUM_EL(R_GTE,) \
+        ENUM_EL(R_LT,) \
+        ENUM_EL(R_GT,) \
+        ENUM_EL(R_AND,) \
+        ENUM_EL(R_OR,) \
+        ENUM_EL(R_EQ,) \
+        ENUM_EL(R_CONCAT,) \
+        ENUM_EL(R_SUB,) \
+        ENUM_EL(R_ADD,) \
+        ENUM_EL(R_MUL,) \
+        ENUM_EL(R_DIV,) \
+        ENUM_EL(R_SHL,) \
+        ENUM_EL(R_SHR,) \
+        ENUM_EL(R_NOT,)         /* a = !b */ \
+        ENUM_EL(R_CAST,)        /* a = (extra) b */ \
+        ENUM_EL(R_ECHO,)        /* echo b */ \
+        ENUM_EL(R_RETURN,)      /* return b */ \
+        ENUM_EL(R_CALL,)        /* a = symbol b(extra arguments from register c on) */ \
+        ENUM_EL(R_CALL_DIRECT,) /* a = function b(extra arguments from register c on) */ \
+        ENUM_EL(R_TAILCALL,)    /* return function b(extra arguments from register c on) */ \
+        ENUM_EL(R_CLOOKUP,)     /* a = constant named b */ \
+        ENUM_EL(R_CONSTDECL,)   /* constant named a = b */ \
+        ENUM_EL(R_INC,)         /* a++ */ \
+        ENUM_EL(R_DEC,)         /* a-- */ \
+        ENUM_EL(R_ADDK,)        /* a += long constant b */ \
+        ENUM_EL(R_APPEND,)      /* a .= b */ \
+        ENUM_EL(R_JMP,)         /* goto a */ \
+        ENUM_EL(R_JMPZ,)        /* if !b goto a */ \
+        ENUM_EL(R_JLT,)         /* if b < c goto a */ \
+        ENUM_EL(R_JLE,) \
+        ENUM_EL(R_JGT,) \
+        ENUM_EL(R_JGE,) \
+        ENUM_EL(R_JEQ,) \
+        ENUM_EL(R_JNE,) \
+        ENUM_EL(R_ADD_LL,)      /* Operands proven to be longs, see OP_ADD_LL */ \
+        ENUM_EL(R_SUB_LL,) \
+        ENUM_EL(R_MUL_LL,) \
+        ENUM_EL(R_LT_LL,) \
+        ENUM_EL(R_LTE_LL,) \
+        ENUM_EL(R_GT_LL,) \
+        ENUM_EL(R_GTE_LL,) \
+        ENUM_EL(R_JLT_LL,) \
+        ENUM_EL(R_JLE_LL,) \
+        ENUM_EL(R_JGT_LL,) \
+        ENUM_EL(R_JGE_LL,) \
+        ENUM_EL(R_MAX_VALUE,)
+
+DECLARE_ENUM(RegOp, ENUM_REGOP);
+
+// Operands b and c either name a register or, with this bit set, an entry
+// of the constant pool
+#define RK_CONST ((uint32_t) 1 << 31)
+
+typedef struct RegInstr {
+    uint8_t op;
+    uint8_t extra;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+} RegInstr;
+
+typedef struct RegCode {
+    RegInstr* code;
+    LineTable lines; // By instruction index
+    size_t size;
+    size_t capacity;
+
+    uint32_t regcount;
+} RegCode;
+
+RegCode* translate_registers(Function* fn);
+void free_regcode(RegCode* rc);
+void print_regcode(const Function* fn, const char* name);
+
+bool run_registers(Runtime* R, Function* fn);
+
+#endif //PHPINTERP_REGCODE_H
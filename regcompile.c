@@ -0,0 +1,493 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include "regcode.h"
+#include "op_util.h"
+#include "optimize.h"
+
+DEFINE_ENUM(RegOp, ENUM_REGOP);
+
+// Translation walks the stack bytecode once and keeps a virtual stack. An
+// entry names where the value can be read: a local, a constant, or the
+// temporary for its depth. Loads of locals and constants emit nothing, the
+// consumer reads them in place. Entries are moved to their own temporary
+// before the local they read is written, and at every jump and jump target,
+// where all paths have to agree on the registers.
+
+#define NO_PRODUCER ((size_t) -1)
+
+typedef struct Entry {
+    uint32_t operand;
+    size_t producer; // Instruction that computed the value into its temporary
+} Entry;
+
+typedef struct Translator {
+    Function* fn;
+    RegCode* rc;
+    Entry* stack;
+    size_t depth;
+    size_t capacity;
+    lineno_t lineno;
+} Translator;
+
+static void oom(void)
+{
+    compiletimeerror("Out of memory while translating to registers");
+}
+
+static uint32_t temp(const Translator* T, size_t depth)
+{
+    const size_t reg = T->fn->locals.size + depth;
+    if (reg >= RK_CONST) {
+        compiletimeerror("Too many registers");
+    }
+
+    return (uint32_t) reg;
+}
+
+static size_t emit(Translator* T, RegOp op, uint8_t extra, uint32_t a, uint32_t b, uint32_t c)
+{
+    RegCode* rc = T->rc;
+    if (rc->size == rc->capacity) {
+        rc->capacity = rc->capacity ? rc->capacity * 2 : 64;
+        RegInstr* code = realloc(rc->code, rc->capacity * sizeof(*code));
+        if (!code) oom();
+        rc->code = code;
+    }
+
+    rc->code[rc->size] = (RegInstr) {(uint8_t) op, extra, a, b, c};
+    set_line(&rc->lines, rc->size, T->lineno);
+    return rc->size++;
+}
+
+static void push_entry(Translator* T, uint32_t operand, size_t producer)
+{
+    if (!try_resize(&T->capacity, T->depth, (void**)&T->stack, sizeof(*T->stack), NULL)) {
+        oom();
+    }
+    T->stack[T->depth++] = (Entry) {operand, producer};
+    if (temp(T, T->depth) > T->rc->regcount) {
+        T->rc->regcount = temp(T, T->depth);
+    }
+}
+
+static Entry pop_entry(Translator* T)
+{
+    assert(T->depth > 0);
+    return T->stack[--T->depth];
+}
+
+// Computes a value into the temporary of the next depth
+static void produce(Translator* T, RegOp op, uint8_t extra, uint32_t b, uint32_t c)
+{
+    const uint32_t dst = temp(T, T->depth);
+    push_entry(T, dst, emit(T, op, extra, dst, b, c));
+}
+
+static void materialize(Translator* T, size_t i)
+{
+    if (T->stack[i].operand != temp(T, i)) {
+        T->stack[i].producer = emit(T, R_MOVE, 0, temp(T, i), T->stack[i].operand, 0);
+        T->stack[i].operand = temp(T, i);
+    }
+}
+
+static void materialize_all(Translator* T)
+{
+    for (size_t i = 0; i < T->depth; ++i) {
+        materialize(T, i);
+        T->stack[i].producer = NO_PRODUCER;
+    }
+}
+
+// Called before slot is written
+static void materialize_readers(Translator* T, uint32_t slot)
+{
+    for (size_t i = 0; i < T->depth; ++i) {
+        if (T->stack[i].operand == slot) {
+            materialize(T, i);
+        }
+    }
+}
+
+static void translate_store(Translator* T, uint32_t slot)
+{
+    Entry value = pop_entry(T);
+    materialize_readers(T, slot);
+    if (value.operand == slot) {
+        return;
+    }
+    if (value.producer != NO_PRODUCER && value.producer == T->rc->size - 1
+        && value.operand == temp(T, T->depth)) {
+        T->rc->code[value.producer].a = slot; // Compute right into the local
+    } else {
+        emit(T, R_MOVE, 0, slot, value.operand, 0);
+    }
+}
+
+static void translate_call(Translator* T, RegOp op, uint32_t callee, uint8_t argc)
+{
+    assert(T->depth >= argc);
+    for (size_t i = T->depth - argc; i < T->depth; ++i) {
+        materialize(T, i); // Arguments in consecutive registers
+    }
+    T->depth -= argc;
+    produce(T, op, argc, callee, temp(T, T->depth));
+}
+
+static RegOp binop_regop(Operator op)
+{
+    switch (op) {
+        case OP_LTE: return R_LTE;
+        case OP_GTE: return R_GTE;
+        case OP_LT: return R_LT;
+        case OP_GT: return R_GT;
+        case OP_AND: return R_AND;
+        case OP_OR: return R_OR;
+        case OP_EQ: return R_EQ;
+        case OP_CONCAT: return R_CONCAT;
+        case OP_SUB: return R_SUB;
+        case OP_ADD: return R_ADD;
+        case OP_MUL: return R_MUL;
+        case OP_DIV: return R_DIV;
+        case OP_SHL: return R_SHL;
+        case OP_SHR: return R_SHR;
+        case OP_JLT: return R_JLT;
+        case OP_JLE: return R_JLE;
+        case OP_JGT: return R_JGT;
+        case OP_JGE: return R_JGE;
+        case OP_JEQ: return R_JEQ;
+        case OP_JNE: return R_JNE;
+        case OP_ADD_LL: return R_ADD_LL;
+        case OP_SUB_LL: return R_SUB_LL;
+        case OP_MUL_LL: return R_MUL_LL;
+        case OP_LT_LL: return R_LT_LL;
+        case OP_LTE_LL: return R_LTE_LL;
+        case OP_GT_LL: return R_GT_LL;
+        case OP_GTE_LL: return R_GTE_LL;
+        case OP_JLT_LL: return R_JLT_LL;
+        case OP_JLE_LL: return R_JLE_LL;
+        case OP_JGT_LL: return R_JGT_LL;
+        case OP_JGE_LL: return R_JGE_LL;
+        default: return R_INVALID;
+    }
+}
+
+static void translate_instr(Translator* T, size_t pos)
+{
+    Function* fn = T->fn;
+    const codepoint_t* ip = fn->code + pos;
+    const Operator op = (Operator) *ip;
+    Entry lhs, rhs;
+    Variant line;
+    switch (op) {
+        case OP_NOP:
+            break;
+        case OP_RETURN:
+            emit(T, R_RETURN, 0, 0, pop_entry(T).operand, 0);
+            break;
+        case OP_CALL:
+            translate_call(T, R_CALL, fetch32(ip + 1), fetch8(ip + 5));
+            break;
+        case OP_CALL_DIRECT:
+            translate_call(T, R_CALL_DIRECT, fetch32(ip + 1), fetch8(ip + 5));
+            break;
+        case OP_TAILCALL:
+            translate_call(T, R_TAILCALL, fetch32(ip + 1), fetch8(ip + 5));
+            break;
+        case OP_ECHO:
+            emit(T, R_ECHO, 0, 0, pop_entry(T).operand, 0);
+            break;
+        case OP_CONST:
+            push_entry(T, RK_CONST | fetch32(ip + 1), NO_PRODUCER);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            produce(T, R_BOOL, op == OP_TRUE, 0, 0);
+            break;
+        case OP_NULL:
+            produce(T, R_NULL, 0, 0, 0);
+            break;
+        case OP_LTE:
+        case OP_GTE:
+        case OP_LT:
+        case OP_GT:
+        case OP_AND:
+        case OP_OR:
+        case OP_EQ:
+        case OP_CONCAT:
+        case OP_SUB:
+        case OP_ADD:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_ADD_LL:
+        case OP_SUB_LL:
+        case OP_MUL_LL:
+        case OP_LT_LL:
+        case OP_LTE_LL:
+        case OP_GT_LL:
+        case OP_GTE_LL:
+            rhs = pop_entry(T);
+            lhs = pop_entry(T);
+            produce(T, binop_regop(op), 0, lhs.operand, rhs.operand);
+            break;
+        case OP_NOT:
+            produce(T, R_NOT, 0, pop_entry(T).operand, 0);
+            break;
+        case OP_CAST:
+            produce(T, R_CAST, fetch8(ip + 1), pop_entry(T).operand, 0);
+            break;
+        case OP_LOAD_SLOT:
+            push_entry(T, fetch32(ip + 1), NO_PRODUCER);
+            break;
+        case OP_STORE_SLOT:
+            translate_store(T, fetch32(ip + 1));
+            break;
+        case OP_INC_SLOT:
+        case OP_DEC_SLOT:
+            materialize_readers(T, fetch32(ip + 1));
+            emit(T, op == OP_INC_SLOT ? R_INC : R_DEC, 0, fetch32(ip + 1), 0, 0);
+            break;
+        case OP_ADD_SLOT:
+            materialize_readers(T, fetch32(ip + 1));
+            emit(T, R_ADDK, 0, fetch32(ip + 1), fetch32(ip + 5), 0);
+            break;
+        case OP_APPEND_SLOT:
+            rhs = pop_entry(T);
+            if (rhs.operand == fetch32(ip + 1)) { // Appending to itself
+                emit(T, R_MOVE, 0, temp(T, T->depth), rhs.operand, 0);
+                rhs.operand = temp(T, T->depth);
+            }
+            materialize_readers(T, fetch32(ip + 1));
+            emit(T, R_APPEND, 0, fetch32(ip + 1), rhs.operand, 0);
+            break;
+        case OP_CLOOKUP:
+            produce(T, R_CLOOKUP, 0, fetch32(ip + 1), 0);
+            break;
+        case OP_CONSTDECL:
+            emit(T, R_CONSTDECL, 0, fetch32(ip + 1), pop_entry(T).operand, 0);
+            break;
+        case OP_DUP:
+            push_entry(T, T->stack[T->depth - 1].operand, NO_PRODUCER);
+            break;
+        case OP_POP:
+            pop_entry(T);
+            break;
+        case OP_JMP: // Targets are stack positions until all are known
+            materialize_all(T);
+            emit(T, R_JMP, 0, op_jump_target(ip), 0, 0);
+            break;
+        case OP_JMPZ:
+            lhs = pop_entry(T);
+            materialize_all(T);
+            emit(T, R_JMPZ, 0, op_jump_target(ip), lhs.operand, 0);
+            break;
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JGT:
+        case OP_JGE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JLT_LL:
+        case OP_JLE_LL:
+        case OP_JGT_LL:
+        case OP_JGE_LL:
+            rhs = pop_entry(T);
+            lhs = pop_entry(T);
+            materialize_all(T);
+            emit(T, binop_regop(op), 0, op_jump_target(ip), lhs.operand, rhs.operand);
+            break;
+        case OP_GETLINE: // The line is known by now, see OP_GETLINE in run_function
+            line.type = TYPE_LONG;
+            line.u.lint = pos + 1 < fn->codesize ? find_line(&fn->lines, pos + 1) : 0;
+            push_entry(T, RK_CONST | add_const(&fn->consts, line), NO_PRODUCER);
+            break;
+        default:
+            compiletimeerror("Cannot translate %s to registers", get_Operator_name(op));
+    }
+}
+
+RegCode* translate_registers(Function* fn)
+{
+    RegCode* rc = calloc(1, sizeof(*rc));
+    uint32_t* map = malloc((fn->codesize + 1) * sizeof(*map)); // Stack to register position
+    bool* targets = find_jump_targets(fn);
+    if (!rc || !map) oom();
+    init_linetable(&rc->lines);
+
+    // Depth at the target of a forward jump. Code after an OP_JMP is only
+    // reached through jumps, such as the returns of an inlined Function that
+    // leave their value on the stack.
+    size_t* depths = malloc((fn->codesize + 1) * sizeof(*depths));
+    if (!depths) oom();
+    for (size_t pos = 0; pos <= fn->codesize; ++pos) {
+        depths[pos] = NO_PRODUCER;
+    }
+
+    Translator T = {fn, rc, NULL, 0, 0, 0};
+    rc->regcount = fn->locals.size;
+    bool reachable = true;
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        const Operator op = (Operator) fn->code[pos];
+        T.lineno = find_line(&fn->lines, pos);
+        if (!reachable && depths[pos] != NO_PRODUCER) {
+            T.depth = 0;
+            for (size_t i = 0; i < depths[pos]; ++i) { // Materialized by the jumps
+                push_entry(&T, temp(&T, i), NO_PRODUCER);
+            }
+        }
+        if (targets[pos]) {
+            materialize_all(&T); // Fall through with the same registers as jumps
+        }
+        map[pos] = (uint32_t) rc->size;
+        translate_instr(&T, pos);
+        if (op_flags(op) & OPF_JUMP && op_jump_target(fn->code + pos) > pos) {
+            depths[op_jump_target(fn->code + pos)] = T.depth;
+        }
+        reachable = !(op_flags(op) & OPF_TERMINATOR);
+    }
+    map[fn->codesize] = (uint32_t) rc->size;
+
+    for (size_t i = 0; i < rc->size; ++i) {
+        switch ((RegOp) rc->code[i].op) {
+            case R_JMP:
+            case R_JMPZ:
+            case R_JLT:
+            case R_JLE:
+            case R_JGT:
+            case R_JGE:
+            case R_JEQ:
+            case R_JNE:
+            case R_JLT_LL:
+            case R_JLE_LL:
+            case R_JGT_LL:
+            case R_JGE_LL:
+                rc->code[i].a = map[rc->code[i].a];
+                break;
+            default:
+                break;
+        }
+    }
+
+    free(T.stack);
+    free(targets);
+    free(depths);
+    free(map);
+    return rc;
+}
+
+void free_regcode(RegCode* rc)
+{
+    if (rc) {
+        free(rc->code);
+        free_linetable(&rc->lines);
+        free(rc);
+    }
+}
+
+static void print_operand(const Function* fn, uint32_t operand)
+{
+    if (!(operand & RK_CONST)) {
+        if (operand < fn->locals.size) {
+            fprintf(stderr, " $%s", symbol_name(fn->locals.names[operand]));
+        } else {
+            fprintf(stderr, " r%u", operand);
+        }
+        return;
+    }
+
+    const Variant value = fn->consts.values[operand & ~RK_CONST];
+    if (value.type == TYPE_LONG) {
+        fprintf(stderr, " %" PRId64, value.u.lint);
+    } else {
+        char* escaped = malloc(strlen(value.u.str) * 2 + 1);
+        escaped_str(escaped, value.u.str);
+        fprintf(stderr, " \"%s\"", escaped);
+        free(escaped);
+    }
+}
+
+void print_regcode(const Function* fn, const char* name)
+{
+    const RegCode* rc = fn->regcode;
+    fprintf(stderr, "Registers: %s (%u registers)\n", name, rc->regcount);
+    for (size_t i = 0; i < rc->size; ++i) {
+        const RegInstr* ins = &rc->code[i];
+        fprintf(stderr, "%04zu: %04u | %s", i, find_line(&rc->lines, i), get_RegOp_name((RegOp) ins->op));
+        switch ((RegOp) ins->op) {
+            case R_ECHO:
+            case R_RETURN:
+                print_operand(fn, ins->b);
+                break;
+            case R_BOOL:
+            case R_CAST:
+                print_operand(fn, ins->a);
+                fprintf(stderr, " %u", ins->extra);
+                print_operand(fn, ins->b);
+                break;
+            case R_CALL:
+            case R_CLOOKUP:
+                print_operand(fn, ins->a);
+                fprintf(stderr, " %s(%u)", symbol_name(ins->b), ins->extra);
+                break;
+            case R_CALL_DIRECT:
+                print_operand(fn, ins->a);
+                fprintf(stderr, " #%u(%u) from", ins->b, ins->extra);
+                print_operand(fn, ins->c);
+                break;
+            case R_TAILCALL:
+                fprintf(stderr, " #%u(%u) from", ins->b, ins->extra);
+                print_operand(fn, ins->c);
+                break;
+            case R_CONSTDECL:
+                fprintf(stderr, " %s", symbol_name(ins->a));
+                print_operand(fn, ins->b);
+                break;
+            case R_JMP:
+            case R_JMPZ:
+            case R_JLT:
+            case R_JLE:
+            case R_JGT:
+            case R_JGE:
+            case R_JEQ:
+            case R_JNE:
+            case R_JLT_LL:
+            case R_JLE_LL:
+            case R_JGT_LL:
+            case R_JGE_LL:
+                fprintf(stderr, " :%04u", ins->a);
+                if (ins->op != R_JMP) {
+                    print_operand(fn, ins->b);
+                }
+                if (ins->op != R_JMP && ins->op != R_JMPZ) {
+                    print_operand(fn, ins->c);
+                }
+                break;
+            case R_ADDK:
+                print_operand(fn, ins->a);
+                print_operand(fn, RK_CONST | ins->b);
+                break;
+            case R_INC:
+            case R_DEC:
+            case R_NULL:
+                print_operand(fn, ins->a);
+                break;
+            case R_MOVE:
+            case R_NOT:
+            case R_APPEND:
+                print_operand(fn, ins->a);
+                print_operand(fn, ins->b);
+                break;
+            default:
+                print_operand(fn, ins->a);
+                print_operand(fn, ins->b);
+                print_operand(fn, ins->c);
+                break;
+        }
+        fputc('\n', stderr);
+    }
+    fprintf(stderr, "\n\n");
+}
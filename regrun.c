@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "regcode.h"
+#include "run.h"
+#include "scope.h"
+
+static inline Variant* operand(Runtime* R, const Function* fn, uint32_t rk)
+{
+    return rk & RK_CONST ? &fn->consts.values[rk & ~RK_CONST] : &R->slots[rk];
+}
+
+// Takes ownership of value
+static inline void set_reg(Variant* reg, Variant value)
+{
+    free_var(*reg);
+    *reg = value;
+}
+
+static void set_long(Variant* reg, int64_t lint)
+{
+    set_reg(reg, (Variant) {.type = TYPE_LONG, .u.lint = lint});
+}
+
+static void set_bool(Variant* reg, bool boolean)
+{
+    set_reg(reg, (Variant) {.type = TYPE_BOOL, .u.boolean = boolean});
+}
+
+static void reg_concat(Variant* dst, Variant lhs, Variant rhs)
+{
+    char* lstr = vartostring(lhs);
+    char* rstr = vartostring(rhs);
+    const size_t llength = strlen(lstr);
+    char* str = realloc(lstr, llength + strlen(rstr) + 1);
+    if (!str) {
+        die("Out of memory for string");
+    }
+    strcpy(str + llength, rstr);
+    free(rstr);
+    set_reg(dst, (Variant) {.type = TYPE_STRING, .u.str = str});
+}
+
+static bool reg_compare(RegOp op, Variant lhs, Variant rhs)
+{
+    switch (op) {
+        case R_JEQ:
+            return compare_equal(lhs, rhs);
+        case R_JNE:
+            return !compare_equal(lhs, rhs);
+        case R_JLT:
+            return binop_bool(OP_LT, vartolong(lhs), vartolong(rhs));
+        case R_JLE:
+            return binop_bool(OP_LTE, vartolong(lhs), vartolong(rhs));
+        case R_JGT:
+            return binop_bool(OP_GT, vartolong(lhs), vartolong(rhs));
+        case R_JGE:
+            return binop_bool(OP_GTE, vartolong(lhs), vartolong(rhs));
+        default:
+            assert(false);
+            return false;
+    }
+}
+
+// Same as call_function, with the arguments in registers first..first+argc-1
+// and the result stored to dst
+static void reg_call(Runtime* R, const FunctionWrapper* callee, uint32_t dst,
+                     uint32_t first, uint8_t argc)
+{
+    Runtime* newruntime = create_callee_runtime(R);
+    if (callee->type == FUNCTION) {
+        reserve_slots(newruntime, callee->u.function->locals.size);
+        for (uint8_t i = 0; i < argc; ++i) { // Move arguments into slots 0..n-1
+            newruntime->slots[i] = R->slots[first + i];
+            R->slots[first + i].type = TYPE_UNDEF;
+        }
+        run_function(newruntime, callee->u.function);
+    } else {
+        for (uint8_t i = argc; i-- > 0;) { // Last argument on the bottom
+            push(newruntime, R->slots[first + i]);
+            set_reg(&R->slots[first + i], (Variant) {.type = TYPE_UNDEF});
+        }
+        callee->u.cfunction(newruntime);
+    }
+    if (newruntime->hasError) { // Nothing was returned
+        set_reg(&R->slots[dst], (Variant) {.type = TYPE_NULL});
+    } else {
+        set_reg(&R->slots[dst], cpy_var(*top(newruntime))); // Return variable
+    }
+    destroy_callee_runtime(R, newruntime);
+}
+
+// Call by name, for callees that were not known when the code was linked
+static void reg_call_symbol(Runtime* R, const RegInstr* ins)
+{
+    const FunctionWrapper* callee = find_function(R->state, ins->b);
+    if (!callee) {
+        raise_fatal(R, "Call to undefined function %s()", symbol_name(ins->b));
+        return;
+    }
+    if (callee->type == FUNCTION && ins->extra != callee->u.function->paramlen) {
+        raise_fatal(R, "Parameter number mismatch. %u expected, %u given",
+                    callee->u.function->paramlen, ins->extra);
+        return;
+    }
+    reg_call(R, callee, ins->a, ins->c, ins->extra);
+}
+
+// Counterpart of run_tailcall with the arguments in registers, which may be
+// among the slots they move to. Returns the callee.
+static Function* reg_tailcall(Runtime* R, const RegInstr* ins)
+{
+    Function* callee = R->state->functions[ins->b].u.function;
+    if (!callee->regcode) {
+        callee->regcode = translate_registers(callee);
+    }
+    Variant args[UINT8_MAX];
+    for (uint8_t i = 0; i < ins->extra; ++i) {
+        args[i] = R->slots[ins->c + i];
+        R->slots[ins->c + i].type = TYPE_UNDEF;
+    }
+    for (size_t i = 0; i < R->slotcount; ++i) { // Registers of a fresh frame are undefined
+        set_reg(&R->slots[i], (Variant) {.type = TYPE_UNDEF});
+    }
+    clear_scope(R->scope); // And so are its constants
+    reserve_slots(R, callee->regcode->regcount);
+    memcpy(R->slots, args, ins->extra * sizeof(*args));
+    R->function = callee;
+    R->pc = 0;
+    return callee;
+}
+
+// Temporaries are dead between runs, and the streamed pseudomain hands their
+// registers to the locals it declares later
+static void clear_temps(Runtime* R, const Function* fn)
+{
+    for (size_t i = fn->locals.size; i < fn->regcode->regcount; ++i) {
+        set_reg(&R->slots[i], (Variant) {.type = TYPE_UNDEF});
+    }
+}
+
+// Counterpart of run_function for the register code of fn, which is
+// translated on the first call. The return value is pushed to the stack.
+bool run_registers(Runtime* R, Function* fn)
+{
+    if (!fn->regcode) {
+        fn->regcode = translate_registers(fn);
+    }
+    const RegCode* rc = fn->regcode;
+    R->function = fn;
+    R->ip = NULL;
+    R->pc = 0;
+    reserve_slots(R, rc->regcount);
+
+    while (R->pc < rc->size && !R->hasError) {
+        const RegInstr* ins = &rc->code[R->pc++];
+        Variant* dst = &R->slots[ins->a];
+        Variant* lhs;
+        Variant* rhs;
+        char* str;
+        switch ((RegOp) ins->op) {
+            case R_MOVE:
+                set_reg(dst, cpy_var(*operand(R, fn, ins->b)));
+                break;
+            case R_BOOL:
+                set_bool(dst, ins->extra);
+                break;
+            case R_NULL:
+                set_reg(dst, (Variant) {.type = TYPE_NULL});
+                break;
+            case R_LTE:
+                set_bool(dst, binop_bool(OP_LTE, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_GTE:
+                set_bool(dst, binop_bool(OP_GTE, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_LT:
+                set_bool(dst, binop_bool(OP_LT, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_GT:
+                set_bool(dst, binop_bool(OP_GT, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_AND:
+                set_bool(dst, binop_bool(OP_AND, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_OR:
+                set_bool(dst, binop_bool(OP_OR, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_EQ:
+                set_bool(dst, compare_equal(*operand(R, fn, ins->b), *operand(R, fn, ins->c)));
+                break;
+            case R_CONCAT:
+                reg_concat(dst, *operand(R, fn, ins->b), *operand(R, fn, ins->c));
+                break;
+            case R_ADD:
+                lhs = operand(R, fn, ins->b);
+                rhs = operand(R, fn, ins->c);
+                if (lhs->type == TYPE_LONG && rhs->type == TYPE_LONG) {
+                    set_long(dst, lhs->u.lint + rhs->u.lint);
+                } else {
+                    set_long(dst, vartolong(*lhs) + vartolong(*rhs));
+                }
+                break;
+            case R_SUB:
+                set_long(dst, binop_long(OP_SUB, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_MUL:
+                set_long(dst, binop_long(OP_MUL, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_DIV:
+                set_long(dst, binop_long(OP_DIV, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_SHL:
+                set_long(dst, binop_long(OP_SHL, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_SHR:
+                set_long(dst, binop_long(OP_SHR, vartolong(*operand(R, fn, ins->b)),
+                                         vartolong(*operand(R, fn, ins->c))));
+                break;
+            case R_NOT:
+                set_long(dst, !vartolong(*operand(R, fn, ins->b)));
+                break;
+            case R_CAST:
+                set_reg(dst, vartotype(*operand(R, fn, ins->b), (VARIANTTYPE) ins->extra));
+                break;
+            case R_ECHO:
+                str = vartostring(*operand(R, fn, ins->b));
+                printf("%s", str);
+                free(str);
+                break;
+            case R_RETURN:
+                push(R, *operand(R, fn, ins->b));
+                clear_temps(R, fn);
+                return true;
+            case R_CALL:
+                reg_call_symbol(R, ins);
+                break;
+            case R_CALL_DIRECT: // Callee and parameter count were checked by link_calls
+                reg_call(R, &R->state->functions[ins->b], ins->a, ins->c, ins->extra);
+                break;
+            case R_TAILCALL:
+                fn = reg_tailcall(R, ins);
+                rc = fn->regcode;
+                break;
+            case R_CLOOKUP:
+                set_reg(dst, cpy_var(lookupWithFlags(R, ins->b, VAR_FLAG_CONST)));
+                break;
+            case R_CONSTDECL:
+                set_var(R, ins->a, *operand(R, fn, ins->b), VAR_FLAG_CONST);
+                break;
+            case R_INC:
+                add_to_slot(dst, 1);
+                break;
+            case R_DEC:
+                add_to_slot(dst, -1);
+                break;
+            case R_ADDK:
+                add_to_slot(dst, fn->consts.values[ins->b].u.lint);
+                break;
+            case R_APPEND:
+                append_to_slot(dst, *operand(R, fn, ins->b));
+                break;
+            case R_JMP:
+                R->pc = ins->a;
+                break;
+            case R_JMPZ:
+                if (vartolong(*operand(R, fn, ins->b)) == 0) {
+                    R->pc = ins->a;
+                }
+                break;
+            case R_JLT:
+            case R_JLE:
+            case R_JGT:
+            case R_JGE:
+            case R_JEQ:
+            case R_JNE:
+                if (reg_compare((RegOp) ins->op, *operand(R, fn, ins->b), *operand(R, fn, ins->c))) {
+                    R->pc = ins->a;
+                }
+                break;
+            case R_ADD_LL:
+                set_long(dst, operand(R, fn, ins->b)->u.lint + operand(R, fn, ins->c)->u.lint);
+                break;
+            case R_SUB_LL:
+                set_long(dst, operand(R, fn, ins->b)->u.lint - operand(R, fn, ins->c)->u.lint);
+                break;
+            case R_MUL_LL:
+                set_long(dst, operand(R, fn, ins->b)->u.lint * operand(R, fn, ins->c)->u.lint);
+                break;
+            case R_LT_LL:
+                set_bool(dst, operand(R, fn, ins->b)->u.lint < operand(R, fn, ins->c)->u.lint);
+                break;
+            case R_LTE_LL:
+                set_bool(dst, operand(R, fn, ins->b)->u.lint <= operand(R, fn, ins->c)->u.lint);
+                break;
+            case R_GT_LL:
+                set_bool(dst, operand(R, fn, ins->b)->u.lint > operand(R, fn, ins->c)->u.lint);
+                break;
+            case R_GTE_LL:
+                set_bool(dst, operand(R, fn, ins->b)->u.lint >= operand(R, fn, ins->c)->u.lint);
+                break;
+            case R_JLT_LL:
+                if (operand(R, fn, ins->b)->u.lint < operand(R, fn, ins->c)->u.lint) {
+                    R->pc = ins->a;
+                }
+                break;
+            case R_JLE_LL:
+                if (operand(R, fn, ins->b)->u.lint <= operand(R, fn, ins->c)->u.lint) {
+                    R->pc = ins->a;
+                }
+                break;
+            case R_JGT_LL:
+                if (operand(R, fn, ins->b)->u.lint > operand(R, fn, ins->c)->u.lint) {
+                    R->pc = ins->a;
+                }
+                break;
+            case R_JGE_LL:
+                if (operand(R, fn, ins->b)->u.lint >= operand(R, fn, ins->c)->u.lint) {
+                    R->pc = ins->a;
+                }
+                break;
+            default:
+                runtimeerror(R, "Unexpected register OP");
+        }
+    }
+
+    clear_temps(R, fn);
+    R->function = NULL;
+    return false;
+}
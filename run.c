@@ -12,6 +12,9 @@
 #include "util.h"
 #include "builtins/std.h"
 #include "compile.h"
+#include "source.h"
+#include "regcode.h"
+#include "cache.h"
 
 
 Variant cpy_var(Variant var)
@@ -36,8 +39,11 @@ static lineno_t get_current_line(Runtime* R)
     if (R->function == NULL) {
         return 0;
     }
+    if (R->ip == NULL) {
+        return find_line(&R->function->regcode->lines, R->pc - 1);
+    }
 
-    return R->function->lineinfo[R->ip - R->function->code];
+    return find_line(&R->function->lines, R->ip - R->function->code);
 }
 
 void runtimeerror(Runtime* R, char* fmt)
@@ -58,23 +64,27 @@ void raise_fatal(Runtime* R, char* fmt, ...)
 }
 
 
-static Runtime* create_runtime(State* S)
+Runtime* create_runtime(State* S)
 {
     Runtime* ret = malloc(sizeof(Runtime));
 
     ret->stackcapacity = 10;
     ret->stacksize = 0;
     ret->stack = calloc(ret->stackcapacity, sizeof(*ret->stack));
+    ret->slots = NULL;
+    ret->slotcount = 0;
     ret->scope = create_scope();
     ret->hasError = false;
     ret->state = S;
     ret->file = NULL;
     ret->function = NULL;
+    ret->ip = NULL;
+    ret->pc = 0;
 
     return ret;
 }
 
-static void destroy_runtime(Runtime* R)
+void destroy_runtime(Runtime* R)
 {
     for (int i = 0; i < (int) R->stacksize; ++i) {
         if (stackidx(R, i)->type == TYPE_STRING) {
@@ -82,62 +92,124 @@ static void destroy_runtime(Runtime* R)
         }
     }
     free(R->stack);
+    for (size_t i = 0; i < R->slotcount; ++i) {
+        free_var(R->slots[i]);
+    }
+    free(R->slots);
     destroy_scope(R->scope);
     free(R->file);
     free(R);
 }
 
-static FunctionWrapper* find_function(State* S, const char* name)
+// Grows the frame of R to count slots, new ones are undefined
+void reserve_slots(Runtime* R, size_t count)
 {
-    for (size_t i = 0; i < S->funlen; ++i) {
-        if (strcmp(S->functions[i].name, name) == 0) {
-            return &S->functions[i];
-        }
+    if (count <= R->slotcount) {
+        return;
     }
 
-    return NULL;
+    Variant* slots = realloc(R->slots, count * sizeof(*slots));
+    if (!slots) {
+        die("Out of memory for locals");
+    }
+    for (size_t i = R->slotcount; i < count; ++i) {
+        slots[i].type = TYPE_UNDEF;
+    }
+    R->slots = slots;
+    R->slotcount = count;
 }
 
-
-static void run_call(Runtime* R)
+// Runtime for a call from R, which lends it the file name for errors
+Runtime* create_callee_runtime(Runtime* R)
 {
-    const char* fnname = tostring(R, -1);
-    pop(R);
+    Runtime* ret = create_runtime(R->state);
+    ret->file = R->file;
 
-    FunctionWrapper* callee = find_function(R->state, fnname);
-    if (!callee) {
-        raise_fatal(R, "Call to undefined function %s()", fnname);
-        free((void*)fnname);
-        return;
-    }
-    free((void*)fnname);
-    const uint8_t param_count = fetch8(R->ip++);
+    return ret;
+}
 
-    if (callee->type == FUNCTION) {
-        if (param_count != callee->u.function->paramlen) {
-            raise_fatal(R, "Parameter number mismatch. %u expected, %u given",
-                        callee->u.function->paramlen, param_count);
-            return;
-        }
+// Hands an error raised in newruntime on to R, the caller
+void destroy_callee_runtime(Runtime* R, Runtime* newruntime)
+{
+    R->hasError |= newruntime->hasError;
+    newruntime->file = NULL;
+    destroy_runtime(newruntime);
+}
 
-        Runtime* newruntime = create_runtime(R->state);
-        for (int i = 0; i < param_count; ++i) {
-            set_var(newruntime, callee->u.function->params[i], *top(R), 0); // Transfer arguments
-            pop(R);
+static void call_function(Runtime* R, const FunctionWrapper* callee, uint8_t param_count)
+{
+    Runtime* newruntime = create_callee_runtime(R);
+    if (callee->type == FUNCTION) {
+        reserve_slots(newruntime, callee->u.function->locals.size);
+        for (int i = 0; i < param_count; ++i) { // Move arguments into slots 0..n-1
+            newruntime->slots[i] = *stackidx(R, i - param_count);
         }
+        R->stacksize -= param_count;
         run_function(newruntime, callee->u.function);
-        push(R, *top(newruntime)); // Return variable
-        destroy_runtime(newruntime);
     } else {
-        Runtime* newruntime = create_runtime(R->state);
         for (int i = 0; i < param_count; ++i) {
             push(newruntime, *top(R)); // Transfer arguments
             pop(R);
         }
         callee->u.cfunction(newruntime);
+    }
+    if (newruntime->hasError) { // Nothing was returned
+        pushnull(R);
+    } else {
         push(R, *top(newruntime)); // Return variable
-        destroy_runtime(newruntime);
     }
+    destroy_callee_runtime(R, newruntime);
+}
+
+// Call by name, for callees that were not known when the code was linked
+static void run_call(Runtime* R)
+{
+    const symbol_t fnname = fetch32(R->ip);
+    R->ip += 4;
+
+    FunctionWrapper* callee = find_function(R->state, fnname);
+    if (!callee) {
+        raise_fatal(R, "Call to undefined function %s()", symbol_name(fnname));
+        return;
+    }
+    const uint8_t param_count = fetch8(R->ip++);
+
+    if (callee->type == FUNCTION && param_count != callee->u.function->paramlen) {
+        raise_fatal(R, "Parameter number mismatch. %u expected, %u given",
+                    callee->u.function->paramlen, param_count);
+        return;
+    }
+    call_function(R, callee, param_count);
+}
+
+// Callee and parameter count were already checked by link_calls
+static void run_call_direct(Runtime* R)
+{
+    const FunctionWrapper* callee = &R->state->functions[fetch32(R->ip)];
+    const uint8_t param_count = fetch8(R->ip + 4);
+    R->ip += 5;
+    call_function(R, callee, param_count);
+}
+
+// Runs the callee of return f(...) in the frame of R, so recursion through
+// tail calls needs neither stack nor memory. Returns the callee.
+static Function* run_tailcall(Runtime* R)
+{
+    Function* callee = R->state->functions[fetch32(R->ip)].u.function;
+    const uint8_t param_count = fetch8(R->ip + 4);
+    for (size_t i = 0; i < R->slotcount; ++i) { // Locals of a fresh frame are undefined
+        free_var(R->slots[i]);
+        R->slots[i].type = TYPE_UNDEF;
+    }
+    clear_scope(R->scope); // And so are its constants
+    reserve_slots(R, callee->locals.size);
+    for (int i = 0; i < param_count; ++i) { // Move arguments into slots 0..n-1
+        R->slots[i] = *stackidx(R, i - param_count);
+    }
+    R->stacksize -= param_count;
+    R->function = callee;
+    R->ip = callee->code;
+    return callee;
 }
 
 static void run_echo(Runtime* R)
@@ -166,7 +238,18 @@ static void run_stringaddexpr(Runtime* R)
 }
 
 // https://github.com/php/php-langspec/blob/1dc4793ede53b12a2b193698d9ef44709bcf9b10/spec/10-expressions.md#relational-operators
-static bool compare_equal(Variant lhs, Variant rhs)
+// Compares var converted to type with other, on the left if left is set.
+// The converted copy is freed again, constant folding calls this too.
+static bool compare_converted(Variant var, Variant other, VARIANTTYPE type, bool left)
+{
+    Variant converted = vartotype(var, type);
+    const bool ret = left ? compare_equal(converted, other) : compare_equal(other, converted);
+    free_var(converted);
+
+    return ret;
+}
+
+bool compare_equal(Variant lhs, Variant rhs)
 {
     switch (lhs.type) {
         case TYPE_UNDEF:
@@ -176,30 +259,30 @@ static bool compare_equal(Variant lhs, Variant rhs)
                 return true;
             }
 
-            return compare_equal(vartotype(lhs, rhs.type), rhs);
+            return compare_converted(lhs, rhs, rhs.type, true);
         case TYPE_STRING:
             if (rhs.type == TYPE_STRING) {
                 return strcmp(lhs.u.str, rhs.u.str) == 0;
             }
             if (rhs.type == TYPE_NULL) {
-                return compare_equal(lhs, vartotype(rhs, TYPE_STRING));
+                return compare_converted(rhs, lhs, TYPE_STRING, false);
             } else {
-                return compare_equal(vartotype(lhs, rhs.type), rhs);
+                return compare_converted(lhs, rhs, rhs.type, true);
             }
         case TYPE_LONG:
             if (rhs.type == TYPE_LONG) {
                 return lhs.u.lint == rhs.u.lint;
             }
             if (rhs.type == TYPE_STRING || rhs.type == TYPE_NULL) {
-                return compare_equal(lhs, vartotype(rhs, TYPE_LONG));
+                return compare_converted(rhs, lhs, TYPE_LONG, false);
             } else {
-                return compare_equal(vartotype(lhs, rhs.type), rhs);
+                return compare_converted(lhs, rhs, rhs.type, true);
             }
         case TYPE_BOOL:
             if (rhs.type == TYPE_BOOL) {
                 return lhs.u.boolean == rhs.u.boolean;
             }
-            return compare_equal(lhs, vartotype(rhs, TYPE_BOOL));
+            return compare_converted(rhs, lhs, TYPE_BOOL, false);
         case TYPE_CFUNCTION:
             return rhs.type == TYPE_CFUNCTION && rhs.u.cfunction == lhs.u.cfunction;
         case TYPE_FUNCTION:
@@ -213,70 +296,139 @@ static bool compare_equal(Variant lhs, Variant rhs)
     return false;
 }
 
-static void run_binop_long(Runtime* R, int op)
+int64_t binop_long(Operator op, int64_t lhs, int64_t rhs)
 {
-    int64_t rhs = tolong(R, -1);
-    pop(R);
-    int64_t lhs = tolong(R, -1);
-    pop(R);
-    int64_t result;
     switch (op) {
-        case '+':
-            result = lhs + rhs;
-            break;
-        case '-':
-            result = lhs - rhs;
-            break;
-        case '*':
-            result = lhs * rhs;
-            break;
-        case '/':
-            result = lhs / rhs;
-            break;
-        case TK_SHL:
-            result = lhs << rhs;
-            break;
-        case TK_SHR:
-            result = lhs >> rhs;
-            break;
+        case OP_ADD:
+            return lhs + rhs;
+        case OP_SUB:
+            return lhs - rhs;
+        case OP_MUL:
+            return lhs * rhs;
+        case OP_DIV:
+            return lhs / rhs;
+        case OP_SHL:
+            return lhs << rhs;
+        case OP_SHR:
+            return lhs >> rhs;
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+bool binop_bool(Operator op, int64_t lhs, int64_t rhs)
+{
+    switch (op) {
+        case OP_LT:
+            return lhs < rhs;
+        case OP_GT:
+            return lhs > rhs;
+        case OP_AND:
+            return lhs && rhs;
+        case OP_OR:
+            return lhs || rhs;
+        case OP_LTE:
+            return lhs <= rhs;
+        case OP_GTE:
+            return lhs >= rhs;
         default:
             assert(false);
-            return;
+            return false;
     }
-    pushlong(R, result);
 }
 
-static void run_binop_bool(Runtime* R, int op)
+static void run_binop_long(Runtime* R, Operator op)
 {
     int64_t rhs = tolong(R, -1);
     pop(R);
     int64_t lhs = tolong(R, -1);
     pop(R);
-    bool result;
+    pushlong(R, binop_long(op, lhs, rhs));
+}
+
+static void run_binop_bool(Runtime* R, Operator op)
+{
+    int64_t rhs = tolong(R, -1);
+    pop(R);
+    int64_t lhs = tolong(R, -1);
+    pop(R);
+    pushbool(R, binop_bool(op, lhs, rhs));
+}
+
+// Evaluates op on two literals for the compiler, with the same semantics as
+// the interpreter. Returns false if the operation has to be left to runtime.
+bool fold_binop(Operator op, Variant lhs, Variant rhs, Variant* result)
+{
+    char* lstr;
+    char* rstr;
+    int64_t llint, rlint;
     switch (op) {
-        case '<':
-            result = lhs < rhs;
-            break;
-        case '>':
-            result = lhs > rhs;
-            break;
-        case TK_AND:
-            result = lhs && rhs;
-            break;
-        case TK_OR:
-            result = lhs || rhs;
-            break;
-        case TK_LTEQ:
-            result = lhs <= rhs;
-            break;
-        case TK_GTEQ:
-            result = lhs >= rhs;
-            break;
+        case OP_CONCAT:
+            lstr = vartostring(lhs);
+            rstr = vartostring(rhs);
+            result->type = TYPE_STRING;
+            result->u.str = malloc(strlen(lstr) + strlen(rstr) + 1);
+            strcpy(result->u.str, lstr);
+            strcat(result->u.str, rstr);
+            free(lstr);
+            free(rstr);
+            return true;
+        case OP_EQ:
+            result->type = TYPE_BOOL;
+            result->u.boolean = compare_equal(lhs, rhs);
+            return true;
+        case OP_DIV:
+        case OP_SHL:
+        case OP_SHR:
+            llint = vartolong(lhs);
+            rlint = vartolong(rhs);
+            if (op == OP_DIV ? rlint == 0 || (rlint == -1 && llint == INT64_MIN)
+                             : rlint < 0 || rlint > 63) {
+                return false; // Traps or undefined, keep the runtime behaviour
+            }
+            // fallthrough
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+            result->type = TYPE_LONG;
+            result->u.lint = binop_long(op, vartolong(lhs), vartolong(rhs));
+            return true;
+        case OP_LT:
+        case OP_GT:
+        case OP_AND:
+        case OP_OR:
+        case OP_LTE:
+        case OP_GTE:
+            result->type = TYPE_BOOL;
+            result->u.boolean = binop_bool(op, vartolong(lhs), vartolong(rhs));
+            return true;
         default:
-            assert(false);
-            return;
+            return false;
     }
-    pushbool(R, result);
+}
+
+// The _LL opcodes only see longs, so the operands are used as they are and
+// popping needs no free_var
+static inline void run_binop_ll(Runtime* R, Operator op)
+{
+    Variant* lhs = &R->stack[R->stacksize - 2];
+    lhs->u.lint = binop_long(op, lhs->u.lint, R->stack[R->stacksize - 1].u.lint);
+    R->stacksize--;
+}
+
+static inline void run_compare_ll(Runtime* R, Operator op)
+{
+    Variant* lhs = &R->stack[R->stacksize - 2];
+    lhs->u.boolean = binop_bool(op, lhs->u.lint, R->stack[R->stacksize - 1].u.lint);
+    lhs->type = TYPE_BOOL;
+    R->stacksize--;
+}
+
+static inline bool run_jump_ll(Runtime* R, Operator op)
+{
+    R->stacksize -= 2;
+    return binop_bool(op, R->stack[R->stacksize].u.lint, R->stack[R->stacksize + 1].u.lint);
 }
 
 static void run_eq(Runtime* R)
@@ -289,6 +441,34 @@ static void run_eq(Runtime* R)
     pushbool(R, result);
 }
 
+// Pops the operands of a fused compare-and-branch and compares them
+static bool run_compare(Runtime* R, Operator op)
+{
+    bool result;
+    if (op == OP_JEQ || op == OP_JNE) {
+        result = compare_equal(*stackidx(R, -2), *stackidx(R, -1)) == (op == OP_JEQ);
+        popn(R, 2);
+        return result;
+    }
+
+    int64_t rhs = tolong(R, -1);
+    int64_t lhs = tolong(R, -2);
+    popn(R, 2);
+    switch (op) {
+        case OP_JLT:
+            return binop_bool(OP_LT, lhs, rhs);
+        case OP_JLE:
+            return binop_bool(OP_LTE, lhs, rhs);
+        case OP_JGT:
+            return binop_bool(OP_GT, lhs, rhs);
+        case OP_JGE:
+            return binop_bool(OP_GTE, lhs, rhs);
+        default:
+            assert(false);
+            return false;
+    }
+}
+
 static void run_notop(Runtime* R)
 {
     int64_t lint = tolong(R, -1);
@@ -296,18 +476,97 @@ static void run_notop(Runtime* R)
     pushlong(R, !lint);
 }
 
-static void run_assignmentexpr(Runtime* R, Function* fn, int flags)
+// Unary counterpart of fold_binop, for OP_NOT and OP_CAST to type
+bool fold_unop(Operator op, VARIANTTYPE type, Variant operand, Variant* result)
+{
+    switch (op) {
+        case OP_NOT:
+            result->type = TYPE_LONG;
+            result->u.lint = !vartolong(operand);
+            return true;
+        case OP_CAST:
+            *result = vartotype(operand, type);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void run_constdecl(Runtime* R)
 {
     Variant* val = top(R);
-    set_var(R, fn->strs[fetch16(R->ip)], *val, flags);
-    R->ip += 2;
+    set_var(R, fetch32(R->ip), *val, VAR_FLAG_CONST);
+    R->ip += 4;
     pop(R);
 }
 
-void run_function(Runtime* R, Function* fn)
+// Moves the top of the stack into a slot
+static void run_store_slot(Runtime* R)
+{
+    Variant* slot = &R->slots[fetch32(R->ip)];
+    R->ip += 4;
+    free_var(*slot);
+    *slot = *top(R);
+    R->stacksize--;
+}
+
+// Converts the slot to a long and adds n, like OP_ADD would
+void add_to_slot(Variant* slot, int64_t n)
+{
+    if (slot->type != TYPE_LONG) {
+        const int64_t lint = vartolong(*slot);
+        free_var(*slot);
+        slot->type = TYPE_LONG;
+        slot->u.lint = lint;
+    }
+    slot->u.lint += n;
+}
+
+// Appends value to the string in a slot, growing it in place
+void append_to_slot(Variant* slot, Variant value)
+{
+    if (slot->type != TYPE_STRING) {
+        char* str = vartostring(*slot);
+        free_var(*slot);
+        slot->type = TYPE_STRING;
+        slot->u.str = str;
+    }
+
+    const bool converted = value.type != TYPE_STRING;
+    char* rhs = converted ? vartostring(value) : value.u.str;
+    const size_t length = strlen(slot->u.str);
+    const size_t rhslength = strlen(rhs);
+    char* str = realloc(slot->u.str, length + rhslength + 1);
+    if (!str) {
+        die("Out of memory for string");
+    }
+    memcpy(str + length, rhs, rhslength + 1);
+    slot->u.str = str;
+
+    if (converted) {
+        free(rhs);
+    }
+}
+
+// Pops a value and appends it to the string in a slot
+static void run_append_slot(Runtime* R)
 {
+    Variant* slot = &R->slots[fetch32(R->ip)];
+    R->ip += 4;
+    append_to_slot(slot, *top(R));
+    pop(R);
+}
+
+// Returns whether fn finished with an explicit return
+bool run_function(Runtime* R, Function* fn)
+{
+    if (R->state->options.registers) {
+        return run_registers(R, fn);
+    }
+
     R->function = fn;
     R->ip = fn->code;
+    reserve_slots(R, fn->locals.size); // Streamed scripts add locals as they go
     while ((size_t)(R->ip - fn->code) < fn->codesize && !R->hasError) {
         Operator op = (Operator) *R->ip++;
         int64_t lint;
@@ -316,21 +575,22 @@ void run_function(Runtime* R, Function* fn)
             case OP_NOP:
                 break;
             case OP_RETURN:
-                return; // Finish executing Function
+                return true; // Finish executing Function
             case OP_CALL:
                 run_call(R);
                 break;
+            case OP_CALL_DIRECT:
+                run_call_direct(R);
+                break;
+            case OP_TAILCALL:
+                fn = run_tailcall(R);
+                break;
             case OP_ECHO:
                 run_echo(R);
                 break;
-            case OP_STR:
-                pushstr(R, fn->strs[fetch16(R->ip)]);
-                R->ip += 2;
-                break;
-            case OP_LONG:
-                lint = (int64_t) fetch64(R->ip);
-                R->ip += 8;
-                pushlong(R, lint);
+            case OP_CONST:
+                push(R, fn->consts.values[fetch32(R->ip)]);
+                R->ip += 4;
                 break;
             case OP_TRUE:
                 pushbool(R, 1);
@@ -342,25 +602,25 @@ void run_function(Runtime* R, Function* fn)
                 pushnull(R);
                 break;
             case OP_LTE:
-                run_binop_bool(R, TK_LTEQ);
+                run_binop_bool(R, OP_LTE);
                 break;
             case OP_GTE:
-                run_binop_bool(R, TK_GTEQ);
+                run_binop_bool(R, OP_GTE);
                 break;
             case OP_LT:
-                run_binop_bool(R, '<');
+                run_binop_bool(R, OP_LT);
                 break;
             case OP_GT:
-                run_binop_bool(R, '>');
+                run_binop_bool(R, OP_GT);
                 break;
             case OP_NOT:
                 run_notop(R);
                 break;
             case OP_AND:
-                run_binop_bool(R, TK_AND);
+                run_binop_bool(R, OP_AND);
                 break;
             case OP_OR:
-                run_binop_bool(R, TK_OR);
+                run_binop_bool(R, OP_OR);
                 break;
             case OP_EQ:
                 run_eq(R);
@@ -369,60 +629,115 @@ void run_function(Runtime* R, Function* fn)
                 run_stringaddexpr(R);
                 break;
             case OP_ADD:
-                run_binop_long(R, '+');
+                run_binop_long(R, OP_ADD);
                 break;
             case OP_SUB:
-                run_binop_long(R, '-');
+                run_binop_long(R, OP_SUB);
                 break;
             case OP_MUL:
-                run_binop_long(R, '*');
+                run_binop_long(R, OP_MUL);
                 break;
             case OP_DIV:
-                run_binop_long(R, '/');
+                run_binop_long(R, OP_DIV);
                 break;
             case OP_SHL:
-                run_binop_long(R, TK_SHL);
+                run_binop_long(R, OP_SHL);
                 break;
             case OP_SHR:
-                run_binop_long(R, TK_SHR);
+                run_binop_long(R, OP_SHR);
                 break;
-            case OP_ADD1:
-                lint = tolong(R, -1);
-                pop(R);
-                pushlong(R, lint + 1);
+            case OP_LOAD_SLOT:
+                push(R, R->slots[fetch32(R->ip)]);
+                R->ip += 4;
                 break;
-            case OP_SUB1:
-                lint = tolong(R, -1);
-                pop(R);
-                pushlong(R, lint - 1);
+            case OP_CLOOKUP:
+                push(R, lookupWithFlags(R, fetch32(R->ip), VAR_FLAG_CONST));
+                R->ip += 4;
                 break;
-            case OP_LOOKUP:
-                push(R, lookup(R, fn->strs[fetch16(R->ip)]));
-                R->ip += 2;
+            case OP_STORE_SLOT:
+                run_store_slot(R);
                 break;
-            case OP_CLOOKUP:
-                push(R, lookupWithFlags(R, fn->strs[fetch16(R->ip)], VAR_FLAG_CONST));
-                R->ip += 2;
+            case OP_INC_SLOT:
+                add_to_slot(&R->slots[fetch32(R->ip)], 1);
+                R->ip += 4;
                 break;
-            case OP_ASSIGN:
-                run_assignmentexpr(R, fn, 0);
+            case OP_DEC_SLOT:
+                add_to_slot(&R->slots[fetch32(R->ip)], -1);
+                R->ip += 4;
+                break;
+            case OP_ADD_SLOT:
+                add_to_slot(&R->slots[fetch32(R->ip)], fn->consts.values[fetch32(R->ip + 4)].u.lint);
+                R->ip += 8;
+                break;
+            case OP_APPEND_SLOT:
+                run_append_slot(R);
                 break;
             case OP_CONSTDECL:
-                run_assignmentexpr(R, fn, VAR_FLAG_CONST);
-                break;    
+                run_constdecl(R);
+                break;
             case OP_DUP:
                 push(R, *top(R));
                 break;
+            case OP_POP:
+                pop(R);
+                break;
             case OP_JMP:
                 R->ip = fn->code + fetch32(R->ip);
                 break;
             case OP_JMPZ:
-                if (tolong(R, -1) == 0) {
+                lint = tolong(R, -1);
+                pop(R);
+                if (lint == 0) {
                     R->ip = fn->code + fetch32(R->ip);
                 } else {
                     R->ip += 4; // jump over jmpaddr
                 }
                 break;
+            case OP_JLT:
+            case OP_JLE:
+            case OP_JGT:
+            case OP_JGE:
+            case OP_JEQ:
+            case OP_JNE:
+                if (run_compare(R, op)) {
+                    R->ip = fn->code + fetch32(R->ip);
+                } else {
+                    R->ip += 4;
+                }
+                break;
+            case OP_ADD_LL:
+                run_binop_ll(R, OP_ADD);
+                break;
+            case OP_SUB_LL:
+                run_binop_ll(R, OP_SUB);
+                break;
+            case OP_MUL_LL:
+                run_binop_ll(R, OP_MUL);
+                break;
+            case OP_LT_LL:
+                run_compare_ll(R, OP_LT);
+                break;
+            case OP_LTE_LL:
+                run_compare_ll(R, OP_LTE);
+                break;
+            case OP_GT_LL:
+                run_compare_ll(R, OP_GT);
+                break;
+            case OP_GTE_LL:
+                run_compare_ll(R, OP_GTE);
+                break;
+            case OP_JLT_LL:
+                R->ip = run_jump_ll(R, OP_LT) ? fn->code + fetch32(R->ip) : R->ip + 4;
+                break;
+            case OP_JLE_LL:
+                R->ip = run_jump_ll(R, OP_LTE) ? fn->code + fetch32(R->ip) : R->ip + 4;
+                break;
+            case OP_JGT_LL:
+                R->ip = run_jump_ll(R, OP_GT) ? fn->code + fetch32(R->ip) : R->ip + 4;
+                break;
+            case OP_JGE_LL:
+                R->ip = run_jump_ll(R, OP_GTE) ? fn->code + fetch32(R->ip) : R->ip + 4;
+                break;
             case OP_CAST:
                 var = vartotype(*stackidx(R, -1), (VARIANTTYPE) fetch8(R->ip++));
                 pop(R);
@@ -441,35 +756,124 @@ void run_function(Runtime* R, Function* fn)
     }
 
     R->function = NULL;
+    return false;
 }
 
 static void init_builtin_functions(State* S)
 {
     for (size_t i = 0; i < arrcount(std_functions); ++i) {
         CFunctionPair pair = std_functions[i];
-        addfunction(S, wrap_cfunction(pair.cfunction, strdup(pair.name)));
+        addfunction(S, wrap_cfunction(pair.cfunction, intern_cstr(pair.name)));
     }
 }
 
-void run_file(const char* filepath) {
-    FILE* handle = fopen(filepath, "r");
-    AST* ast = parse(handle);
-    // print_ast(ast,0);
-
-    Function* fn = create_function();
+// A State with an empty pseudomain at index 0 followed by the builtins
+static State* create_script_state(Options options)
+{
     State* S = create_state();
-    addfunction(S, wrap_function(fn, strdup("<pseudomain>")));
+    S->options = options;
+    addfunction(S, wrap_function(create_function(), intern_cstr("<pseudomain>")));
     init_builtin_functions(S);
-    compile(S, fn, ast);
+
+    return S;
+}
+
+// Returns NULL if the script does not compile
+static State* compile_file(const char* filepath, const Source* source, Options options)
+{
+    Program* program = parse_buffer(source->data, source->length);
+    if (!program) {
+        return NULL;
+    }
+    // print_ast(program, program->root, 0);
+
+    State* S = create_script_state(options);
+    compile(S, S->functions[0].u.function, program);
+    destroy_program(program);
+    if (!link_calls(S, filepath)) {
+        destroy_state(S);
+        return NULL;
+    }
+
+    return S;
+}
+
+// Setting PHPINTERP_CACHE to a directory keeps the compiled script there for
+// the next run, see cache.h
+void run_file(const char* filepath, Options options) {
+    Source* source = open_source(filepath);
+    if (!source) {
+        printf("Could not open input file: %s\n", filepath);
+        return;
+    }
+
+    const char* cachedir = getenv("PHPINTERP_CACHE");
+    State* S = NULL;
+    if (cachedir) {
+        S = create_script_state(options);
+        if (!load_cached(S, cachedir, filepath, source)) {
+            destroy_state(S); // Stale, damaged or missing entry
+            S = compile_file(filepath, source, options);
+            if (S) {
+                store_cached(S, cachedir, filepath, source);
+            }
+        }
+    } else {
+        S = compile_file(filepath, source, options);
+    }
+    close_source(source);
+    if (!S) {
+        return;
+    }
 
     Runtime* R = create_runtime(S);
     R->file = strdup(filepath);
-    // print_code(fn, "<pseudomain>");
-    run_function(R, fn);
+    // print_code(S->functions[0].u.function, "<pseudomain>");
+    run_function(R, S->functions[0].u.function);
+    destroy_state(S);
+    destroy_runtime(R);
+}
+
+// Reads the script from stream through a fixed window and runs every
+// top-level statement as soon as it is parsed, so memory does not grow with
+// the input. Once a statement calls a function that is not declared yet,
+// maybe further down, the rest of the input is compiled along with it and
+// runs as a whole, as for a file.
+void run_stream(FILE* stream, const char* name, Options options)
+{
+    Lexer* L = create_stream_lexer(stream);
+    Parser* P = L ? create_parser(L) : NULL;
+    if (!P) {
+        printf("Could not open input file: %s\n", name);
+        return;
+    }
+
+    State* S = create_script_state(options);
+    Function* fn = S->functions[0].u.function;
+
+    Runtime* R = create_runtime(S);
+    R->file = strdup(name);
+    const Program* program;
+    while ((program = parse_next_stmt(P))) {
+        clear_code(fn); // Executed statements are not needed anymore
+        compile(S, fn, program);
+        if (!link_calls(S, name)) {
+            break;
+        }
+        if (S->calllen) { // Left unlinked, also inside functions it may call
+            compile(S, fn, parse_remaining(P));
+            if (!link_calls(S, name)) {
+                break;
+            }
+        }
+        if (run_function(R, fn) || R->hasError) {
+            break;
+        }
+    }
     destroy_state(S);
     destroy_runtime(R);
 
-    destroy_ast(ast);
+    destroy_parser(P);
 }
 
 void print_stack(Runtime* R)
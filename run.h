@@ -3,16 +3,33 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "crossplatform/stdnoreturn.h"
 #include "stack.h"
+#include "compile.h"
 
 
 void runtimeerror(Runtime* R, char* fmt);
 void raise_fatal(Runtime* R, char*, ...);
-void run_file(const char*);
-void run_function(Runtime*, Function*);
+void run_file(const char*, Options options);
+void run_stream(FILE*, const char* name, Options options);
+bool run_function(Runtime*, Function*);
+Runtime* create_runtime(State* S);
+void destroy_runtime(Runtime* R);
+Runtime* create_callee_runtime(Runtime* R);
+void destroy_callee_runtime(Runtime* R, Runtime* newruntime);
+void reserve_slots(Runtime* R, size_t count);
 Variant cpy_var(Variant var);
 void free_var(Variant var);
+bool fold_binop(Operator op, Variant lhs, Variant rhs, Variant* result);
+bool fold_unop(Operator op, VARIANTTYPE type, Variant operand, Variant* result);
+
+// Operator semantics shared with the register backend
+bool compare_equal(Variant lhs, Variant rhs);
+int64_t binop_long(Operator op, int64_t lhs, int64_t rhs);
+bool binop_bool(Operator op, int64_t lhs, int64_t rhs);
+void add_to_slot(Variant* slot, int64_t n);
+void append_to_slot(Variant* slot, Variant value);
 
 void print_stack(Runtime*);
 
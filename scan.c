@@ -0,0 +1,65 @@
+#include <stdint.h>
+#include "scan.h"
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+static size_t scan_scalar(const char* buf, size_t pos, size_t len, char stop1,
+                          char stop2, size_t* newlines)
+{
+    for (; pos < len; ++pos) {
+        const char c = buf[pos];
+        if (c == stop1 || c == stop2) {
+            return pos;
+        }
+        if (c == '\n') {
+            (*newlines)++;
+        }
+    }
+
+    return len;
+}
+
+size_t scan_until(const char* buf, size_t len, char stop1, char stop2,
+                  size_t* newlines)
+{
+    size_t pos = 0;
+#if defined(__AVX2__)
+    const __m256i s1 = _mm256_set1_epi8(stop1);
+    const __m256i s2 = _mm256_set1_epi8(stop2);
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; pos + 32 <= len; pos += 32) {
+        const __m256i chunk = _mm256_loadu_si256((const __m256i*) (buf + pos));
+        const uint32_t stops = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(chunk, s1), _mm256_cmpeq_epi8(chunk, s2)));
+        const uint32_t lines = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl));
+        if (stops) {
+            const int idx = __builtin_ctz(stops);
+            *newlines += __builtin_popcount(lines & ((1u << idx) - 1));
+            return pos + idx;
+        }
+        *newlines += __builtin_popcount(lines);
+    }
+#elif defined(__SSE2__)
+    const __m128i s1 = _mm_set1_epi8(stop1);
+    const __m128i s2 = _mm_set1_epi8(stop2);
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; pos + 16 <= len; pos += 16) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*) (buf + pos));
+        const uint32_t stops = (uint32_t) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, s1), _mm_cmpeq_epi8(chunk, s2)));
+        const uint32_t lines = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        if (stops) {
+            const int idx = __builtin_ctz(stops);
+            *newlines += __builtin_popcount(lines & ((1u << idx) - 1));
+            return pos + idx;
+        }
+        *newlines += __builtin_popcount(lines);
+    }
+#endif
+
+    return scan_scalar(buf, pos, len, stop1, stop2, newlines);
+}
@@ -0,0 +1,13 @@
+#ifndef PHPINTERP_SCAN_H
+#define PHPINTERP_SCAN_H
+
+#include <stddef.h>
+
+// Returns the offset of the first byte in buf[0, len) equal to stop1 or
+// stop2, or len if there is none. The number of '\n' bytes skipped before
+// that offset is added to *newlines.
+// Uses AVX2 or SSE2 when the compiler targets them, bytewise otherwise.
+size_t scan_until(const char* buf, size_t len, char stop1, char stop2,
+                  size_t* newlines);
+
+#endif //PHPINTERP_SCAN_H
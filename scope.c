@@ -20,23 +20,31 @@ Scope* create_scope()
 void destroy_scope(Scope* scope)
 {
     for (size_t i = 0; i < scope->size; ++i) {
-        free(scope->vars[i].name);
         free_var(scope->vars[i].value);
     }
     free(scope->vars);
     free(scope);
 }
 
-Variant lookup(Runtime* R, char* str)
+// Empties scope, like a new one
+void clear_scope(Scope* scope)
 {
-    return lookupWithFlags(R, str, 0);
+    for (size_t i = 0; i < scope->size; ++i) {
+        free_var(scope->vars[i].value);
+    }
+    scope->size = 0;
+}
+
+Variant lookup(Runtime* R, symbol_t name)
+{
+    return lookupWithFlags(R, name, 0);
 }
 
-Variant lookupWithFlags(Runtime* R, char* str, int flags)
+Variant lookupWithFlags(Runtime* R, symbol_t name, int flags)
 {
     Variable* vars = R->scope->vars;
     for (size_t i = 0; i < R->scope->size; ++i) {
-        if (strcmp(str, vars[i].name) == 0 && (flags == vars[i].flags || vars[i].flags & flags)) {
+        if (name == vars[i].name && (flags == vars[i].flags || vars[i].flags & flags)) {
             return vars[i].value;
         }
     }
@@ -50,12 +58,12 @@ static void try_vars_resize(Scope* scope)
                sizeof(*scope->vars), die);
 }
 
-Variable* set_var(Runtime* R, char* str, Variant var, int flags)
+Variable* set_var(Runtime* R, symbol_t name, Variant var, int flags)
 {
     Variable* vars = R->scope->vars;
     // existing variable
     for (size_t i = 0; i < R->scope->size; ++i) {
-        if (strcmp(str, vars[i].name) == 0 && (flags == vars[i].flags || vars[i].flags & flags)) {
+        if (name == vars[i].name && (flags == vars[i].flags || vars[i].flags & flags)) {
             if (flags & VAR_FLAG_CONST) {
                 runtimeerror(R, "Cannot redeclare constant");
                 return NULL;
@@ -71,8 +79,9 @@ Variable* set_var(Runtime* R, char* str, Variant var, int flags)
     }
 
     try_vars_resize(R->scope);
+    vars = R->scope->vars;
     const size_t idx = R->scope->size++;
-    vars[idx].name = strdup(str);
+    vars[idx].name = name;
     vars[idx].value = cpy_var(var);
     vars[idx].flags = flags;
 
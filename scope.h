@@ -13,8 +13,9 @@ typedef struct Scope {
 
 Scope* create_scope();
 void destroy_scope(Scope*);
-Variant lookup(Runtime* R, char* str);
-Variant lookupWithFlags(Runtime* R, char* str, int flags);
-Variable* set_var(Runtime* R, char* str, Variant var, int flags);
+void clear_scope(Scope*);
+Variant lookup(Runtime* R, symbol_t name);
+Variant lookupWithFlags(Runtime* R, symbol_t name, int flags);
+Variable* set_var(Runtime* R, symbol_t name, Variant var, int flags);
 
 #endif //PHPINTERP_SCOPE_H
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "source.h"
+
+#ifndef _WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+static Source* create_source(const char* data, size_t length, bool mapped)
+{
+    Source* ret = malloc(sizeof(Source));
+    if (!ret) {
+        perror("malloc for source failed.");
+        return NULL;
+    }
+    ret->data = data;
+    ret->length = length;
+    ret->mapped = mapped;
+
+    return ret;
+}
+
+Source* read_source(FILE* file)
+{
+    size_t length = 0;
+    size_t capacity = 1 << 16;
+    char* data = malloc(capacity);
+    if (!data) {
+        perror("malloc for source failed.");
+        return NULL;
+    }
+
+    size_t n;
+    while ((n = fread(data + length, 1, capacity - length, file)) > 0) {
+        length += n;
+        if (length == capacity) {
+            capacity *= 2;
+            char* tmp = realloc(data, capacity);
+            if (!tmp) {
+                perror("resizing source failed.");
+                free(data);
+                return NULL;
+            }
+            data = tmp;
+        }
+    }
+
+    Source* ret = create_source(data, length, false);
+    if (!ret) {
+        free(data);
+    }
+
+    return ret;
+}
+
+Source* open_source(const char* path)
+{
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close(fd);
+            madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+            Source* ret = create_source(data, (size_t) st.st_size, true);
+            if (!ret) {
+                munmap(data, (size_t) st.st_size);
+            }
+            return ret;
+        }
+    }
+
+    FILE* file = fdopen(fd, "rb");
+    if (!file) {
+        close(fd);
+        return NULL;
+    }
+#else
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+#endif
+    Source* ret = read_source(file);
+    fclose(file);
+
+    return ret;
+}
+
+void close_source(Source* source)
+{
+#ifndef _WIN32
+    if (source->mapped) {
+        munmap((void*) source->data, source->length);
+        free(source);
+        return;
+    }
+#endif
+    free((void*) source->data);
+    free(source);
+}
+
+size_t read_available(FILE* file, char* buf, size_t len)
+{
+#ifndef _WIN32
+    ssize_t ret;
+    do {
+        ret = read(fileno(file), buf, len);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? 0 : (size_t) ret;
+#else
+    return fread(buf, 1, len, file);
+#endif
+}
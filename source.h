@@ -0,0 +1,24 @@
+#ifndef PHPINTERP_SOURCE_H
+#define PHPINTERP_SOURCE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// A complete script held in memory. Regular files are mmap'ed, everything
+// else (pipes, terminals) is read into a single heap block.
+typedef struct Source {
+    const char* data;
+    size_t length;
+    bool mapped;
+} Source;
+
+Source* open_source(const char* path);
+Source* read_source(FILE* file);
+void close_source(Source*);
+
+// Reads up to len bytes of whatever the stream has available, only blocking
+// until the first byte arrives. Returns 0 at the end of the stream.
+size_t read_available(FILE* file, char* buf, size_t len);
+
+#endif //PHPINTERP_SOURCE_H
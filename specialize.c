@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include "optimize.h"
+#include "op_util.h"
+
+// Forward dataflow over the basic blocks of a Function that tracks which
+// types each slot and stack entry may hold. Arithmetic and comparisons whose
+// operands can only be longs are then replaced by their _LL opcodes, which
+// have the same length and stack effect.
+
+typedef uint8_t TypeSet; // Bit per VARIANTTYPE
+_Static_assert(TYPE_MAX_VALUE <= 8, "TypeSet needs a bit per type");
+
+#define TS(type) ((TypeSet) (1u << (type)))
+#define TS_ANY ((TypeSet) ((1u << TYPE_MAX_VALUE) - 1))
+
+#define NO_BLOCK ((uint32_t) -1)
+
+typedef struct TypeState {
+    bool reached;
+    TypeSet* slots;
+    TypeSet* stack;
+    size_t depth;
+    size_t capacity;
+} TypeState;
+
+typedef struct Inference {
+    Function* fn;
+    uint32_t* blockat; // Block starting at a position, NO_BLOCK if none
+    size_t* starts;
+    TypeState* entries; // State on entry to each block
+    size_t blockcount;
+
+    uint32_t* worklist;
+    bool* queued;
+    size_t pending;
+
+    bool consistent; // Stack depths agree wherever paths meet
+} Inference;
+
+static void push_type(TypeState* st, TypeSet type)
+{
+    if (!try_resize(&st->capacity, st->depth, (void**)&st->stack, sizeof(*st->stack), NULL)) {
+        optimizer_oom();
+    }
+    st->stack[st->depth++] = type;
+}
+
+static void copy_state(const Function* fn, TypeState* dst, const TypeState* src)
+{
+    dst->reached = true;
+    memcpy(dst->slots, src->slots, fn->locals.size * sizeof(*dst->slots));
+    dst->depth = 0;
+    for (size_t i = 0; i < src->depth; ++i) {
+        push_type(dst, src->stack[i]);
+    }
+}
+
+// Returns whether the entry state of block grew
+static bool merge_state(Inference* I, uint32_t block, const TypeState* st)
+{
+    TypeState* entry = &I->entries[block];
+    if (!entry->reached) {
+        copy_state(I->fn, entry, st);
+        return true;
+    }
+    if (entry->depth != st->depth) {
+        I->consistent = false;
+        return false;
+    }
+
+    bool changed = false;
+    for (uint32_t i = 0; i < I->fn->locals.size; ++i) {
+        changed |= (entry->slots[i] | st->slots[i]) != entry->slots[i];
+        entry->slots[i] |= st->slots[i];
+    }
+    for (size_t i = 0; i < st->depth; ++i) {
+        changed |= (entry->stack[i] | st->stack[i]) != entry->stack[i];
+        entry->stack[i] |= st->stack[i];
+    }
+
+    return changed;
+}
+
+static void flow_to(Inference* I, size_t pos, const TypeState* st)
+{
+    const uint32_t block = pos < I->fn->codesize ? I->blockat[pos] : NO_BLOCK;
+    if (block != NO_BLOCK && merge_state(I, block, st) && !I->queued[block]) {
+        I->queued[block] = true;
+        I->worklist[I->pending++] = block;
+    }
+}
+
+// Type of the value the instruction at ip pushes
+static TypeSet pushed_type(const Function* fn, const codepoint_t* ip, const TypeState* st)
+{
+    switch ((Operator) *ip) {
+        case OP_CONST:
+            return TS(fn->consts.values[fetch32(ip + 1)].type);
+        case OP_NULL:
+            return TS(TYPE_NULL);
+        case OP_NOT:
+        case OP_SUB:
+        case OP_ADD:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_ADD_LL:
+        case OP_SUB_LL:
+        case OP_MUL_LL:
+        case OP_GETLINE:
+            return TS(TYPE_LONG);
+        case OP_CONCAT:
+            return TS(TYPE_STRING);
+        case OP_LOAD_SLOT:
+            return st->slots[fetch32(ip + 1)];
+        case OP_DUP:
+            return st->stack[st->depth - 1];
+        case OP_CAST:
+            return TS(fetch8(ip + 1));
+        default:
+            return op_flags((Operator) *ip) & OPF_BOOL ? TS(TYPE_BOOL) : TS_ANY;
+    }
+}
+
+static void transfer(const Function* fn, const codepoint_t* ip, TypeState* st)
+{
+    const TypeSet pushed = pushed_type(fn, ip, st);
+    switch ((Operator) *ip) {
+        case OP_STORE_SLOT:
+            st->slots[fetch32(ip + 1)] = st->stack[st->depth - 1];
+            break;
+        case OP_INC_SLOT:
+        case OP_DEC_SLOT:
+        case OP_ADD_SLOT:
+            st->slots[fetch32(ip + 1)] = TS(TYPE_LONG);
+            break;
+        case OP_APPEND_SLOT:
+            st->slots[fetch32(ip + 1)] = TS(TYPE_STRING);
+            break;
+        default:
+            break;
+    }
+
+    st->depth -= op_pops(ip);
+    if (op_pushes(ip)) {
+        push_type(st, pushed);
+    }
+}
+
+static Operator specialized(Operator op)
+{
+    switch (op) {
+        case OP_ADD: return OP_ADD_LL;
+        case OP_SUB: return OP_SUB_LL;
+        case OP_MUL: return OP_MUL_LL;
+        case OP_LT: return OP_LT_LL;
+        case OP_LTE: return OP_LTE_LL;
+        case OP_GT: return OP_GT_LL;
+        case OP_GTE: return OP_GTE_LL;
+        case OP_JLT: return OP_JLT_LL;
+        case OP_JLE: return OP_JLE_LL;
+        case OP_JGT: return OP_JGT_LL;
+        case OP_JGE: return OP_JGE_LL;
+        default: return OP_INVALID;
+    }
+}
+
+static void find_blocks(Inference* I)
+{
+    const Function* fn = I->fn;
+    bool* isstart = find_block_starts(fn);
+
+    I->blockat = malloc(fn->codesize * sizeof(*I->blockat) + 1);
+    I->starts = malloc(fn->codesize * sizeof(*I->starts) + 1);
+    if (!I->blockat || !I->starts) optimizer_oom();
+    I->blockcount = 0;
+    for (size_t pos = 0; pos < fn->codesize; ++pos) {
+        I->blockat[pos] = NO_BLOCK;
+    }
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if (isstart[pos]) {
+            I->blockat[pos] = (uint32_t) I->blockcount;
+            I->starts[I->blockcount++] = pos;
+        }
+    }
+    free(isstart);
+}
+
+// Runs block from its entry state. With rewrite set, operations whose
+// operands are proven longs are specialized on the way.
+static void run_block(Inference* I, uint32_t block, TypeState* st, bool rewrite)
+{
+    Function* fn = I->fn;
+    copy_state(fn, st, &I->entries[block]);
+    size_t pos = I->starts[block];
+    do {
+        codepoint_t* ip = fn->code + pos;
+        const Operator op = (Operator) *ip;
+        if (op_pops(ip) > st->depth || (op == OP_DUP && !st->depth)) { // Stack does not add up
+            I->consistent = false;
+            return;
+        }
+        if (rewrite && specialized(op) != OP_INVALID && st->depth >= 2
+            && st->stack[st->depth - 1] == TS(TYPE_LONG)
+            && st->stack[st->depth - 2] == TS(TYPE_LONG)) {
+            *ip = (codepoint_t) specialized(op);
+        }
+
+        transfer(fn, ip, st);
+        if (op_flags(op) & OPF_JUMP) {
+            flow_to(I, op_jump_target(ip), st);
+        }
+        if (op_flags(op) & OPF_TERMINATOR) {
+            return;
+        }
+        pos += op_len(op);
+    } while (pos < fn->codesize && I->blockat[pos] == NO_BLOCK);
+
+    flow_to(I, pos, st);
+}
+
+// Locals other than the parameters start out undefined in a fresh frame.
+// The pseudomain may be streamed, so its locals can hold anything left by
+// earlier statements.
+void specialize_types(Function* fn, bool fresh_frame)
+{
+    if (!fn->codesize) {
+        return;
+    }
+
+    Inference I = {fn, NULL, NULL, NULL, 0, NULL, NULL, 0, true};
+    find_blocks(&I);
+    I.entries = calloc(I.blockcount, sizeof(*I.entries));
+    I.worklist = malloc(I.blockcount * sizeof(*I.worklist));
+    I.queued = calloc(I.blockcount, sizeof(*I.queued));
+    TypeState st = {false, malloc(fn->locals.size * sizeof(TypeSet) + 1), NULL, 0, 0};
+    if (!I.entries || !I.worklist || !I.queued || !st.slots) optimizer_oom();
+    for (size_t i = 0; i < I.blockcount; ++i) {
+        I.entries[i].slots = malloc(fn->locals.size * sizeof(TypeSet) + 1);
+        if (!I.entries[i].slots) optimizer_oom();
+    }
+
+    for (uint32_t i = 0; i < fn->locals.size; ++i) {
+        st.slots[i] = fresh_frame && i >= fn->paramlen ? TS(TYPE_UNDEF) : TS_ANY;
+    }
+    flow_to(&I, 0, &st);
+    while (I.pending && I.consistent) {
+        const uint32_t block = I.worklist[--I.pending];
+        I.queued[block] = false;
+        run_block(&I, block, &st, false);
+    }
+
+    if (I.consistent) {
+        for (uint32_t block = 0; block < I.blockcount; ++block) {
+            if (I.entries[block].reached) {
+                run_block(&I, block, &st, true);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < I.blockcount; ++i) {
+        free(I.entries[i].slots);
+        free(I.entries[i].stack);
+    }
+    free(I.entries);
+    free(I.worklist);
+    free(I.queued);
+    free(I.blockat);
+    free(I.starts);
+    free(st.slots);
+    free(st.stack);
+}
@@ -0,0 +1,1401 @@
+#include <stdlib.h>
+#include <string.h>
+#include "optimize.h"
+#include "op_util.h"
+#include "array-util.h"
+#include "run.h"
+
+// Optimizing tier, enabled with -O. The bytecode of a Function is lowered to
+// a control flow graph in SSA form: every slot and stack entry refers to the
+// instruction or phi that defined its value, so a load is a copy of what was
+// stored. Sparse conditional constant propagation and global value numbering
+// run on that graph, and their results are written back as edits to the
+// bytecode, which keep the line of the code they replace. Dead stores are
+// then removed from the new code with a liveness pass over the slots.
+
+#define NO_VALUE ((uint32_t) -1)
+#define NO_BLOCK ((uint32_t) -1)
+#define MAX_DSE_ROUNDS 8
+
+typedef enum ValueKind {
+    V_ENTRY, // Slot on entry to the function
+    V_PHI,
+    V_OP, // Pushed or written to a slot by an instruction
+} ValueKind;
+
+typedef enum LatticeKind {
+    L_TOP, // Not reached yet
+    L_CONST,
+    L_BOTTOM, // Varies
+} LatticeKind;
+
+typedef struct SsaValue {
+    ValueKind kind;
+    uint32_t block;
+    size_t pos; // Defining instruction of a V_OP
+    uint32_t args[2]; // Operands of a V_OP taking at most two
+    uint8_t argc;
+    uint32_t* phiargs; // One per predecessor of block
+    uint32_t index; // Slot or stack entry a phi merges, slots first
+    uint32_t replacement; // Value a trivial phi stands for
+    uint32_t number; // Global value number
+    uint32_t home; // Slot the value was first stored to
+    LatticeKind lattice;
+    Variant constant; // Owned if lattice is L_CONST
+} SsaValue;
+
+typedef struct Block {
+    size_t start;
+    size_t end;
+    uint32_t succs[2];
+    uint8_t succlen;
+    uint32_t* preds; // The function entry is an extra predecessor of block 0
+    bool* live; // Per predecessor, whether the edge may be taken
+    size_t predlen;
+    size_t predcapacity;
+
+    uint32_t rpo; // NO_BLOCK if unreachable
+    uint32_t idom;
+    bool executable;
+
+    uint32_t phis; // First of the phis at the start
+    uint32_t phicount;
+    uint32_t branchargs[2]; // Operands of a conditional jump at the end
+    uint32_t* entry; // Values of the slots followed by the stack
+    uint32_t* exit;
+    size_t entrydepth;
+    size_t exitdepth;
+} Block;
+
+typedef struct Ssa {
+    Function* fn;
+
+    Block* blocks;
+    size_t blockcount;
+    uint32_t* blockat; // Block starting at a position, NO_BLOCK if none
+    uint32_t* order; // Reverse postorder of the reachable blocks
+    size_t ordercount;
+
+    SsaValue* values;
+    size_t valuelen;
+    size_t valuecapacity;
+    uint32_t* pushed; // Per position, value the instruction pushes
+    uint32_t* defined; // Per position, value the instruction leaves in its slot
+
+    bool consistent; // Stack depths agree wherever paths meet
+} Ssa;
+
+// Replaces [start, end) by code, or inserts it before start if both are
+// equal. A jump in code still targets an old position.
+typedef struct Edit {
+    size_t start;
+    size_t end;
+    codepoint_t code[10];
+    uint8_t len;
+    size_t line; // Old position whose line code gets
+    uint32_t temp; // Value that has to be kept in a temporary, or NO_VALUE
+} Edit;
+
+typedef struct Edits {
+    Edit* edits;
+    size_t len;
+    size_t capacity;
+} Edits;
+
+// Code that computes a stack entry, as long as it is contiguous and can be
+// dropped without changing what the program does
+typedef struct Expr {
+    size_t start;
+    size_t end;
+    bool removable;
+} Expr;
+
+typedef struct Tracker {
+    Expr* stack;
+    size_t depth;
+    size_t capacity;
+} Tracker;
+
+// Whether the instruction at ip has no effect besides its result
+static bool is_pure(const codepoint_t* ip)
+{
+    switch ((Operator) *ip) {
+        case OP_CONST:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NULL:
+        case OP_LOAD_SLOT:
+        case OP_CLOOKUP:
+        case OP_GETLINE:
+        case OP_LTE:
+        case OP_GTE:
+        case OP_LT:
+        case OP_GT:
+        case OP_NOT:
+        case OP_AND:
+        case OP_OR:
+        case OP_EQ:
+        case OP_CONCAT:
+        case OP_SUB:
+        case OP_ADD:
+        case OP_MUL:
+        case OP_SHL:
+        case OP_SHR:
+            return true; // Not OP_DIV, which fails on zero
+        case OP_CAST:
+            return fetch8(ip + 1) != TYPE_FUNCTION && fetch8(ip + 1) != TYPE_CFUNCTION;
+        default:
+            return false;
+    }
+}
+
+// Whether equal operands give an equal result, so it can be numbered
+static bool is_numbered(const codepoint_t* ip)
+{
+    return is_pure(ip) && *ip != OP_LOAD_SLOT && *ip != OP_CLOOKUP && *ip != OP_GETLINE;
+}
+
+static bool is_literal(Operator op)
+{
+    return op == OP_CONST || op == OP_TRUE || op == OP_FALSE || op == OP_NULL;
+}
+
+// Operator compared by a conditional jump
+static Operator compared(Operator op)
+{
+    switch (op) {
+        case OP_JLT: return OP_LT;
+        case OP_JLE: return OP_LTE;
+        case OP_JGT: return OP_GT;
+        case OP_JGE: return OP_GTE;
+        case OP_JEQ:
+        case OP_JNE: return OP_EQ;
+        default: return OP_INVALID;
+    }
+}
+
+static void push_expr(Tracker* T, Expr expr)
+{
+    if (!try_resize(&T->capacity, T->depth, (void**)&T->stack, sizeof(*T->stack), NULL)) {
+        optimizer_oom();
+    }
+    T->stack[T->depth++] = expr;
+}
+
+// Pops the operands of the instruction at pos and pushes its result. Returns
+// the expression of the instruction including its operands, which is
+// removable if they are and removable is set.
+static Expr track(Tracker* T, const codepoint_t* ip, size_t pos, bool removable)
+{
+    const unsigned pops = op_pops(ip);
+    Expr ret = {pos, pos + op_len((Operator) *ip), removable && (Operator) *ip != OP_DUP};
+    if (pops > T->depth) {
+        T->depth = 0;
+        ret.removable = false;
+        return ret;
+    }
+    const Expr* operands = T->stack + T->depth - pops;
+    if (pops) {
+        ret.start = operands[0].start;
+    }
+    for (unsigned i = 0; i < pops; ++i) {
+        // Adjacent, or code with side effects such as OP_INC_SLOT lies between
+        const size_t end = i + 1 < pops ? operands[i + 1].start : pos;
+        ret.removable &= operands[i].removable && operands[i].end == end;
+    }
+    if (!ret.removable) {
+        ret.start = pos;
+    }
+
+    T->depth -= pops;
+    if ((Operator) *ip == OP_DUP && T->depth) {
+        T->stack[T->depth - 1].removable = false;
+    }
+    if (op_pushes(ip)) {
+        push_expr(T, ret);
+    }
+    return ret;
+}
+
+static void reset_tracker(Tracker* T)
+{
+    for (size_t i = 0; i < T->depth; ++i) {
+        T->stack[i].removable = false; // Computed in another block
+    }
+}
+
+static void add_edit(Edits* E, Edit edit)
+{
+    if (!try_resize(&E->capacity, E->len, (void**)&E->edits, sizeof(*E->edits), NULL)) {
+        optimizer_oom();
+    }
+    E->edits[E->len++] = edit;
+}
+
+static Edit slot_edit(size_t start, size_t end, size_t line, Operator op, uint32_t slot)
+{
+    Edit ret = {start, end, {(codepoint_t) op}, (uint8_t) op_len(op), line, NO_VALUE};
+    *(uint32_t*)(ret.code + 1) = htole32(slot);
+    return ret;
+}
+
+// Rebuilds the code of fn with the sorted, disjoint edits applied
+static void apply_edits(State* S, Function* fn, const Edits* E)
+{
+    size_t capacity = fn->codesize + 1;
+    for (size_t i = 0; i < E->len; ++i) {
+        capacity += E->edits[i].len;
+    }
+    uint32_t* map = malloc((fn->codesize + 1) * sizeof(*map)); // Old to new position
+    codepoint_t* code = calloc(capacity, sizeof(*code));
+    if (!map || !code) optimizer_oom();
+    LineTable lines;
+    init_linetable(&lines);
+
+    size_t size = 0;
+    size_t next = 0;
+    size_t pos = 0;
+    while (pos < fn->codesize) {
+        if (next < E->len && E->edits[next].start == pos) {
+            const Edit* edit = &E->edits[next++];
+            for (size_t at = 0; at < edit->len; at += op_len((Operator) edit->code[at])) {
+                set_line(&lines, size + at, find_line(&fn->lines, edit->line));
+            }
+            memcpy(code + size, edit->code, edit->len);
+            size += edit->len;
+            if (edit->end > pos) {
+                map[pos] = (uint32_t) (size - edit->len);
+                pos = edit->end;
+            }
+            continue; // Jumps to an insertion skip it
+        }
+        const size_t len = op_len((Operator) fn->code[pos]);
+        map[pos] = (uint32_t) size;
+        memcpy(code + size, fn->code + pos, len);
+        set_line(&lines, size, find_line(&fn->lines, pos));
+        size += len;
+        pos += len;
+    }
+    map[fn->codesize] = (uint32_t) size;
+
+    for (pos = 0; pos < size; pos += op_len((Operator) code[pos])) {
+        if (op_flags((Operator) code[pos]) & OPF_JUMP) {
+            op_set_jump_target(code + pos, map[op_jump_target(code + pos)]);
+        }
+    }
+    for (size_t i = 0; i < S->calllen; ++i) {
+        if (S->calls[i].fn == fn) {
+            S->calls[i].position = map[S->calls[i].position];
+        }
+    }
+
+    free(fn->code);
+    free_linetable(&fn->lines);
+    fn->code = code;
+    fn->lines = lines;
+    fn->codesize = size;
+    fn->codecapacity = capacity;
+    free(map);
+}
+
+static int compare_edits(const void* lhs, const void* rhs)
+{
+    const Edit* l = lhs;
+    const Edit* r = rhs;
+    if (l->start != r->start) {
+        return l->start < r->start ? -1 : 1;
+    }
+    if ((l->start == l->end) != (r->start == r->end)) {
+        return l->start == l->end ? -1 : 1; // Insertions go before the code at start
+    }
+    return l->end > r->end ? -1 : l->end < r->end; // Outermost first
+}
+
+// Sorts the edits and drops those inside a bigger one
+static void keep_outermost(Edits* E)
+{
+    qsort(E->edits, E->len, sizeof(*E->edits), compare_edits);
+    size_t kept = 0;
+    size_t end = 0;
+    for (size_t i = 0; i < E->len; ++i) {
+        if (kept && E->edits[i].start < end) {
+            continue;
+        }
+        E->edits[kept++] = E->edits[i];
+        end = E->edits[i].end;
+    }
+    E->len = kept;
+}
+
+static void add_pred(Block* block, uint32_t pred)
+{
+    if (!try_resize(&block->predcapacity, block->predlen, (void**)&block->preds,
+                    sizeof(*block->preds), NULL)) {
+        optimizer_oom();
+    }
+    block->preds[block->predlen++] = pred;
+}
+
+static void find_blocks(Ssa* G)
+{
+    const Function* fn = G->fn;
+    bool* isstart = find_block_starts(fn);
+    G->blockat = malloc((fn->codesize + 1) * sizeof(*G->blockat));
+    if (!G->blockat) optimizer_oom();
+
+    size_t count = 0;
+    for (size_t pos = 0; pos <= fn->codesize; ++pos) {
+        G->blockat[pos] = NO_BLOCK;
+    }
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if (isstart[pos]) {
+            G->blockat[pos] = (uint32_t) count++;
+        }
+    }
+    G->blocks = calloc(count, sizeof(*G->blocks));
+    if (!G->blocks) optimizer_oom();
+    G->blockcount = count;
+
+    for (size_t pos = 0; pos < fn->codesize; pos += op_len((Operator) fn->code[pos])) {
+        if (G->blockat[pos] == NO_BLOCK) {
+            continue;
+        }
+        Block* block = &G->blocks[G->blockat[pos]];
+        block->start = pos;
+        size_t last = pos;
+        block->end = pos + op_len((Operator) fn->code[pos]);
+        while (block->end < fn->codesize && G->blockat[block->end] == NO_BLOCK) {
+            last = block->end;
+            block->end += op_len((Operator) fn->code[block->end]);
+        }
+        const unsigned flags = op_flags((Operator) fn->code[last]);
+        if (!(flags & OPF_TERMINATOR) && block->end < fn->codesize) {
+            block->succs[block->succlen++] = G->blockat[block->end];
+        }
+        if (flags & OPF_JUMP && op_jump_target(fn->code + last) < fn->codesize) {
+            block->succs[block->succlen++] = G->blockat[op_jump_target(fn->code + last)];
+        }
+    }
+    free(isstart);
+}
+
+// Numbers the blocks reachable from the entry in reverse postorder and links
+// them to their reachable predecessors
+static void order_blocks(Ssa* G)
+{
+    uint32_t* stack = malloc((G->blockcount + 1) * sizeof(*stack));
+    uint8_t* visited = calloc(G->blockcount, sizeof(*visited)); // Successors done
+    bool* seen = calloc(G->blockcount, sizeof(*seen));
+    G->order = malloc((G->blockcount + 1) * sizeof(*G->order));
+    if (!stack || !visited || !seen || !G->order) optimizer_oom();
+
+    size_t post = G->blockcount;
+    size_t depth = 0;
+    stack[depth++] = 0;
+    seen[0] = true;
+    while (depth) {
+        const uint32_t b = stack[depth - 1];
+        Block* block = &G->blocks[b];
+        if (visited[b] < block->succlen) {
+            const uint32_t succ = block->succs[visited[b]++];
+            if (!seen[succ]) {
+                seen[succ] = true;
+                stack[depth++] = succ;
+            }
+            continue;
+        }
+        G->order[--post] = b;
+        --depth;
+    }
+    G->ordercount = G->blockcount - post;
+    memmove(G->order, G->order + post, G->ordercount * sizeof(*G->order));
+
+    for (uint32_t b = 0; b < G->blockcount; ++b) {
+        G->blocks[b].rpo = NO_BLOCK;
+    }
+    for (uint32_t i = 0; i < G->ordercount; ++i) {
+        G->blocks[G->order[i]].rpo = i;
+    }
+    for (uint32_t i = 0; i < G->ordercount; ++i) {
+        const Block* block = &G->blocks[G->order[i]];
+        for (uint8_t s = 0; s < block->succlen; ++s) {
+            add_pred(&G->blocks[block->succs[s]], G->order[i]);
+        }
+    }
+    for (uint32_t i = 0; i < G->ordercount; ++i) {
+        Block* block = &G->blocks[G->order[i]];
+        block->live = calloc(block->predlen + 1, sizeof(*block->live));
+        if (!block->live) optimizer_oom();
+    }
+
+    free(stack);
+    free(visited);
+    free(seen);
+}
+
+// Cooper, Harvey and Kennedy's iteration over the reverse postorder
+static void find_dominators(Ssa* G)
+{
+    for (uint32_t i = 0; i < G->ordercount; ++i) {
+        G->blocks[G->order[i]].idom = NO_BLOCK;
+    }
+    G->blocks[0].idom = 0;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = 1; i < G->ordercount; ++i) {
+            Block* block = &G->blocks[G->order[i]];
+            uint32_t idom = NO_BLOCK;
+            for (size_t p = 0; p < block->predlen; ++p) {
+                uint32_t pred = block->preds[p];
+                if (G->blocks[pred].idom == NO_BLOCK) {
+                    continue;
+                }
+                uint32_t other = idom;
+                while (other != NO_BLOCK && pred != other) {
+                    while (G->blocks[pred].rpo > G->blocks[other].rpo) {
+                        pred = G->blocks[pred].idom;
+                    }
+                    while (G->blocks[other].rpo > G->blocks[pred].rpo) {
+                        other = G->blocks[other].idom;
+                    }
+                }
+                idom = pred;
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool dominates(const Ssa* G, uint32_t a, uint32_t b)
+{
+    while (b != a && b != 0) {
+        b = G->blocks[b].idom;
+    }
+    return b == a;
+}
+
+static uint32_t new_value(Ssa* G, ValueKind kind, uint32_t block, size_t pos)
+{
+    if (!try_resize(&G->valuecapacity, G->valuelen, (void**)&G->values, sizeof(*G->values), NULL)) {
+        optimizer_oom();
+    }
+    G->values[G->valuelen] = (SsaValue) {kind, block, pos, {NO_VALUE, NO_VALUE}, 0, NULL, NO_SLOT,
+                                         NO_VALUE, (uint32_t) G->valuelen, NO_SLOT, L_TOP, {0}};
+    return (uint32_t) G->valuelen++;
+}
+
+// Value v stands for once trivial phis are gone
+static uint32_t resolve(Ssa* G, uint32_t v)
+{
+    while (G->values[v].replacement != NO_VALUE) {
+        v = G->values[v].replacement;
+    }
+    return v;
+}
+
+static uint32_t* new_state(const Ssa* G, size_t depth)
+{
+    uint32_t* ret = malloc((G->fn->locals.size + depth + 1) * sizeof(*ret));
+    if (!ret) optimizer_oom();
+    return ret;
+}
+
+// Walks the instructions of block from its entry state to its exit state
+static void lower_block(Ssa* G, uint32_t b)
+{
+    const Function* fn = G->fn;
+    Block* block = &G->blocks[b];
+    const uint32_t slots = fn->locals.size;
+    size_t capacity = slots + block->entrydepth + 1;
+    uint32_t* state = malloc(capacity * sizeof(*state));
+    if (!state) optimizer_oom();
+    memcpy(state, block->entry, (slots + block->entrydepth) * sizeof(*state));
+    size_t depth = block->entrydepth;
+    uint32_t* stack = state + slots;
+
+    for (size_t pos = block->start; pos < block->end; pos += op_len((Operator) fn->code[pos])) {
+        const codepoint_t* ip = fn->code + pos;
+        const Operator op = (Operator) *ip;
+        const unsigned pops = op_pops(ip);
+        if (pops > depth || (op == OP_DUP && !depth)) {
+            G->consistent = false;
+            break;
+        }
+        if (slots + depth + 1 >= capacity) {
+            capacity *= 2;
+            state = realloc(state, capacity * sizeof(*state));
+            if (!state) optimizer_oom();
+            stack = state + slots;
+        }
+
+        uint32_t v;
+        const uint32_t slot = op_slot(ip);
+        switch (op) {
+            case OP_LOAD_SLOT:
+                G->pushed[pos] = stack[depth++] = state[slot];
+                break;
+            case OP_STORE_SLOT:
+                G->defined[pos] = state[slot] = stack[--depth];
+                if (G->values[state[slot]].home == NO_SLOT) {
+                    G->values[state[slot]].home = slot;
+                }
+                break;
+            case OP_DUP:
+                G->pushed[pos] = stack[depth] = stack[depth - 1];
+                ++depth;
+                break;
+            case OP_INC_SLOT:
+            case OP_DEC_SLOT:
+            case OP_ADD_SLOT:
+            case OP_APPEND_SLOT:
+                v = new_value(G, V_OP, b, pos);
+                G->values[v].args[G->values[v].argc++] = state[slot];
+                if (op == OP_APPEND_SLOT) {
+                    G->values[v].args[G->values[v].argc++] = stack[--depth];
+                }
+                G->values[v].home = slot;
+                G->defined[pos] = state[slot] = v;
+                break;
+            default:
+                depth -= pops;
+                if (op_flags(op) & OPF_BRANCH) {
+                    memcpy(block->branchargs, stack + depth, pops * sizeof(*stack));
+                }
+                if (op_pushes(ip)) {
+                    v = new_value(G, V_OP, b, pos);
+                    for (unsigned i = 0; i < pops && pops <= 2; ++i) {
+                        G->values[v].args[G->values[v].argc++] = stack[depth + i];
+                    }
+                    G->pushed[pos] = stack[depth++] = v;
+                }
+                break;
+        }
+    }
+
+    block->exit = state;
+    block->exitdepth = depth;
+}
+
+// Phis merge every slot and stack entry where control flow meets. Blocks
+// with a single predecessor continue from its exit state.
+static void lower(Ssa* G)
+{
+    const uint32_t slots = G->fn->locals.size;
+    uint32_t* entry = new_state(G, 0);
+    for (uint32_t i = 0; i < slots; ++i) {
+        entry[i] = new_value(G, V_ENTRY, 0, 0);
+        G->values[entry[i]].home = i;
+        G->values[entry[i]].lattice = L_BOTTOM;
+    }
+
+    for (uint32_t i = 0; i < G->ordercount && G->consistent; ++i) {
+        const uint32_t b = G->order[i];
+        Block* block = &G->blocks[b];
+        const Block* first = block->predlen ? &G->blocks[block->preds[0]] : NULL;
+        for (size_t p = 0; p < block->predlen && b; ++p) { // Earliest lowered predecessor
+            if (G->blocks[block->preds[p]].rpo < first->rpo) {
+                first = &G->blocks[block->preds[p]];
+            }
+        }
+        if (b == 0 && !block->predlen) {
+            block->entry = entry;
+            entry = NULL;
+        } else if (b != 0 && block->predlen == 1) {
+            block->entrydepth = first->exitdepth;
+            block->entry = new_state(G, block->entrydepth);
+            memcpy(block->entry, first->exit, (slots + block->entrydepth) * sizeof(uint32_t));
+        } else {
+            block->entrydepth = b == 0 ? 0 : first->exitdepth;
+            block->entry = new_state(G, block->entrydepth);
+            block->phis = (uint32_t) G->valuelen;
+            block->phicount = slots + (uint32_t) block->entrydepth;
+            for (uint32_t k = 0; k < block->phicount; ++k) {
+                const uint32_t phi = new_value(G, V_PHI, b, block->start);
+                G->values[phi].index = k;
+                G->values[phi].home = k < slots ? k : NO_SLOT;
+                G->values[phi].phiargs = malloc((block->predlen + 1) * sizeof(uint32_t));
+                if (!G->values[phi].phiargs) optimizer_oom();
+                block->entry[k] = phi;
+            }
+        }
+        lower_block(G, b);
+    }
+
+    for (size_t v = 0; v < G->valuelen && G->consistent; ++v) {
+        SsaValue* phi = &G->values[v];
+        if (phi->kind != V_PHI) {
+            continue;
+        }
+        const Block* block = &G->blocks[phi->block];
+        for (size_t p = 0; p < block->predlen; ++p) {
+            const Block* pred = &G->blocks[block->preds[p]];
+            if (pred->exitdepth != block->entrydepth) {
+                G->consistent = false;
+                break;
+            }
+            phi->phiargs[p] = pred->exit[phi->index];
+        }
+        if (phi->block == 0) {
+            phi->phiargs[block->predlen] = entry[phi->index];
+        }
+    }
+    free(entry);
+}
+
+static size_t phi_argc(const Ssa* G, const SsaValue* phi)
+{
+    return G->blocks[phi->block].predlen + (phi->block == 0);
+}
+
+// A phi whose arguments are all one value or itself is that value
+static void remove_trivial_phis(Ssa* G)
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t v = 0; v < G->valuelen; ++v) {
+            SsaValue* phi = &G->values[v];
+            if (phi->kind != V_PHI || phi->replacement != NO_VALUE) {
+                continue;
+            }
+            uint32_t same = NO_VALUE;
+            bool trivial = true;
+            for (size_t i = 0; i < phi_argc(G, phi) && trivial; ++i) {
+                const uint32_t arg = resolve(G, phi->phiargs[i]);
+                if (arg != v && arg != same) {
+                    trivial = same == NO_VALUE;
+                    same = arg;
+                }
+            }
+            if (trivial && same != NO_VALUE) {
+                phi->replacement = same;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool same_constant(Variant lhs, Variant rhs)
+{
+    if (lhs.type != rhs.type) {
+        return false;
+    }
+    switch (lhs.type) {
+        case TYPE_LONG:
+            return lhs.u.lint == rhs.u.lint;
+        case TYPE_BOOL:
+            return lhs.u.boolean == rhs.u.boolean;
+        case TYPE_NULL:
+            return true;
+        case TYPE_STRING:
+            return strcmp(lhs.u.str, rhs.u.str) == 0;
+        default:
+            return false;
+    }
+}
+
+// Lowers the lattice of value to kind, taking ownership of constant if kind
+// is L_CONST. Returns whether it changed.
+static bool lower_lattice(SsaValue* value, LatticeKind kind, Variant constant)
+{
+    const bool owned = kind == L_CONST;
+    const bool literal = constant.type != TYPE_UNDEF && constant.type < TYPE_CFUNCTION;
+    bool changed = false;
+    if (owned && value->lattice == L_TOP && literal) {
+        value->lattice = L_CONST;
+        value->constant = constant;
+        return true;
+    } else if (owned && value->lattice == L_CONST && same_constant(value->constant, constant)) {
+        // Agrees with what is known
+    } else if (kind != L_TOP && value->lattice != L_BOTTOM) {
+        if (value->lattice == L_CONST) {
+            free_var(value->constant);
+        }
+        value->lattice = L_BOTTOM;
+        changed = true;
+    }
+
+    if (owned) {
+        free_var(constant);
+    }
+    return changed;
+}
+
+static LatticeKind operand_lattice(Ssa* G, uint32_t v, Variant* constant)
+{
+    const SsaValue* value = &G->values[resolve(G, v)];
+    *constant = value->constant;
+    return value->lattice;
+}
+
+// Bottom if any of the operands is, otherwise top if any of them is
+static LatticeKind operands_lattice(Ssa* G, const uint32_t* operands, uint8_t count,
+                                    Variant* constants)
+{
+    LatticeKind ret = L_CONST;
+    for (uint8_t i = 0; i < count; ++i) {
+        const LatticeKind kind = operand_lattice(G, operands[i], &constants[i]);
+        if (kind == L_BOTTOM || (kind == L_TOP && ret == L_CONST)) {
+            ret = kind;
+        }
+    }
+    return ret;
+}
+
+static bool evaluate_op(Ssa* G, uint32_t v)
+{
+    SsaValue* value = &G->values[v];
+    const codepoint_t* ip = G->fn->code + value->pos;
+    Variant args[2];
+    const LatticeKind kind = operands_lattice(G, value->args, value->argc, args);
+    Variant result = {.type = TYPE_UNDEF};
+    if (kind != L_CONST) {
+        return kind == L_BOTTOM && lower_lattice(value, L_BOTTOM, result);
+    }
+
+    bool folded = true;
+    switch ((Operator) *ip) {
+        case OP_CONST:
+            result = cpy_var(G->fn->consts.values[fetch32(ip + 1)]);
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            result = (Variant) {.type = TYPE_BOOL, .u.boolean = *ip == OP_TRUE};
+            break;
+        case OP_NULL:
+            result.type = TYPE_NULL;
+            break;
+        case OP_NOT:
+            folded = fold_unop(OP_NOT, TYPE_UNDEF, args[0], &result);
+            break;
+        case OP_CAST:
+            folded = is_pure(ip) && fold_unop(OP_CAST, (VARIANTTYPE) fetch8(ip + 1), args[0], &result);
+            break;
+        case OP_INC_SLOT:
+        case OP_DEC_SLOT:
+        case OP_ADD_SLOT:
+            result.type = TYPE_LONG;
+            result.u.lint = vartolong(args[0]) + (*ip == OP_INC_SLOT ? 1 : *ip == OP_DEC_SLOT ? -1
+                                                 : G->fn->consts.values[fetch32(ip + 5)].u.lint);
+            break;
+        case OP_APPEND_SLOT:
+            folded = fold_binop(OP_CONCAT, args[0], args[1], &result);
+            break;
+        default:
+            folded = value->argc == 2 && (is_pure(ip) || *ip == OP_DIV)
+                     && fold_binop((Operator) *ip, args[0], args[1], &result);
+            break;
+    }
+
+    return lower_lattice(value, folded ? L_CONST : L_BOTTOM, result);
+}
+
+static bool evaluate_phi(Ssa* G, uint32_t v)
+{
+    SsaValue* phi = &G->values[v];
+    const Block* block = &G->blocks[phi->block];
+    bool changed = false;
+    for (size_t i = 0; i < phi_argc(G, phi); ++i) {
+        Variant constant;
+        const LatticeKind kind = operand_lattice(G, phi->phiargs[i], &constant);
+        if ((i == block->predlen || block->live[i]) && kind != L_TOP) {
+            changed |= lower_lattice(phi, kind, kind == L_CONST ? cpy_var(constant) : constant);
+        }
+    }
+    return changed;
+}
+
+static bool mark_edge(Ssa* G, uint32_t from, uint32_t to)
+{
+    Block* block = &G->blocks[to];
+    bool changed = !block->executable;
+    block->executable = true;
+    for (size_t p = 0; p < block->predlen; ++p) {
+        if (block->preds[p] == from && !block->live[p]) {
+            block->live[p] = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Whether the conditional jump at ip that ends block always or never jumps,
+// which is stored to taken
+static bool decided_branch(Ssa* G, const Block* block, const codepoint_t* ip, bool* taken)
+{
+    Variant operands[2], result;
+    if (operands_lattice(G, block->branchargs, (uint8_t) op_pops(ip), operands) != L_CONST) {
+        return false;
+    }
+    if (*ip == OP_JMPZ) {
+        *taken = vartolong(operands[0]) == 0;
+        return true;
+    }
+    if (!fold_binop(compared((Operator) *ip), operands[0], operands[1], &result)) {
+        return false;
+    }
+    *taken = result.u.boolean == (*ip != OP_JNE);
+    return true;
+}
+
+// Marks the successors of block that its last instruction may go to
+static bool follow_branch(Ssa* G, uint32_t b, size_t last)
+{
+    const Block* block = &G->blocks[b];
+    const codepoint_t* ip = G->fn->code + last;
+    const Operator op = (Operator) *ip;
+    if (!(op_flags(op) & OPF_BRANCH) || block->succlen < 2) {
+        bool changed = false;
+        for (uint8_t s = 0; s < block->succlen; ++s) {
+            changed |= mark_edge(G, b, block->succs[s]);
+        }
+        return changed;
+    }
+
+    Variant operands[2];
+    bool taken;
+    if (operands_lattice(G, block->branchargs, (uint8_t) op_pops(ip), operands) == L_TOP) {
+        return false;
+    } else if (decided_branch(G, block, ip, &taken)) {
+        return mark_edge(G, b, block->succs[taken]);
+    }
+    return mark_edge(G, b, block->succs[0]) | mark_edge(G, b, block->succs[1]);
+}
+
+// Value the instruction at pos creates, NO_VALUE if none
+static uint32_t created_at(const Ssa* G, size_t pos)
+{
+    const uint32_t candidates[2] = {G->pushed[pos], G->defined[pos]};
+    for (int i = 0; i < 2; ++i) {
+        const uint32_t v = candidates[i];
+        if (v != NO_VALUE && G->values[v].kind == V_OP && G->values[v].pos == pos) {
+            return v;
+        }
+    }
+    return NO_VALUE;
+}
+
+// Evaluates the executable blocks until neither a value nor an edge changes.
+// Lattices only go down, so this ends after a few passes.
+static void propagate_constants(Ssa* G)
+{
+    G->blocks[0].executable = true;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = 0; i < G->ordercount; ++i) {
+            const uint32_t b = G->order[i];
+            const Block* block = &G->blocks[b];
+            if (!block->executable) {
+                continue;
+            }
+            for (uint32_t k = 0; k < block->phicount; ++k) {
+                changed |= evaluate_phi(G, block->phis + k);
+            }
+            size_t last = block->start;
+            for (size_t pos = block->start; pos < block->end; pos += op_len((Operator) G->fn->code[pos])) {
+                const uint32_t v = created_at(G, pos);
+                if (v != NO_VALUE) {
+                    changed |= evaluate_op(G, v);
+                }
+                last = pos;
+            }
+            changed |= follow_branch(G, b, last);
+        }
+    }
+}
+
+static uint32_t hash_operation(const codepoint_t* ip, uint32_t immediate, const uint32_t* numbers)
+{
+    uint32_t ret = 2166136261u;
+    const uint32_t parts[4] = {*ip, immediate, numbers[0], numbers[1]};
+    for (int i = 0; i < 4; ++i) {
+        ret = (ret ^ parts[i]) * 16777619u;
+    }
+    return ret;
+}
+
+static uint32_t immediate_of(const codepoint_t* ip)
+{
+    switch ((Operator) *ip) {
+        case OP_CONST:
+            return fetch32(ip + 1);
+        case OP_CAST:
+            return fetch8(ip + 1);
+        default:
+            return 0;
+    }
+}
+
+// Values computed by the same operation on the same numbers get the number
+// of the first of them that dominates them
+static void number_values(Ssa* G)
+{
+    uint32_t bucketcount = 16;
+    while (bucketcount < 2 * G->valuelen) {
+        bucketcount *= 2;
+    }
+    uint32_t* buckets = malloc(bucketcount * sizeof(*buckets));
+    uint32_t* next = malloc((G->valuelen + 1) * sizeof(*next));
+    uint32_t* hashes = malloc((G->valuelen + 1) * sizeof(*hashes));
+    if (!buckets || !next || !hashes) optimizer_oom();
+    for (uint32_t i = 0; i < bucketcount; ++i) {
+        buckets[i] = NO_VALUE;
+    }
+
+    for (uint32_t i = 0; i < G->ordercount; ++i) {
+        const uint32_t b = G->order[i];
+        const Block* block = &G->blocks[b];
+        if (!block->executable) {
+            continue;
+        }
+        for (size_t pos = block->start; pos < block->end; pos += op_len((Operator) G->fn->code[pos])) {
+            const codepoint_t* ip = G->fn->code + pos;
+            const uint32_t v = created_at(G, pos);
+            if (v == NO_VALUE || !is_numbered(ip)
+                || (G->values[v].lattice == L_CONST && !is_literal((Operator) *ip))) {
+                continue;
+            }
+            SsaValue* value = &G->values[v];
+            uint32_t numbers[2] = {NO_VALUE, NO_VALUE};
+            for (uint8_t k = 0; k < value->argc; ++k) {
+                numbers[k] = G->values[resolve(G, value->args[k])].number;
+            }
+            if ((*ip == OP_ADD || *ip == OP_MUL) && numbers[0] > numbers[1]) {
+                const uint32_t tmp = numbers[0];
+                numbers[0] = numbers[1];
+                numbers[1] = tmp;
+            }
+            const uint32_t immediate = immediate_of(ip);
+            hashes[v] = hash_operation(ip, immediate, numbers);
+
+            const uint32_t bucket = hashes[v] & (bucketcount - 1);
+            for (uint32_t w = buckets[bucket]; w != NO_VALUE; w = next[w]) {
+                const SsaValue* other = &G->values[w];
+                const codepoint_t* otherip = G->fn->code + other->pos;
+                uint32_t othernumbers[2] = {NO_VALUE, NO_VALUE};
+                for (uint8_t k = 0; k < other->argc; ++k) {
+                    othernumbers[k] = G->values[resolve(G, other->args[k])].number;
+                }
+                if (*otherip == OP_ADD || *otherip == OP_MUL) {
+                    if (othernumbers[0] > othernumbers[1]) {
+                        const uint32_t tmp = othernumbers[0];
+                        othernumbers[0] = othernumbers[1];
+                        othernumbers[1] = tmp;
+                    }
+                }
+                if (hashes[w] == hashes[v] && *otherip == *ip && immediate_of(otherip) == immediate
+                    && othernumbers[0] == numbers[0] && othernumbers[1] == numbers[1]
+                    && dominates(G, other->block, b)) {
+                    value->number = other->number;
+                    break;
+                }
+            }
+            if (value->number == v) {
+                next[v] = buckets[bucket];
+                buckets[bucket] = v;
+            }
+        }
+    }
+
+    free(buckets);
+    free(next);
+    free(hashes);
+}
+
+static size_t count_instructions(const Function* fn, size_t start, size_t end)
+{
+    size_t ret = 0;
+    for (size_t pos = start; pos < end; pos += op_len((Operator) fn->code[pos])) {
+        ++ret;
+    }
+    return ret;
+}
+
+// Edit that pushes constant instead of [start, end). Returns false for
+// constants without a literal.
+static bool literal_edit(Function* fn, size_t start, size_t end, size_t line, Variant constant,
+                         Edit* edit)
+{
+    switch (constant.type) {
+        case TYPE_LONG:
+        case TYPE_STRING:
+            *edit = slot_edit(start, end, line, OP_CONST, add_const(&fn->consts, cpy_var(constant)));
+            return true;
+        case TYPE_BOOL:
+        case TYPE_NULL:
+            *edit = (Edit) {start, end, {constant.type == TYPE_NULL ? OP_NULL
+                                         : constant.u.boolean ? OP_TRUE : OP_FALSE},
+                            1, line, NO_VALUE};
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Slot that holds v according to slots, NO_SLOT if none
+static uint32_t holding_slot(const Ssa* G, const uint32_t* slots, uint32_t v)
+{
+    const uint32_t home = G->values[v].home;
+    if (home != NO_SLOT && slots[home] == v) {
+        return home;
+    }
+    for (uint32_t i = 0; i < G->fn->locals.size; ++i) {
+        if (slots[i] == v) {
+            return i;
+        }
+    }
+    return NO_SLOT;
+}
+
+// Edits for the instruction at pos, whose expression is expr
+static void edit_instruction(Ssa* G, const Block* block, const uint32_t* slots, size_t pos,
+                             Expr expr, Edits* E, SsaStats* stats)
+{
+    Function* fn = G->fn;
+    const codepoint_t* ip = fn->code + pos;
+    const Operator op = (Operator) *ip;
+    const size_t end = pos + op_len(op);
+    Edit edit;
+    bool taken;
+    if (!expr.removable) {
+        return;
+    }
+
+    if (op_flags(op) & OPF_BRANCH) {
+        if (decided_branch(G, block, ip, &taken)) {
+            edit = slot_edit(expr.start, end, pos, OP_JMP, op_jump_target(ip));
+            edit.len = taken ? edit.len : 0;
+            add_edit(E, edit);
+            stats->folded++;
+        }
+        return;
+    }
+    if (G->pushed[pos] == NO_VALUE) {
+        return;
+    }
+
+    const uint32_t v = resolve(G, G->pushed[pos]);
+    const SsaValue* value = &G->values[v];
+    const uint32_t slot = value->number != v ? holding_slot(G, slots, value->number) : NO_SLOT;
+    if (value->lattice == L_CONST) {
+        if (!is_literal(op) && literal_edit(fn, expr.start, end, pos, value->constant, &edit)) {
+            add_edit(E, edit);
+            stats->folded++;
+        }
+    } else if (value->number != v && expr.start < pos) {
+        const size_t length = count_instructions(fn, expr.start, end);
+        if (slot != NO_SLOT) {
+            add_edit(E, slot_edit(expr.start, end, pos, OP_LOAD_SLOT, slot));
+            stats->reused++;
+        } else if (length > 3) { // Pays for OP_DUP and OP_STORE_SLOT of the temporary
+            edit = slot_edit(expr.start, end, pos, OP_LOAD_SLOT, NO_SLOT);
+            edit.temp = value->number;
+            add_edit(E, edit);
+        }
+    } else if (op == OP_LOAD_SLOT && value->home != NO_SLOT && value->home != op_slot(ip)
+               && slots[value->home] == v) {
+        add_edit(E, slot_edit(pos, end, pos, OP_LOAD_SLOT, value->home));
+        stats->copies++;
+    }
+}
+
+// Gives every value that an edit loads from a temporary its slot, stored
+// right after the value is computed. Edits whose value is not computed
+// anymore are dropped.
+static void add_temporaries(Ssa* G, Edits* E, SsaStats* stats)
+{
+    Function* fn = G->fn;
+    const size_t count = E->len;
+    uint32_t* temps = NULL; // Value, slot pairs
+    size_t templen = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i) {
+        Edit edit = E->edits[i];
+        if (edit.temp == NO_VALUE) {
+            E->edits[kept++] = edit;
+            continue;
+        }
+        const SsaValue* value = &G->values[edit.temp];
+        const size_t after = value->pos + op_len((Operator) fn->code[value->pos]);
+        bool computed = after < fn->codesize;
+        for (size_t k = 0; k < count && computed; ++k) {
+            computed = E->edits[k].start >= after || E->edits[k].end <= after
+                       || E->edits[k].start == E->edits[k].end;
+        }
+        if (!computed) {
+            continue;
+        }
+
+        uint32_t slot = NO_SLOT;
+        for (size_t k = 0; k < templen; ++k) {
+            slot = temps[2 * k] == edit.temp ? temps[2 * k + 1] : slot;
+        }
+        if (slot == NO_SLOT) {
+            slot = add_temp_slot(fn);
+            temps = realloc(temps, 2 * (templen + 1) * sizeof(*temps));
+            if (!temps) optimizer_oom();
+            temps[2 * templen] = edit.temp;
+            temps[2 * templen++ + 1] = slot;
+        }
+        *(uint32_t*)(edit.code + 1) = htole32(slot);
+        E->edits[kept++] = edit;
+        stats->reused++;
+    }
+    E->len = kept;
+
+    for (size_t k = 0; k < templen; ++k) {
+        const SsaValue* value = &G->values[temps[2 * k]];
+        const size_t after = value->pos + op_len((Operator) fn->code[value->pos]);
+        Edit store = slot_edit(after, after, value->pos, OP_STORE_SLOT, temps[2 * k + 1]);
+        memmove(store.code + 1, store.code, store.len);
+        store.code[0] = OP_DUP;
+        store.len++;
+        add_edit(E, store);
+    }
+    free(temps);
+}
+
+static void rewrite(State* S, Ssa* G, SsaStats* stats)
+{
+    Function* fn = G->fn;
+    Edits E = {NULL, 0, 0};
+    Tracker T = {NULL, 0, 0};
+    uint32_t* slots = malloc((fn->locals.size + 1) * sizeof(*slots));
+    if (!slots) optimizer_oom();
+
+    for (uint32_t i = 0; i < G->ordercount; ++i) {
+        const Block* block = &G->blocks[G->order[i]];
+        if (!block->executable) {
+            continue;
+        }
+        for (uint32_t k = 0; k < fn->locals.size; ++k) {
+            slots[k] = resolve(G, block->entry[k]);
+        }
+        T.depth = 0;
+        for (size_t k = 0; k < block->entrydepth; ++k) {
+            push_expr(&T, (Expr) {block->start, block->start, false});
+        }
+
+        for (size_t pos = block->start; pos < block->end; pos += op_len((Operator) fn->code[pos])) {
+            const codepoint_t* ip = fn->code + pos;
+            const uint32_t v = G->pushed[pos] != NO_VALUE ? resolve(G, G->pushed[pos]) : NO_VALUE;
+            const bool removable = is_pure(ip) || op_flags((Operator) *ip) & OPF_BRANCH
+                                   || (v != NO_VALUE && G->values[v].lattice == L_CONST);
+            const Expr expr = track(&T, ip, pos, removable);
+            edit_instruction(G, block, slots, pos, expr, &E, stats);
+            if (G->defined[pos] != NO_VALUE) {
+                slots[op_slot(ip)] = resolve(G, G->defined[pos]);
+            }
+        }
+    }
+
+    keep_outermost(&E);
+    add_temporaries(G, &E, stats);
+    keep_outermost(&E);
+    if (E.len) {
+        apply_edits(S, fn, &E);
+    }
+    free(E.edits);
+    free(T.stack);
+    free(slots);
+}
+
+// Whether control leaves the function after the block
+static bool exits(const Function* fn, const Block* block, size_t last)
+{
+    const Operator op = (Operator) fn->code[last];
+    return op == OP_RETURN || (!(op_flags(op) & OPF_TERMINATOR) && block->end >= fn->codesize)
+           || (op_flags(op) & OPF_JUMP && op_jump_target(fn->code + last) >= fn->codesize);
+}
+
+static size_t last_instruction(const Function* fn, const Block* block)
+{
+    size_t last = block->start;
+    for (size_t pos = block->start; pos < block->end; pos += op_len((Operator) fn->code[pos])) {
+        last = pos;
+    }
+    return last;
+}
+
+// Runs block backwards from the slots live at its end, marking the writes
+// nobody reads in dead if it is set
+static void live_slots(const Function* fn, const Block* block, bool* live, bool* dead)
+{
+    size_t* positions = malloc((block->end - block->start) * sizeof(*positions));
+    if (!positions) optimizer_oom();
+    size_t count = 0;
+    for (size_t pos = block->start; pos < block->end; pos += op_len((Operator) fn->code[pos])) {
+        positions[count++] = pos;
+    }
+    while (count--) {
+        const codepoint_t* ip = fn->code + positions[count];
+        const uint32_t slot = op_slot(ip);
+        if (slot == NO_SLOT) {
+            continue;
+        }
+        switch ((Operator) *ip) {
+            case OP_LOAD_SLOT:
+                live[slot] = true;
+                break;
+            case OP_STORE_SLOT:
+                if (dead) {
+                    dead[positions[count]] = !live[slot];
+                }
+                live[slot] = false;
+                break;
+            default: // Read and write the slot
+                if (dead) {
+                    dead[positions[count]] = !live[slot];
+                }
+                live[slot] |= !dead || !dead[positions[count]];
+                break;
+        }
+    }
+    free(positions);
+}
+
+// One round of removing writes to slots that are not read afterwards. The
+// slots of the pseudomain outlive it, in a fresh frame they die on return.
+static size_t remove_dead_stores(State* S, Function* fn, bool fresh_frame)
+{
+    Ssa G = {0};
+    G.fn = fn;
+    find_blocks(&G);
+    const uint32_t slots = fn->locals.size;
+    bool* livein = calloc(G.blockcount * slots + 1, sizeof(*livein));
+    bool* live = malloc(slots + 1);
+    bool* dead = calloc(fn->codesize + 1, sizeof(*dead));
+    if (!livein || !live || !dead) optimizer_oom();
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = G.blockcount; b-- > 0;) {
+            const Block* block = &G.blocks[b];
+            memset(live, exits(fn, block, last_instruction(fn, block)) && !fresh_frame, slots);
+            for (uint8_t s = 0; s < block->succlen; ++s) {
+                for (uint32_t k = 0; k < slots; ++k) {
+                    live[k] |= livein[block->succs[s] * slots + k];
+                }
+            }
+            live_slots(fn, block, live, NULL);
+            if (memcmp(live, livein + b * slots, slots) != 0) {
+                memcpy(livein + b * slots, live, slots);
+                changed = true;
+            }
+        }
+    }
+
+    Edits E = {NULL, 0, 0};
+    Tracker T = {NULL, 0, 0};
+    for (size_t b = 0; b < G.blockcount; ++b) {
+        const Block* block = &G.blocks[b];
+        memset(live, exits(fn, block, last_instruction(fn, block)) && !fresh_frame, slots);
+        for (uint8_t s = 0; s < block->succlen; ++s) {
+            for (uint32_t k = 0; k < slots; ++k) {
+                live[k] |= livein[block->succs[s] * slots + k];
+            }
+        }
+        live_slots(fn, block, live, dead);
+
+        reset_tracker(&T);
+        for (size_t pos = block->start; pos < block->end; pos += op_len((Operator) fn->code[pos])) {
+            const codepoint_t* ip = fn->code + pos;
+            const size_t end = pos + op_len((Operator) *ip);
+            const Expr expr = track(&T, ip, pos, is_pure(ip) || dead[pos]);
+            if (!dead[pos]) {
+                continue;
+            }
+            if (expr.removable) {
+                add_edit(&E, (Edit) {expr.start, end, {0}, 0, pos, NO_VALUE});
+            } else {
+                add_edit(&E, (Edit) {pos, end, {OP_POP}, 1, pos, NO_VALUE});
+            }
+        }
+    }
+
+    keep_outermost(&E);
+    const size_t ret = E.len;
+    if (E.len) {
+        apply_edits(S, fn, &E);
+    }
+    free(E.edits);
+    free(T.stack);
+    free(livein);
+    free(live);
+    free(dead);
+    for (size_t b = 0; b < G.blockcount; ++b) {
+        free(G.blocks[b].preds);
+    }
+    free(G.blocks);
+    free(G.blockat);
+    return ret;
+}
+
+static void free_ssa(Ssa* G)
+{
+    for (size_t v = 0; v < G->valuelen; ++v) {
+        if (G->values[v].lattice == L_CONST) {
+            free_var(G->values[v].constant);
+        }
+        free(G->values[v].phiargs);
+    }
+    for (size_t b = 0; b < G->blockcount; ++b) {
+        free(G->blocks[b].preds);
+        free(G->blocks[b].live);
+        free(G->blocks[b].entry);
+        free(G->blocks[b].exit);
+    }
+    free(G->values);
+    free(G->blocks);
+    free(G->blockat);
+    free(G->order);
+    free(G->pushed);
+    free(G->defined);
+}
+
+// Locals other than the parameters are dead when a fresh frame returns
+SsaStats optimize_ssa(State* S, Function* fn, bool fresh_frame)
+{
+    SsaStats stats = {0, 0, 0, 0};
+    if (!fn->codesize) {
+        return stats;
+    }
+
+    Ssa G = {0};
+    G.fn = fn;
+    G.consistent = true;
+    G.pushed = malloc((fn->codesize + 1) * sizeof(*G.pushed));
+    G.defined = malloc((fn->codesize + 1) * sizeof(*G.defined));
+    if (!G.pushed || !G.defined) optimizer_oom();
+    for (size_t pos = 0; pos <= fn->codesize; ++pos) {
+        G.pushed[pos] = G.defined[pos] = NO_VALUE;
+    }
+
+    find_blocks(&G);
+    order_blocks(&G);
+    find_dominators(&G);
+    lower(&G);
+    if (G.consistent) {
+        remove_trivial_phis(&G);
+        propagate_constants(&G);
+        number_values(&G);
+        rewrite(S, &G, &stats);
+    }
+    free_ssa(&G);
+
+    for (int round = 0; round < MAX_DSE_ROUNDS; ++round) {
+        const size_t removed = remove_dead_stores(S, fn, fresh_frame);
+        if (!removed) {
+            break;
+        }
+        stats.stores += removed;
+    }
+    return stats;
+}
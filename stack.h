@@ -8,6 +8,7 @@
 #include "crossplatform/stdnoreturn.h"
 #include "enum-util.h"
 #include "array-util.h"
+#include "symbol.h"
 
 #define ENUM_VARIANTTYPE(ELEMENT)   \
     ELEMENT(TYPE_UNDEF, =0)         \
@@ -43,7 +44,7 @@ typedef struct Variant {
 
 static const int VAR_FLAG_CONST = 1 << 1;
 typedef struct Variable {
-    char* name;
+    symbol_t name;
     Variant value;
     int flags;
 } Variable;
@@ -53,9 +54,12 @@ typedef struct Runtime {
     size_t stacksize;
     size_t stackcapacity;
     Function* function;
-    codepoint_t* ip;
+    codepoint_t* ip; // NULL while running register code
+    size_t pc; // Next register instruction, see run_registers
     Variant* stack;
-    Scope* scope;
+    Variant* slots; // Locals of the running Function
+    size_t slotcount;
+    Scope* scope; // Constants
     State* state; // non-owning ptr
     bool hasError;
 
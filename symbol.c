@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "crossplatform/stdnoreturn.h"
+#include "symbol.h"
+
+typedef struct Symbol {
+    char* name;
+    size_t length;
+    uint32_t hash;
+} Symbol;
+
+typedef struct SymbolTable {
+    Symbol* symbols;
+    size_t size;
+    size_t capacity;
+
+    symbol_t* buckets; // Open addressing, NO_SYMBOL marks an empty bucket
+    size_t bucketcount;
+} SymbolTable;
+
+static SymbolTable table = {NULL, 0, 0, NULL, 0};
+
+static uint32_t hash_str(const char* str, size_t length)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char) str[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static _Noreturn void symbols_oom(void)
+{
+    puts("Out of memory while interning symbols");
+    abort();
+}
+
+static void insert_bucket(symbol_t sym)
+{
+    size_t mask = table.bucketcount - 1;
+    size_t idx = table.symbols[sym].hash & mask;
+    while (table.buckets[idx] != NO_SYMBOL) {
+        idx = (idx + 1) & mask;
+    }
+    table.buckets[idx] = sym;
+}
+
+static void grow_buckets(void)
+{
+    size_t count = table.bucketcount ? table.bucketcount * 2 : 64;
+    symbol_t* buckets = malloc(count * sizeof(*buckets));
+    if (!buckets) symbols_oom();
+    for (size_t i = 0; i < count; ++i) {
+        buckets[i] = NO_SYMBOL;
+    }
+
+    free(table.buckets);
+    table.buckets = buckets;
+    table.bucketcount = count;
+    for (size_t i = 0; i < table.size; ++i) {
+        insert_bucket((symbol_t) i);
+    }
+}
+
+symbol_t intern(const char* str, size_t length)
+{
+    const uint32_t hash = hash_str(str, length);
+    if (table.bucketcount) {
+        size_t mask = table.bucketcount - 1;
+        for (size_t idx = hash & mask; table.buckets[idx] != NO_SYMBOL;
+             idx = (idx + 1) & mask) {
+            Symbol* candidate = &table.symbols[table.buckets[idx]];
+            if (candidate->hash == hash && candidate->length == length &&
+                memcmp(candidate->name, str, length) == 0) {
+                return table.buckets[idx];
+            }
+        }
+    }
+
+    if (table.size + 1 >= NO_SYMBOL) symbols_oom();
+    if (table.size == table.capacity) {
+        table.capacity = table.capacity ? table.capacity * 2 : 64;
+        Symbol* tmp = realloc(table.symbols, table.capacity * sizeof(*tmp));
+        if (!tmp) symbols_oom();
+        table.symbols = tmp;
+    }
+
+    Symbol* sym = &table.symbols[table.size];
+    sym->name = malloc(length + 1);
+    if (!sym->name) symbols_oom();
+    memcpy(sym->name, str, length);
+    sym->name[length] = '\0';
+    sym->length = length;
+    sym->hash = hash;
+
+    const symbol_t ret = (symbol_t) table.size++;
+    if (table.size * 2 > table.bucketcount) {
+        grow_buckets(); // Reinserts the new symbol as well
+    } else {
+        insert_bucket(ret);
+    }
+
+    return ret;
+}
+
+const char* symbol_name(symbol_t sym)
+{
+    assert(sym < table.size);
+    return table.symbols[sym].name;
+}
+
+size_t symbol_count(void)
+{
+    return table.size;
+}
+
+void free_symbols(void)
+{
+    for (size_t i = 0; i < table.size; ++i) {
+        free(table.symbols[i].name);
+    }
+    free(table.symbols);
+    free(table.buckets);
+    table.symbols = NULL;
+    table.buckets = NULL;
+    table.size = table.capacity = table.bucketcount = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef PHPINTERP_SYMBOL_H
+#define PHPINTERP_SYMBOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Process-wide table of interned identifiers. Every distinct name gets a
+// dense id once, afterwards names are compared by id only.
+typedef uint32_t symbol_t;
+
+#define NO_SYMBOL ((symbol_t) -1)
+
+symbol_t intern(const char* str, size_t length);
+const char* symbol_name(symbol_t);
+size_t symbol_count(void);
+void free_symbols(void);
+
+static inline symbol_t intern_cstr(const char* str)
+{
+    return intern(str, strlen(str));
+}
+
+#endif //PHPINTERP_SYMBOL_H
@@ -0,0 +1,12 @@
+<?php
+
+// Assignments as expressions are not supported yet, but they still have to
+// compile while the function is never called
+function unused() {
+    echo $x = 4;
+    $a = $b = 3;
+    return $a + 1;
+}
+
+$n = 2;
+echo $n + 3 . "\n";
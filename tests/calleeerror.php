@@ -0,0 +1,9 @@
+<?php
+
+function h($x) {
+    return missing($x);
+}
+
+echo "before\n";
+echo h(1);
+echo "after\n";
@@ -0,0 +1,33 @@
+<?php
+function check($a, $b) {
+    $r = "";
+    if ($a < $b) { $r = $r . "<"; }
+    if ($a <= $b) { $r = $r . "<="; }
+    if ($a > $b) { $r = $r . ">"; }
+    if ($a >= $b) { $r = $r . ">="; }
+    if ($a == $b) { $r = $r . "=="; }
+    if (!($a == $b)) { $r = $r . "!="; }
+    if (!($a < $b)) { $r = $r . "!<"; }
+    return $r;
+}
+
+echo check(1, 2) . "\n";
+echo check(2, 2) . "\n";
+echo check(3, 2) . "\n";
+echo check("10", 10) . "\n";
+echo check("abc", "abc") . "\n";
+echo check(true, 1) . "\n";
+echo check(null, 0) . "\n";
+
+$n = 0;
+while ($n * $n <= 50) {
+    $n++;
+}
+echo $n . "\n";
+for ($i = 10; $i > 0; $i = $i - 4) {
+    echo $i . " ";
+}
+echo "\n";
+if (!(2 < 1)) {
+    echo "folded\n";
+}
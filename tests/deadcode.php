@@ -0,0 +1,45 @@
+<?php
+
+const DEBUG = false;
+
+function sign($n) {
+    if ($n < 0) {
+        return "negative";
+    } else {
+        return "non-negative";
+    }
+    echo "never printed\n";
+}
+
+function early() {
+    return 1;
+    echo "never printed\n";
+    return 2;
+}
+
+function loop() {
+    $i = 0;
+    while (true) {
+        $i++;
+        if ($i > 3) {
+            return $i;
+        }
+    }
+}
+
+echo sign(0 - 5) . "\n";
+echo sign(5) . "\n";
+echo early() . "\n";
+echo loop() . "\n";
+
+if (DEBUG) {
+    echo "debug\n";
+} else {
+    echo "release\n";
+}
+if (true) {
+    echo "taken\n";
+}
+if (false) {
+    echo "not taken\n";
+}
@@ -0,0 +1,48 @@
+<?php
+const DAY = 60 * 60 * 24;
+const GREETING = "Hallo" . " " . "Welt";
+const LIMIT = 1 << 4;
+
+function week() {
+    const DAYS = 7;
+    return DAYS * 24;
+}
+
+echo DAY . "\n";
+echo GREETING . "\n";
+echo LIMIT - 2 * 3 + 10 / 5 . "\n";
+echo 2 + 3 . "4" . "\n";
+echo (7 - 10) * 2 . "\n";
+echo (256 >> 3) . "\n";
+echo week() . "\n";
+if (1 < 2) {
+    echo "less\n";
+}
+if (5 <= 4) {
+    echo "wrong\n";
+} else {
+    echo "greater\n";
+}
+if ("10" == 10) {
+    echo "equal\n";
+}
+if (true && 1 >= 1) {
+    echo "and\n";
+}
+if (false || 0 > 1) {
+    echo "wrong\n";
+}
+if (!false) {
+    echo "not\n";
+}
+$i = 0;
+while ($i < LIMIT / 4) {
+    echo GREETING . " " . $i . "\n";
+    $i++;
+}
+if ("12" == 12) {
+    echo "mixed\n";
+}
+if (3 == "x3") {
+    echo "wrong\n";
+}
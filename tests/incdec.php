@@ -0,0 +1,47 @@
+<?php
+$i = 5;
+$i++;
+++$i;
+echo $i . "\n";
+$i--;
+--$i;
+--$i;
+echo $i . "\n";
+echo $i++ . " " . $i . "\n";
+echo ++$i . " " . $i . "\n";
+echo $i-- . " " . $i . "\n";
+echo --$i . " " . $i . "\n";
+
+$n = "7";
+$n++;
+echo $n . "\n";
+
+$x = 10;
+$x = $x + 5;
+$x = $x - 3;
+$x = $x + 2 * 4;
+$x = $x - 1;
+echo $x . "\n";
+
+$s = "a";
+$s = $s . "b";
+$s = $s . $x . "-" . 1;
+$s = $s . $s;
+echo $s . "\n";
+
+$t = 3;
+$t = $t . "x";
+echo $t . "\n";
+
+$sum = 0;
+$str = "";
+for ($k = 0; $k < 5; $k++) {
+    $sum = $sum + 2;
+    $str = $str . $k;
+}
+echo $sum . " " . $str . "\n";
+$k = 10;
+while ($k > 0) {
+    $k--;
+}
+echo $k . "\n";
@@ -0,0 +1,43 @@
+<?php
+
+function idxToDay($i) {
+    if ($i == 0) return "Mon";
+    if ($i == 1) return "Tue";
+    if ($i == 2) return "Wed";
+    if ($i == 3) return "Thu";
+    if ($i == 4) return "Fri";
+    if ($i == 5) return "Sat";
+    return "Sun";
+}
+
+function twice($n) {
+    $d = $n * 2;
+    return $d;
+}
+
+function where() {
+    return __LINE__;
+}
+
+function countdown($n) {
+    if ($n < 1) {
+        return 0;
+    }
+    return $n + countdown($n - 1);
+}
+
+function week() {
+    $s = "";
+    for ($i = 0; $i < 7; $i++) {
+        $s = $s . idxToDay($i) . " ";
+    }
+    return $s;
+}
+
+$d = 5;
+echo week() . "\n";
+for ($i = 0; $i < 3; $i++) {
+    echo twice(twice($i)) . " " . $d . "\n";
+}
+echo where() . "\n";
+echo countdown(4) . "\n";
@@ -0,0 +1,40 @@
+<?php
+function classify($n) {
+    if ($n < 10) {
+        if ($n < 5) {
+            if ($n == 0) {
+                $r = "zero";
+            } else {
+                $r = "small";
+            }
+        } else {
+            $r = "medium";
+        }
+    } else {
+        if ($n > 100) {
+            $r = "huge";
+        } else {
+            $r = "large";
+        }
+    }
+    return $r;
+}
+
+$total = 0;
+for ($i = 0; $i < 12; $i = $i + 3) {
+    $j = 0;
+    while ($j < $i) {
+        if ($j == 2) {
+        } else {
+            $total = $total + $j;
+        }
+        $j++;
+    }
+    echo $i . " " . classify($i) . " " . $total . "\n";
+}
+echo classify(500) . "\n";
+if (1 < 2) {
+}
+for ($k = 0; false; $k++) {
+}
+echo "done\n";
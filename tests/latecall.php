@@ -0,0 +1,23 @@
+<?php
+
+$greeting = "Hello";
+echo $greeting . "\n";
+
+function outer($n) {
+    return inner($n) + 1;
+}
+
+// Both callees of this loop are declared further down
+for ($i = 0; $i < 3; ++$i) {
+    echo $greeting . " " . outer($i) . " " . later($i) . "\n";
+}
+
+function inner($n) {
+    return $n * 10;
+}
+
+echo "after\n";
+
+function later($n) {
+    return $n . "!";
+}
@@ -0,0 +1,33 @@
+<?php
+
+function rows($n, $width) {
+    const PREFIX = "row";
+    $out = "";
+    $i = 0;
+    while ($i < $n) {
+        $out = $out . PREFIX . ($width * 2 + 1) . ":" . $i . " ";
+        $i++;
+    }
+    return $out;
+}
+
+function rebased($n) {
+    $base = 10;
+    $sum = 0;
+    for ($i = 0; $i < $n; $i++) {
+        $sum = $sum + ($base + 5);
+        $base = $base + 1;
+    }
+    return $sum;
+}
+
+echo rows(3, 4) . "\n";
+echo "[" . rows(0, 4) . "]\n";
+echo rebased(3) . "\n";
+
+$x = 7;
+$total = 0;
+for ($j = 0; $j < 4; $j++) {
+    $total = $total + $x * $x;
+}
+echo $total . "\n";
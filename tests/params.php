@@ -0,0 +1,17 @@
+<?php
+function show($a, $b, $c)
+{
+    $d = $a . "-" . $b . "-" . $c;
+    echo $d . "\n";
+    $a = $a + 10;
+    return $a;
+}
+
+$x = show(1, 2, 3);
+echo $x . "\n";
+$i = 0;
+while ($i < 3) {
+    $x = show($i, $x, "z");
+    $i++;
+}
+echo $x . "\n";
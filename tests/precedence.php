@@ -0,0 +1,27 @@
+<?php
+
+function f($x) {
+    echo $x;
+    return $x;
+}
+
+echo 1 + 2 * 3 . "\n";
+echo 2 * 3 - 4 * 5 . "\n";
+echo 10 - 4 - 3 . "\n";
+echo 100 / 10 / 5 . "\n";
+echo (1 << 2 + 1) . "\n";
+echo (2 + 3 > 4) . "\n";
+echo (1 < 2 == 2 > 1) . "\n";
+echo !0 + 1 . "\n";
+
+$i = 1;
+echo $i++ + 10 . "\n";
+echo $i . "\n";
+
+if (1 == 1 && 2 == 3 || 4 == 4) {
+    echo "|| binds weakest\n";
+}
+
+if (f(2) > f(1)) {
+    echo " operands run left to right\n";
+}
@@ -0,0 +1,58 @@
+<?php
+
+function shape($a, $b) {
+    $debug = 0;
+    $scale = 4;
+    $c = $a;
+    $unused = $a * 3;
+    if ($debug) {
+        echo "debugging\n";
+    }
+    $x = ($a + $b) * ($a - $b) + $scale * 2;
+    $y = ($a + $b) * ($a - $b) - $c;
+    return $x . "," . $y . "," . $scale * $scale;
+}
+
+function merge($flag) {
+    if ($flag) {
+        $k = 10;
+    } else {
+        $k = 10;
+    }
+    $name = "k";
+    return $name . "=" . ($k + 1);
+}
+
+function count_up($n) {
+    $step = 2;
+    $i = 0;
+    $sum = 0;
+    while ($i < $n) {
+        $sum = $sum + $step;
+        $step = 3;
+        $i++;
+    }
+    return $sum;
+}
+
+function bump($n) {
+    $b = 16;
+    if ($n) {
+        $x = $b++ * 2;
+        echo $x . " ";
+    }
+    $y = $b-- + $b;
+    return $y . " " . $b;
+}
+
+echo shape(7, 3) . "\n";
+echo merge(true) . " " . merge(false) . "\n";
+echo count_up(0) . " " . count_up(1) . " " . count_up(4) . "\n";
+
+$limit = 3;
+$total = 0;
+for ($j = 0; $j < $limit; $j++) {
+    $total = $total + $limit * 2;
+}
+echo $total . "\n";
+echo bump(1) . "\n";
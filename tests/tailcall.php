@@ -0,0 +1,47 @@
+<?php
+
+function sum($n, $acc) {
+    if ($n == 0) {
+        return $acc;
+    }
+    return sum($n - 1, $acc + $n);
+}
+
+function is_even($n) {
+    if ($n == 0) {
+        return true;
+    }
+    return is_odd($n - 1);
+}
+
+function is_odd($n) {
+    if ($n == 0) {
+        return false;
+    }
+    return is_even($n - 1);
+}
+
+function repeat($s, $n, $acc) {
+    $next = $acc . $s;
+    if ($n < 2) {
+        return $next;
+    }
+    return repeat($s, $n - 1, $next);
+}
+
+function line($n) {
+    if ($n > 0) {
+        return line($n - 1);
+    }
+    return __LINE__;
+}
+
+echo sum(1000000, 0) . "\n";
+if (is_even(1000000)) {
+    echo "even\n";
+}
+if (is_odd(999999)) {
+    echo "odd\n";
+}
+echo repeat("ab", 3, "") . "\n";
+echo line(5) . "\n";
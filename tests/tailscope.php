@@ -0,0 +1,21 @@
+<?php
+
+function countdown($n) {
+    const K = 7;
+    if ($n == 0) {
+        return K;
+    }
+    return countdown($n - 1);
+}
+
+function outer($n) {
+    const Q = 9;
+    return inner($n);
+}
+
+function inner($n) {
+    return "[" . Q . "]";
+}
+
+echo countdown(3) . "\n";
+echo outer(1) . "\n";
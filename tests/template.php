@@ -0,0 +1,11 @@
+<ul>
+<?php
+for ($i = 0; $i < 3; ++$i) { ?>
+  <li class="row"><?php echo $i; ?></li>
+<?php }
+if ($i == 3) { ?>
+  <li>done after <?php echo $i ?> rows</li>
+<?php } ?>
+</ul>
+line <?php echo __LINE__; ?>
+
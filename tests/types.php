@@ -0,0 +1,41 @@
+<?php
+
+function total($n) {
+    $sum = 0;
+    for ($i = 0; $i < $n; $i++) {
+        $sum = $sum + $i * 3 - 1;
+    }
+    return $sum;
+}
+echo total(10) . "\n";
+echo total("4") . "\n";
+
+function grow($x) {
+    $y = 1;
+    while ($y < 100) {
+        $y = $y * $x;
+    }
+    return $y;
+}
+echo grow(3) . "\n";
+
+function flip($n) {
+    $r = 0;
+    for ($i = 0; $i < $n; $i++) {
+        if ($i == 2) {
+            $r = "10";
+        }
+        $r = $r + 1;
+    }
+    return $r;
+}
+echo flip(4) . "\n";
+
+$v = 5;
+$v = $v . "1";
+echo $v + 1;
+echo "\n";
+
+$a = 7;
+$b = 2;
+echo ($a > $b) . "|" . ($a <= $b) . "|" . ($a - $b) . "\n";